@@ -0,0 +1,1318 @@
+/* buffer.c */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "buffer.h"
+#include "store.h"
+
+enum hed_piece_source {
+  HED_PIECE_ORIG,
+  HED_PIECE_ADD,
+};
+
+struct hed_piece {
+  struct hed_piece *left;
+  struct hed_piece *right;
+  uint32_t prio;
+  enum hed_piece_source source;
+  size_t off;
+  size_t len;
+  size_t sum;           // total length of this subtree
+};
+
+struct hed_snapshot_piece {
+  size_t pos;
+  enum hed_piece_source source;
+  size_t off;
+  size_t len;
+};
+
+/*
+ * A range of the original data or the add buffer.
+ */
+struct hed_piece_ref {
+  enum hed_piece_source source;
+  size_t off;
+  size_t len;
+};
+
+struct hed_ref_list {
+  struct hed_piece_ref *refs;
+  size_t num;
+  size_t cap;
+};
+
+/*
+ * One step of the undo history: at 'pos', 'old_len' bytes made of
+ * the pieces in 'old' were replaced by 'new_len' bytes made of the
+ * pieces in 'new'.  Entries only point to data, so they take the same
+ * memory however many bytes they cover.  The add data they point to
+ * must never be overwritten: that's why starting an entry freezes the
+ * add buffer (see overwrite_add_tail()).
+ */
+struct hed_undo_entry {
+  bool deletion;
+  size_t pos;
+  size_t old_len;
+  size_t new_len;
+  struct hed_ref_list old;
+  struct hed_ref_list new;
+};
+
+// stop merging changes into an entry when it gets this big
+#define UNDO_MAX_MERGE_LEN  (64*1024)
+
+#define PIECE_SUM(p)  ((p) ? (p)->sum : 0)
+
+static uint32_t next_prio(struct hed_buffer *buf)
+{
+  // xorshift32
+  uint32_t x = buf->prio_seed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  buf->prio_seed = x;
+  return x;
+}
+
+static void update_piece(struct hed_piece *p)
+{
+  p->sum = PIECE_SUM(p->left) + p->len + PIECE_SUM(p->right);
+}
+
+/*
+ * Make sure there are at least 'n' pieces in the free list, so the
+ * tree operations that follow can't fail halfway through.
+ */
+static int reserve_pieces(struct hed_buffer *buf, size_t n)
+{
+  size_t have = 0;
+  for (struct hed_piece *p = buf->free_pieces; p && have < n; p = p->right)
+    have++;
+  while (have < n) {
+    struct hed_piece *p = malloc(sizeof(struct hed_piece));
+    if (! p)
+      return -1;
+    p->right = buf->free_pieces;
+    buf->free_pieces = p;
+    have++;
+  }
+  return 0;
+}
+
+static struct hed_piece *new_piece(struct hed_buffer *buf, enum hed_piece_source source, size_t off, size_t len, uint32_t prio)
+{
+  struct hed_piece *p = buf->free_pieces;
+  buf->free_pieces = p->right;
+  p->left = NULL;
+  p->right = NULL;
+  p->prio = prio;
+  p->source = source;
+  p->off = off;
+  p->len = len;
+  p->sum = len;
+  buf->num_pieces++;
+  return p;
+}
+
+static void release_pieces(struct hed_buffer *buf, struct hed_piece *p)
+{
+  if (! p)
+    return;
+  release_pieces(buf, p->left);
+  release_pieces(buf, p->right);
+  free(p);
+  buf->num_pieces--;
+}
+
+/*
+ * Split the tree 't' at byte position 'pos': the first 'pos' bytes
+ * go to 'l', the rest go to 'r'.  If 'pos' falls inside a piece,
+ * the piece is split in two (this takes one piece from the free
+ * list).
+ */
+static void split_pieces(struct hed_buffer *buf, struct hed_piece *t, size_t pos, struct hed_piece **l, struct hed_piece **r)
+{
+  if (! t) {
+    *l = *r = NULL;
+    return;
+  }
+
+  size_t left_sum = PIECE_SUM(t->left);
+  if (pos <= left_sum) {
+    split_pieces(buf, t->left, pos, l, &t->left);
+    update_piece(t);
+    *r = t;
+  } else if (pos >= left_sum + t->len) {
+    split_pieces(buf, t->right, pos - left_sum - t->len, &t->right, r);
+    update_piece(t);
+    *l = t;
+  } else {
+    size_t k = pos - left_sum;
+    struct hed_piece *n = new_piece(buf, t->source, t->off + k, t->len - k, t->prio);
+    t->len = k;
+    n->right = t->right;
+    t->right = NULL;
+    update_piece(n);
+    update_piece(t);
+    *l = t;
+    *r = n;
+  }
+}
+
+static struct hed_piece *merge_pieces(struct hed_piece *l, struct hed_piece *r)
+{
+  if (! l) return r;
+  if (! r) return l;
+  if (l->prio >= r->prio) {
+    l->right = merge_pieces(l->right, r);
+    update_piece(l);
+    return l;
+  }
+  r->left = merge_pieces(l, r->left);
+  update_piece(r);
+  return r;
+}
+
+static struct hed_piece *find_piece(struct hed_buffer *buf, size_t pos, size_t *piece_pos)
+{
+  struct hed_piece *p = buf->root;
+  size_t start = 0;
+  while (p) {
+    size_t left_sum = PIECE_SUM(p->left);
+    if (pos < start + left_sum)
+      p = p->left;
+    else if (pos < start + left_sum + p->len) {
+      *piece_pos = start + left_sum;
+      return p;
+    } else {
+      start += left_sum + p->len;
+      p = p->right;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Get a pointer to the data at offset 'off' of a piece and return
+ * the number of bytes that can be read contiguously from it.
+ */
+static size_t get_source_data(struct hed_store *orig, uint8_t **add_chunks, enum hed_piece_source source,
+                              size_t piece_off, size_t piece_len, size_t off, const uint8_t **data)
+{
+  if (source == HED_PIECE_ORIG) {
+    size_t len = hed_store_get_span(orig, piece_off + off, data);
+    return (len < piece_len - off) ? len : piece_len - off;
+  }
+  size_t add_off = piece_off + off;
+  *data = add_chunks[add_off / HED_ADD_CHUNK_SIZE] + add_off % HED_ADD_CHUNK_SIZE;
+  return piece_len - off;
+}
+
+static size_t get_piece_data(struct hed_buffer *buf, struct hed_piece *p, size_t off, const uint8_t **data)
+{
+  return get_source_data(buf->orig, buf->add_chunks, p->source, p->off, p->len, off, data);
+}
+
+/*
+ * Add a reference to 'len' bytes of a source to a list, extending the
+ * last one if the data is contiguous (but not across add chunks, since
+ * the references become pieces again on undo).
+ */
+static int add_ref(struct hed_ref_list *list, enum hed_piece_source source, size_t off, size_t len)
+{
+  if (list->num > 0) {
+    struct hed_piece_ref *last = &list->refs[list->num-1];
+    if (last->source == source && last->off + last->len == off
+        && ! (source == HED_PIECE_ADD && off % HED_ADD_CHUNK_SIZE == 0)) {
+      last->len += len;
+      return 0;
+    }
+  }
+  if (list->num == list->cap) {
+    size_t cap = (list->cap == 0) ? 4 : 2 * list->cap;
+    struct hed_piece_ref *refs = realloc(list->refs, cap * sizeof(struct hed_piece_ref));
+    if (! refs)
+      return -1;
+    list->refs = refs;
+    list->cap = cap;
+  }
+  list->refs[list->num].source = source;
+  list->refs[list->num].off = off;
+  list->refs[list->num].len = len;
+  list->num++;
+  return 0;
+}
+
+/*
+ * Add references to the data of 'len' bytes at 'pos' to a list.
+ */
+static int collect_refs(struct hed_buffer *buf, size_t pos, size_t len, struct hed_ref_list *list)
+{
+  size_t end = pos + len;
+  while (pos < end) {
+    size_t piece_pos;
+    struct hed_piece *p = find_piece(buf, pos, &piece_pos);
+    if (! p)
+      break;
+    size_t n = piece_pos + p->len - pos;
+    if (n > end - pos)
+      n = end - pos;
+    if (add_ref(list, p->source, p->off + (pos - piece_pos), n) < 0)
+      return -1;
+    pos += n;
+  }
+  return 0;
+}
+
+static void free_undo_entry(struct hed_undo_entry *entry)
+{
+  free(entry->old.refs);
+  free(entry->new.refs);
+}
+
+/*
+ * Forget the undo entries from 'num' on.
+ */
+static void truncate_undo(struct hed_buffer *buf, size_t num)
+{
+  while (buf->undo_len > num)
+    free_undo_entry(&buf->undo[--buf->undo_len]);
+  if (buf->undo_pos > num)
+    buf->undo_pos = num;
+  if (buf->undo_clean > num)
+    buf->undo_clean = SIZE_MAX;
+  buf->undo_open = false;
+}
+
+/*
+ * Start recording the replacement of 'del_len' bytes at 'pos' by
+ * 'len' bytes, before it's made.  A change touching the range
+ * changed by the last entry (like typing consecutive bytes, or the
+ * second nibble of a byte) is merged into it if both are deletions
+ * or both are not, so 'entry' is then the merged entry.
+ * Returns 1 if merged, 0 if not and -1 on errors.
+ */
+static int begin_undo_entry(struct hed_buffer *buf, size_t pos, size_t del_len, size_t len, struct hed_undo_entry *entry)
+{
+  memset(entry, 0, sizeof(struct hed_undo_entry));
+  struct hed_undo_entry *last = (buf->undo_pos > 0) ? &buf->undo[buf->undo_pos-1] : NULL;
+  entry->deletion = (len == 0);
+  if (last && buf->undo_open && buf->undo_clean != buf->undo_pos
+      && last->deletion == entry->deletion && last->old_len + last->new_len < UNDO_MAX_MERGE_LEN
+      && pos <= last->pos + last->new_len && pos + del_len >= last->pos) {
+    size_t last_end = last->pos + last->new_len;
+    size_t before = (pos < last->pos) ? last->pos - pos : 0;
+    size_t after = (pos + del_len > last_end) ? pos + del_len - last_end : 0;
+    entry->pos = (pos < last->pos) ? pos : last->pos;
+    entry->old_len = last->old_len + before + after;
+    entry->new_len = last->new_len + before + after - del_len + len;
+    if (collect_refs(buf, pos, before, &entry->old) < 0)
+      goto err;
+    for (size_t i = 0; i < last->old.num; i++) {
+      struct hed_piece_ref *ref = &last->old.refs[i];
+      if (add_ref(&entry->old, ref->source, ref->off, ref->len) < 0)
+        goto err;
+    }
+    if (collect_refs(buf, last_end, after, &entry->old) < 0)
+      goto err;
+    return 1;
+  }
+
+  truncate_undo(buf, buf->undo_pos);
+  if (buf->undo_len == buf->undo_cap) {
+    size_t cap = (buf->undo_cap == 0) ? 16 : 2 * buf->undo_cap;
+    struct hed_undo_entry *undo = realloc(buf->undo, cap * sizeof(struct hed_undo_entry));
+    if (! undo)
+      return -1;
+    buf->undo = undo;
+    buf->undo_cap = cap;
+  }
+  entry->pos = pos;
+  entry->old_len = del_len;
+  entry->new_len = len;
+  if (collect_refs(buf, pos, del_len, &entry->old) < 0)
+    goto err;
+  buf->add_frozen = buf->add_len;
+  return 0;
+
+ err:
+  free_undo_entry(entry);
+  return -1;
+}
+
+/*
+ * Finish recording a change after it's made.  If that fails, the
+ * history no longer matches the data, so it's dropped.
+ */
+static void end_undo_entry(struct hed_buffer *buf, struct hed_undo_entry *entry, bool merged)
+{
+  if (collect_refs(buf, entry->pos, entry->new_len, &entry->new) < 0) {
+    free_undo_entry(entry);
+    truncate_undo(buf, 0);
+    buf->undo_clean = SIZE_MAX;
+    return;
+  }
+  if (merged)
+    free_undo_entry(&buf->undo[buf->undo_pos-1]);
+  else
+    buf->undo_len = ++buf->undo_pos;
+  buf->undo[buf->undo_pos-1] = *entry;
+  buf->undo_open = true;
+}
+
+/*
+ * Create a buffer with the original data from the store 'orig' (which
+ * may be NULL for an empty buffer).  The buffer takes ownership of the
+ * store.
+ */
+struct hed_buffer *hed_new_buffer(struct hed_store *orig)
+{
+  struct hed_buffer *buf = malloc(sizeof(struct hed_buffer));
+  if (! buf)
+    return NULL;
+  buf->orig = orig;
+  buf->add_chunks = NULL;
+  buf->add_num_chunks = 0;
+  buf->add_len = 0;
+  buf->add_frozen = 0;
+  buf->root = NULL;
+  buf->free_pieces = NULL;
+  buf->num_pieces = 0;
+  buf->len = 0;
+  buf->prio_seed = 0x9e3779b9;
+  buf->generation = 0;
+  buf->num_snapshots = 0;
+  buf->changes_generation = (unsigned int) -1;
+  buf->changes.extents = NULL;
+  buf->changes.num_extents = 0;
+  buf->changes.cap = 0;
+  buf->changes.num_bytes = 0;
+  buf->holes_generation = (unsigned int) -1;
+  buf->holes.extents = NULL;
+  buf->holes.num_extents = 0;
+  buf->holes.cap = 0;
+  buf->holes.num_bytes = 0;
+  buf->undo = NULL;
+  buf->undo_len = 0;
+  buf->undo_pos = 0;
+  buf->undo_cap = 0;
+  buf->undo_clean = 0;
+  buf->undo_open = false;
+
+  if (orig && orig->len > 0) {
+    if (reserve_pieces(buf, 1) < 0) {
+      free(buf);
+      return NULL;
+    }
+    buf->root = new_piece(buf, HED_PIECE_ORIG, 0, orig->len, next_prio(buf));
+    buf->len = orig->len;
+  }
+  return buf;
+}
+
+void hed_free_buffer(struct hed_buffer *buf)
+{
+  release_pieces(buf, buf->root);
+  while (buf->free_pieces) {
+    struct hed_piece *next = buf->free_pieces->right;
+    free(buf->free_pieces);
+    buf->free_pieces = next;
+  }
+  for (size_t i = 0; i < buf->add_num_chunks; i++)
+    free(buf->add_chunks[i]);
+  free(buf->add_chunks);
+  if (buf->orig)
+    hed_free_store(buf->orig);
+  truncate_undo(buf, 0);
+  free(buf->undo);
+  free(buf->changes.extents);
+  free(buf->holes.extents);
+  free(buf);
+}
+
+bool hed_buffer_get_span(struct hed_buffer *buf, size_t pos, struct hed_span *span)
+{
+  size_t piece_pos;
+  struct hed_piece *p = find_piece(buf, pos, &piece_pos);
+  span->pos = pos;
+  span->len = (p) ? get_piece_data(buf, p, pos - piece_pos, &span->data) : 0;
+  if (span->len == 0) {
+    span->data = NULL;
+    return false;
+  }
+  return true;
+}
+
+size_t hed_buffer_read(struct hed_buffer *buf, size_t pos, uint8_t *data, size_t len)
+{
+  size_t n_read = 0;
+  struct hed_span span;
+  while (n_read < len && hed_buffer_get_span(buf, pos + n_read, &span)) {
+    size_t n = (span.len < len - n_read) ? span.len : len - n_read;
+    memcpy(data + n_read, span.data, n);
+    n_read += n;
+  }
+  return n_read;
+}
+
+bool hed_buffer_get_piece(struct hed_buffer *buf, size_t pos, struct hed_piece_info *info)
+{
+  size_t piece_pos;
+  struct hed_piece *p = find_piece(buf, pos, &piece_pos);
+  if (! p)
+    return false;
+  info->pos = piece_pos;
+  info->len = p->len;
+  info->from_orig = (p->source == HED_PIECE_ORIG);
+  info->orig_off = p->off;
+  return true;
+}
+
+/*
+ * Append data to the add buffer, allocating new chunks as needed.
+ * Pieces never cross chunk boundaries, so the data of a piece is
+ * always contiguous in memory.
+ */
+static int append_add_data(struct hed_buffer *buf, const uint8_t *data, size_t len)
+{
+  size_t need_chunks = (buf->add_len + len + HED_ADD_CHUNK_SIZE - 1) / HED_ADD_CHUNK_SIZE;
+  if (need_chunks > buf->add_num_chunks) {
+    uint8_t **chunks = realloc(buf->add_chunks, need_chunks * sizeof(uint8_t *));
+    if (! chunks)
+      return -1;
+    buf->add_chunks = chunks;
+    while (buf->add_num_chunks < need_chunks) {
+      uint8_t *chunk = malloc(HED_ADD_CHUNK_SIZE);
+      if (! chunk)
+        return -1;
+      buf->add_chunks[buf->add_num_chunks++] = chunk;
+    }
+  }
+
+  size_t pos = 0;
+  while (pos < len) {
+    size_t chunk_off = (buf->add_len + pos) % HED_ADD_CHUNK_SIZE;
+    size_t n = HED_ADD_CHUNK_SIZE - chunk_off;
+    if (n > len - pos)
+      n = len - pos;
+    memcpy(buf->add_chunks[(buf->add_len + pos) / HED_ADD_CHUNK_SIZE] + chunk_off, data + pos, n);
+    pos += n;
+  }
+  return 0;
+}
+
+/*
+ * Try to extend the last piece of the tree 't' by 'len' bytes
+ * starting at 'add_off' in the add buffer.  This works when the
+ * piece ends exactly where the new data starts (for example, when
+ * typing over consecutive bytes), and keeps the number of pieces
+ * from growing with every key press.
+ */
+static size_t extend_last_piece(struct hed_piece *t, size_t add_off, size_t len)
+{
+  if (! t)
+    return 0;
+  struct hed_piece *last = t;
+  while (last->right)
+    last = last->right;
+  if (last->source != HED_PIECE_ADD || last->off + last->len != add_off || add_off % HED_ADD_CHUNK_SIZE == 0)
+    return 0;
+
+  size_t n = HED_ADD_CHUNK_SIZE - add_off % HED_ADD_CHUNK_SIZE;
+  if (n > len)
+    n = len;
+  for (struct hed_piece *p = t; p; p = p->right) {
+    if (p == last)
+      p->len += n;
+    p->sum += n;
+  }
+  return n;
+}
+
+/*
+ * Overwrite data in place if it's the tail of the add buffer and
+ * nothing else can be referencing it (typically, the second nibble
+ * of a byte typed in the hex pane).
+ */
+static bool overwrite_add_tail(struct hed_buffer *buf, size_t pos, const uint8_t *data, size_t len)
+{
+  size_t piece_pos;
+  struct hed_piece *p = find_piece(buf, pos, &piece_pos);
+  if (! p || p->source != HED_PIECE_ADD)
+    return false;
+  size_t off = p->off + (pos - piece_pos);
+  if (pos + len != piece_pos + p->len || off + len != buf->add_len || off < buf->add_frozen)
+    return false;
+  if (off / HED_ADD_CHUNK_SIZE != (off + len - 1) / HED_ADD_CHUNK_SIZE)
+    return false;
+  memcpy(buf->add_chunks[off / HED_ADD_CHUNK_SIZE] + off % HED_ADD_CHUNK_SIZE, data, len);
+  return true;
+}
+
+static int replace_data(struct hed_buffer *buf, size_t pos, size_t del_len, const uint8_t *data, size_t len)
+{
+  if (del_len == len && overwrite_add_tail(buf, pos, data, len)) {
+    buf->generation++;
+    return 0;
+  }
+
+  // worst case: two splits plus one new piece per add chunk touched
+  if (reserve_pieces(buf, 4 + len / HED_ADD_CHUNK_SIZE) < 0)
+    return -1;
+  size_t add_off = buf->add_len;
+  if (len > 0 && append_add_data(buf, data, len) < 0)
+    return -1;
+  buf->add_len += len;
+
+  struct hed_piece *left, *mid, *right;
+  split_pieces(buf, buf->root, pos, &left, &right);
+  split_pieces(buf, right, del_len, &mid, &right);
+  release_pieces(buf, mid);
+
+  size_t done = extend_last_piece(left, add_off, len);
+  while (done < len) {
+    size_t n = HED_ADD_CHUNK_SIZE - (add_off + done) % HED_ADD_CHUNK_SIZE;
+    if (n > len - done)
+      n = len - done;
+    struct hed_piece *p = new_piece(buf, HED_PIECE_ADD, add_off + done, n, next_prio(buf));
+    left = merge_pieces(left, p);
+    done += n;
+  }
+  buf->root = merge_pieces(left, right);
+  buf->len = buf->len - del_len + len;
+  buf->generation++;
+  return 0;
+}
+
+/*
+ * Replace 'del_len' bytes at 'pos' with the data of a list of
+ * references (used to undo and redo changes).
+ */
+static int replace_with_refs(struct hed_buffer *buf, size_t pos, size_t del_len, const struct hed_ref_list *list)
+{
+  if (reserve_pieces(buf, 2 + list->num) < 0)
+    return -1;
+  struct hed_piece *left, *mid, *right;
+  split_pieces(buf, buf->root, pos, &left, &right);
+  split_pieces(buf, right, del_len, &mid, &right);
+  release_pieces(buf, mid);
+
+  size_t len = 0;
+  for (size_t i = 0; i < list->num; i++) {
+    const struct hed_piece_ref *ref = &list->refs[i];
+    left = merge_pieces(left, new_piece(buf, ref->source, ref->off, ref->len, next_prio(buf)));
+    len += ref->len;
+  }
+  buf->root = merge_pieces(left, right);
+  buf->len = buf->len - del_len + len;
+  buf->generation++;
+  return 0;
+}
+
+int hed_buffer_replace(struct hed_buffer *buf, size_t pos, size_t del_len, const uint8_t *data, size_t len)
+{
+  if (pos > buf->len)
+    return -1;
+  if (del_len > buf->len - pos)
+    del_len = buf->len - pos;
+  if (del_len == 0 && len == 0)
+    return 0;
+
+  struct hed_undo_entry entry;
+  int merged = begin_undo_entry(buf, pos, del_len, len, &entry);
+  if (merged < 0)
+    return -1;
+  if (replace_data(buf, pos, del_len, data, len) < 0) {
+    free_undo_entry(&entry);
+    return -1;
+  }
+  end_undo_entry(buf, &entry, merged);
+  return 0;
+}
+
+int hed_buffer_insert(struct hed_buffer *buf, size_t pos, const uint8_t *data, size_t len)
+{
+  return hed_buffer_replace(buf, pos, 0, data, len);
+}
+
+int hed_buffer_delete(struct hed_buffer *buf, size_t pos, size_t len)
+{
+  return hed_buffer_replace(buf, pos, len, NULL, 0);
+}
+
+/*
+ * Append 'len' bytes at offset 'off' of the original data to the end
+ * of the buffer.  Used when the original data is a stream that keeps
+ * growing.
+ */
+int hed_buffer_append_orig(struct hed_buffer *buf, size_t off, size_t len)
+{
+  if (len == 0)
+    return 0;
+
+  struct hed_piece *last = buf->root;
+  while (last && last->right)
+    last = last->right;
+  if (last && last->source == HED_PIECE_ORIG && last->off + last->len == off) {
+    for (struct hed_piece *p = buf->root; p; p = p->right) {
+      if (p == last)
+        p->len += len;
+      p->sum += len;
+    }
+  } else {
+    if (reserve_pieces(buf, 1) < 0)
+      return -1;
+    struct hed_piece *p = new_piece(buf, HED_PIECE_ORIG, off, len, next_prio(buf));
+    buf->root = merge_pieces(buf->root, p);
+  }
+  buf->len += len;
+  buf->generation++;
+  return 0;
+}
+
+/*
+ * Undo the last change, setting 'pos' to where it was.  Returns 0 if
+ * there's nothing to undo, 1 if a change was undone and -1 on errors.
+ */
+int hed_buffer_undo(struct hed_buffer *buf, size_t *pos)
+{
+  if (buf->undo_pos == 0)
+    return 0;
+  struct hed_undo_entry *entry = &buf->undo[buf->undo_pos-1];
+  if (replace_with_refs(buf, entry->pos, entry->new_len, &entry->old) < 0)
+    return -1;
+  buf->undo_pos--;
+  buf->undo_open = false;
+  *pos = entry->pos;
+  return 1;
+}
+
+/*
+ * Redo the last undone change, like hed_buffer_undo().
+ */
+int hed_buffer_redo(struct hed_buffer *buf, size_t *pos)
+{
+  if (buf->undo_pos == buf->undo_len)
+    return 0;
+  struct hed_undo_entry *entry = &buf->undo[buf->undo_pos];
+  if (replace_with_refs(buf, entry->pos, entry->old_len, &entry->new) < 0)
+    return -1;
+  buf->undo_pos++;
+  buf->undo_open = false;
+  *pos = entry->pos;
+  return 1;
+}
+
+/*
+ * Record whether the data now matches the file (after it's saved),
+ * so undoing or redoing back to this point can tell.
+ */
+void hed_buffer_mark_clean(struct hed_buffer *buf, bool clean)
+{
+  buf->undo_clean = (clean) ? buf->undo_pos : SIZE_MAX;
+  buf->undo_open = false;
+}
+
+/*
+ * Make the next change start a new undo entry instead of joining the
+ * last one.
+ */
+void hed_buffer_close_undo(struct hed_buffer *buf)
+{
+  buf->undo_open = false;
+}
+
+bool hed_buffer_is_clean(struct hed_buffer *buf)
+{
+  return buf->undo_clean == buf->undo_pos;
+}
+
+/*
+ * Add a range to the end of an extent set, merging it with the last
+ * extent if they touch.  Ranges must be added in order.
+ */
+int hed_add_extent(struct hed_extent_set *set, size_t pos, size_t len)
+{
+  if (len == 0)
+    return 0;
+  set->num_bytes += len;
+  if (set->num_extents > 0) {
+    struct hed_extent *last = &set->extents[set->num_extents-1];
+    if (last->pos + last->len >= pos) {
+      if (pos + len > last->pos + last->len) {
+        set->num_bytes -= (last->pos + last->len) - pos;
+        last->len = pos + len - last->pos;
+      } else
+        set->num_bytes -= len;
+      return 0;
+    }
+  }
+  if (set->num_extents == set->cap) {
+    size_t cap = (set->cap == 0) ? 16 : 2 * set->cap;
+    struct hed_extent *extents = realloc(set->extents, cap * sizeof(struct hed_extent));
+    if (! extents)
+      return -1;
+    set->extents = extents;
+    set->cap = cap;
+  }
+  set->extents[set->num_extents].pos = pos;
+  set->extents[set->num_extents].len = len;
+  set->num_extents++;
+  return 0;
+}
+
+void hed_clear_extent_set(struct hed_extent_set *set)
+{
+  set->num_extents = 0;
+  set->num_bytes = 0;
+}
+
+static int collect_changes(struct hed_buffer *buf, struct hed_piece *p, size_t start)
+{
+  if (! p)
+    return 0;
+  size_t pos = start + PIECE_SUM(p->left);
+  if (collect_changes(buf, p->left, start) < 0)
+    return -1;
+  if (p->source != HED_PIECE_ORIG || p->off != pos) {
+    if (p->source == HED_PIECE_ORIG)
+      buf->changes_in_place = false;
+    if (hed_add_extent(&buf->changes, pos, p->len) < 0)
+      return -1;
+  }
+  return collect_changes(buf, p->right, pos + p->len);
+}
+
+/*
+ * Return the set of ranges of the buffer that don't come from the
+ * original data at the same position, which is what has to be
+ * written to turn the original file into the buffer contents.  The
+ * set is recomputed from the pieces only when the buffer changed.
+ */
+const struct hed_extent_set *hed_buffer_get_changes(struct hed_buffer *buf)
+{
+  if (buf->changes_generation != buf->generation) {
+    hed_clear_extent_set(&buf->changes);
+    buf->changes_in_place = true;
+    if (collect_changes(buf, buf->root, 0) < 0)
+      return NULL;
+    buf->changes_generation = buf->generation;
+  }
+  return &buf->changes;
+}
+
+static int collect_holes(struct hed_buffer *buf, struct hed_piece *p, size_t start)
+{
+  if (! p)
+    return 0;
+  size_t pos = start + PIECE_SUM(p->left);
+  if (collect_holes(buf, p->left, start) < 0)
+    return -1;
+  if (p->source == HED_PIECE_ORIG) {
+    size_t off = 0;
+    while (off < p->len) {
+      bool is_hole;
+      size_t run = hed_store_get_run(buf->orig, p->off + off, &is_hole);
+      if (run == 0)
+        break;
+      if (run > p->len - off)
+        run = p->len - off;
+      if (is_hole && hed_add_extent(&buf->holes, pos + off, run) < 0)
+        return -1;
+      off += run;
+    }
+  }
+  return collect_holes(buf, p->right, pos + p->len);
+}
+
+/*
+ * Return the ranges of the buffer that come from holes in the
+ * original data (so they're known to be all zeros without reading
+ * them).  Like the changes, the set is only recomputed when the
+ * buffer changed.
+ */
+const struct hed_extent_set *hed_buffer_get_holes(struct hed_buffer *buf)
+{
+  if (buf->holes_generation != buf->generation) {
+    hed_clear_extent_set(&buf->holes);
+    if (buf->orig && buf->orig->holes && buf->orig->holes->num_extents > 0) {
+      if (collect_holes(buf, buf->root, 0) < 0)
+        return NULL;
+    }
+    buf->holes_generation = buf->generation;
+  }
+  return &buf->holes;
+}
+
+/*
+ * Return the length of the run of hole or data bytes starting at
+ * 'pos', and set 'is_hole' to which one it is.
+ */
+size_t hed_buffer_get_run(struct hed_buffer *buf, size_t pos, bool *is_hole)
+{
+  *is_hole = false;
+  if (pos >= buf->len)
+    return 0;
+  const struct hed_extent_set *holes = hed_buffer_get_holes(buf);
+  if (! holes || holes->num_extents == 0)
+    return buf->len - pos;
+
+  // find the first hole that ends after 'pos'
+  size_t lo = 0, hi = holes->num_extents;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (holes->extents[mid].pos + holes->extents[mid].len <= pos)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == holes->num_extents)
+    return buf->len - pos;
+  const struct hed_extent *hole = &holes->extents[lo];
+  if (hole->pos <= pos) {
+    *is_hole = true;
+    return hole->pos + hole->len - pos;
+  }
+  return hole->pos - pos;
+}
+
+/*
+ * Find the start of the next data extent after 'pos' (or the previous
+ * one before it, if 'backward' is true).  Data extents start at the
+ * start of the buffer and at the end of each hole.
+ */
+bool hed_buffer_find_data(struct hed_buffer *buf, size_t pos, bool backward, size_t *data_pos)
+{
+  const struct hed_extent_set *holes = hed_buffer_get_holes(buf);
+  if (! holes)
+    return false;
+
+  bool found = false;
+  for (size_t i = 0; i <= holes->num_extents; i++) {
+    size_t start;
+    if (i == 0) {
+      if (holes->num_extents > 0 && holes->extents[0].pos == 0)
+        continue;
+      start = 0;
+    } else
+      start = holes->extents[i-1].pos + holes->extents[i-1].len;
+    if (start >= buf->len)
+      break;
+    if (backward && start < pos) {
+      *data_pos = start;
+      found = true;
+    } else if (! backward && start > pos) {
+      *data_pos = start;
+      return true;
+    }
+  }
+  return found;
+}
+
+/*
+ * Prefetch the original data shown in 'len' bytes at 'pos' of the
+ * buffer (or drop it, if 'drop' is true; see hed_store_prefetch()
+ * and hed_store_drop()).  Consecutive pieces that come from
+ * consecutive original data are handled as a single range.  Does
+ * nothing if 'buf' is NULL.
+ */
+void hed_buffer_prefetch(struct hed_buffer *buf, size_t pos, size_t len, bool drop)
+{
+  if (! buf || ! buf->orig || pos >= buf->len)
+    return;
+  size_t end = (len < buf->len - pos) ? pos + len : buf->len;
+  size_t range_off = 0, range_len = 0;
+  while (pos < end) {
+    size_t piece_pos;
+    struct hed_piece *p = find_piece(buf, pos, &piece_pos);
+    if (! p)
+      break;
+    size_t piece_end = (piece_pos + p->len < end) ? piece_pos + p->len : end;
+    if (p->source == HED_PIECE_ORIG) {
+      size_t off = p->off + (pos - piece_pos);
+      if (range_len > 0 && range_off + range_len == off)
+        range_len += piece_end - pos;
+      else {
+        if (range_len > 0) {
+          if (drop)
+            hed_store_drop(buf->orig, range_off, range_len);
+          else
+            hed_store_prefetch(buf->orig, range_off, range_len);
+        }
+        range_off = off;
+        range_len = piece_end - pos;
+      }
+    }
+    pos = piece_end;
+  }
+  if (range_len > 0) {
+    if (drop)
+      hed_store_drop(buf->orig, range_off, range_len);
+    else
+      hed_store_prefetch(buf->orig, range_off, range_len);
+  }
+}
+
+/*
+ * Discard all pieces and make the buffer contain exactly the data
+ * of 'orig' (typically a store for the file the buffer was just
+ * written to).  The old store is freed, and the undo history with
+ * it.  This fails if there are snapshots of the buffer, since they
+ * still use the add data.
+ */
+int hed_buffer_reset(struct hed_buffer *buf, struct hed_store *orig)
+{
+  if (buf->num_snapshots > 0 || reserve_pieces(buf, 1) < 0)
+    return -1;
+  release_pieces(buf, buf->root);
+  buf->root = NULL;
+  for (size_t i = 0; i < buf->add_num_chunks; i++)
+    free(buf->add_chunks[i]);
+  free(buf->add_chunks);
+  buf->add_chunks = NULL;
+  buf->add_num_chunks = 0;
+  buf->add_len = 0;
+  buf->add_frozen = 0;
+  truncate_undo(buf, 0);
+  buf->undo_clean = 0;
+
+  if (buf->orig && buf->orig != orig)
+    hed_free_store(buf->orig);
+  buf->orig = orig;
+  buf->len = 0;
+  if (orig && orig->len > 0) {
+    buf->root = new_piece(buf, HED_PIECE_ORIG, 0, orig->len, next_prio(buf));
+    buf->len = orig->len;
+  }
+  buf->generation++;
+  return 0;
+}
+
+/*
+ * Make 'orig' (a new version of the original file) the original data
+ * of the buffer, keeping the edits.  Pieces of original data keep
+ * their offsets, so the parts that weren't edited show the new data.
+ * Original data past the end of the new store is dropped, and data
+ * past the end of the old one goes after the piece that ended it (or
+ * at the end of the buffer, if that was deleted).  The old store is
+ * freed and the undo history with it, since its entries may point
+ * past the new end.  This fails if there are snapshots of the buffer.
+ */
+int hed_buffer_rebase(struct hed_buffer *buf, struct hed_store *orig)
+{
+  if (buf->num_snapshots > 0)
+    return -1;
+  struct hed_ref_list list = { NULL, 0, 0 };
+  if (collect_refs(buf, 0, buf->len, &list) < 0 || reserve_pieces(buf, list.num + 1) < 0) {
+    free(list.refs);
+    return -1;
+  }
+
+  size_t old_len = (buf->orig) ? buf->orig->len : 0;
+  size_t new_len = orig->len;
+  bool tail_added = (new_len <= old_len);
+  release_pieces(buf, buf->root);
+  buf->root = NULL;
+  buf->len = 0;
+  for (size_t i = 0; i <= list.num; i++) {
+    if (i == list.num) {
+      if (tail_added)
+        break;
+      // the end of the old data was deleted
+      buf->root = merge_pieces(buf->root, new_piece(buf, HED_PIECE_ORIG, old_len, new_len - old_len, next_prio(buf)));
+      buf->len += new_len - old_len;
+      break;
+    }
+    struct hed_piece_ref *ref = &list.refs[i];
+    size_t off = ref->off;
+    size_t len = ref->len;
+    if (ref->source == HED_PIECE_ORIG) {
+      if (off >= new_len)
+        len = 0;
+      else if (len > new_len - off)
+        len = new_len - off;
+      if (! tail_added && off + ref->len == old_len) {
+        len += new_len - old_len;
+        tail_added = true;
+      }
+    }
+    if (len == 0)
+      continue;
+    buf->root = merge_pieces(buf->root, new_piece(buf, ref->source, off, len, next_prio(buf)));
+    buf->len += len;
+  }
+  free(list.refs);
+
+  truncate_undo(buf, 0);
+  buf->undo_clean = SIZE_MAX;
+  if (buf->orig && buf->orig != orig)
+    hed_free_store(buf->orig);
+  buf->orig = orig;
+  buf->generation++;
+  return 0;
+}
+
+/*
+ * Return the index of the first extent of a set that ends after
+ * 'pos'.
+ */
+static size_t find_extent(const struct hed_extent_set *set, size_t pos)
+{
+  size_t lo = 0, hi = set->num_extents;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (set->extents[mid].pos + set->extents[mid].len <= pos)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/*
+ * Copy 'len' bytes at offset 'off' of the original data to the add
+ * buffer, adding references to the copy to a list.
+ */
+static int copy_orig_refs(struct hed_buffer *buf, size_t off, size_t len, struct hed_ref_list *list)
+{
+  size_t done = 0;
+  while (done < len) {
+    const uint8_t *data;
+    size_t n = hed_store_get_span(buf->orig, off + done, &data);
+    if (n == 0)
+      return -1;
+    if (n > len - done)
+      n = len - done;
+    if (append_add_data(buf, data, n) < 0)
+      return -1;
+    size_t copied = 0;
+    while (copied < n) {
+      size_t add_off = buf->add_len + copied;
+      size_t chunk_n = HED_ADD_CHUNK_SIZE - add_off % HED_ADD_CHUNK_SIZE;
+      if (chunk_n > n - copied)
+        chunk_n = n - copied;
+      if (add_ref(list, HED_PIECE_ADD, add_off, chunk_n) < 0)
+        return -1;
+      copied += chunk_n;
+    }
+    buf->add_len += n;
+    done += n;
+  }
+  return 0;
+}
+
+/*
+ * Replace the references to original data inside 'extents' in a list
+ * with references to copies of the data.
+ */
+static int detach_refs(struct hed_buffer *buf, struct hed_ref_list *list, const struct hed_extent_set *extents)
+{
+  struct hed_ref_list detached = { NULL, 0, 0 };
+  for (size_t i = 0; i < list->num; i++) {
+    struct hed_piece_ref *ref = &list->refs[i];
+    size_t off = ref->off;
+    size_t end = ref->off + ref->len;
+    while (off < end) {
+      size_t n = end - off;
+      size_t e = (ref->source == HED_PIECE_ORIG) ? find_extent(extents, off) : extents->num_extents;
+      if (e < extents->num_extents && extents->extents[e].pos <= off) {
+        size_t ext_end = extents->extents[e].pos + extents->extents[e].len;
+        if (n > ext_end - off)
+          n = ext_end - off;
+        if (copy_orig_refs(buf, off, n, &detached) < 0)
+          goto err;
+      } else {
+        if (e < extents->num_extents && n > extents->extents[e].pos - off)
+          n = extents->extents[e].pos - off;
+        if (add_ref(&detached, ref->source, off, n) < 0)
+          goto err;
+      }
+      off += n;
+    }
+  }
+  free(list->refs);
+  *list = detached;
+  return 0;
+
+ err:
+  free(detached.refs);
+  return -1;
+}
+
+/*
+ * Make the undo history stop referring to the original data inside
+ * 'extents', by copying the data it uses from there to the add
+ * buffer.  This is done before the original file is overwritten
+ * there (when saving in place), so undoing past the save still
+ * brings back the old data.  The pieces of the buffer itself must
+ * not refer to the extents.  If this fails, some references may
+ * already point to copies, which is harmless.
+ */
+int hed_buffer_detach_orig(struct hed_buffer *buf, const struct hed_extent_set *extents)
+{
+  if (! buf->orig || extents->num_extents == 0)
+    return 0;
+  for (size_t i = 0; i < buf->undo_len; i++) {
+    struct hed_undo_entry *entry = &buf->undo[i];
+    if (detach_refs(buf, &entry->old, extents) < 0 || detach_refs(buf, &entry->new, extents) < 0)
+      return -1;
+  }
+  buf->add_frozen = buf->add_len;
+  return 0;
+}
+
+/*
+ * Return true if every piece of original data is still at its
+ * original position, which means the buffer can be written over
+ * the original file without clobbering data that hasn't been
+ * written yet.
+ */
+bool hed_buffer_is_in_place(struct hed_buffer *buf)
+{
+  if (! hed_buffer_get_changes(buf))
+    return false;
+  return buf->changes_in_place;
+}
+
+static void flatten_pieces(struct hed_snapshot *snap, struct hed_piece *p, size_t start)
+{
+  if (! p)
+    return;
+  size_t pos = start + PIECE_SUM(p->left);
+  flatten_pieces(snap, p->left, start);
+  struct hed_snapshot_piece *sp = &snap->pieces[snap->num_pieces++];
+  sp->pos = pos;
+  sp->source = p->source;
+  sp->off = p->off;
+  sp->len = p->len;
+  flatten_pieces(snap, p->right, pos + p->len);
+}
+
+static void destroy_snapshot(struct hed_snapshot *snap)
+{
+  free(snap->pieces);
+  free(snap->add_chunks);
+  free(snap->changes.extents);
+  free(snap->holes.extents);
+  free(snap);
+}
+
+/*
+ * Take a read-only snapshot of the buffer contents that stays valid
+ * while the buffer is edited, so it can be read from another thread
+ * (for example, to save the file in the background).  The add data
+ * written so far is frozen, since the snapshot shares it with the
+ * buffer; edits made after this only append to it, and start a new
+ * undo entry.
+ */
+struct hed_snapshot *hed_buffer_snapshot(struct hed_buffer *buf)
+{
+  const struct hed_extent_set *changes = hed_buffer_get_changes(buf);
+  const struct hed_extent_set *holes = hed_buffer_get_holes(buf);
+  if (! changes || ! holes)
+    return NULL;
+
+  struct hed_snapshot *snap = malloc(sizeof(struct hed_snapshot));
+  if (! snap)
+    return NULL;
+  snap->buf = buf;
+  snap->orig = buf->orig;
+  snap->len = buf->len;
+  snap->generation = buf->generation;
+  snap->in_place = buf->changes_in_place;
+  snap->num_pieces = 0;
+  snap->changes.extents = NULL;
+  snap->changes.num_extents = 0;
+  snap->changes.cap = 0;
+  snap->changes.num_bytes = 0;
+  snap->holes.extents = NULL;
+  snap->holes.num_extents = 0;
+  snap->holes.cap = 0;
+  snap->holes.num_bytes = 0;
+  snap->pieces = malloc(((buf->num_pieces > 0) ? buf->num_pieces : 1) * sizeof(struct hed_snapshot_piece));
+  snap->add_chunks = malloc(((buf->add_num_chunks > 0) ? buf->add_num_chunks : 1) * sizeof(uint8_t *));
+  if (! snap->pieces || ! snap->add_chunks) {
+    destroy_snapshot(snap);
+    return NULL;
+  }
+  for (size_t i = 0; i < changes->num_extents; i++) {
+    if (hed_add_extent(&snap->changes, changes->extents[i].pos, changes->extents[i].len) < 0) {
+      destroy_snapshot(snap);
+      return NULL;
+    }
+  }
+  for (size_t i = 0; i < holes->num_extents; i++) {
+    if (hed_add_extent(&snap->holes, holes->extents[i].pos, holes->extents[i].len) < 0) {
+      destroy_snapshot(snap);
+      return NULL;
+    }
+  }
+  if (buf->add_num_chunks > 0)
+    memcpy(snap->add_chunks, buf->add_chunks, buf->add_num_chunks * sizeof(uint8_t *));
+  flatten_pieces(snap, buf->root, 0);
+
+  buf->add_frozen = buf->add_len;
+  buf->undo_open = false;
+  buf->num_snapshots++;
+  return snap;
+}
+
+void hed_free_snapshot(struct hed_snapshot *snap)
+{
+  snap->buf->num_snapshots--;
+  destroy_snapshot(snap);
+}
+
+static struct hed_snapshot_piece *find_snapshot_piece(struct hed_snapshot *snap, size_t pos)
+{
+  if (pos >= snap->len)
+    return NULL;
+  size_t lo = 0, hi = snap->num_pieces;
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (snap->pieces[mid].pos <= pos)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return &snap->pieces[lo];
+}
+
+bool hed_snapshot_get_span(struct hed_snapshot *snap, size_t pos, struct hed_span *span)
+{
+  struct hed_snapshot_piece *p = find_snapshot_piece(snap, pos);
+  span->pos = pos;
+  span->len = (p) ? get_source_data(snap->orig, snap->add_chunks, p->source, p->off, p->len, pos - p->pos, &span->data) : 0;
+  if (span->len == 0) {
+    span->data = NULL;
+    return false;
+  }
+  return true;
+}
+
+bool hed_snapshot_get_piece(struct hed_snapshot *snap, size_t pos, struct hed_piece_info *info)
+{
+  struct hed_snapshot_piece *p = find_snapshot_piece(snap, pos);
+  if (! p)
+    return false;
+  info->pos = p->pos;
+  info->len = p->len;
+  info->from_orig = (p->source == HED_PIECE_ORIG);
+  info->orig_off = p->off;
+  return true;
+}
+
+size_t hed_snapshot_read(struct hed_snapshot *snap, size_t pos, uint8_t *data, size_t len)
+{
+  size_t n_read = 0;
+  struct hed_span span;
+  while (n_read < len && hed_snapshot_get_span(snap, pos + n_read, &span)) {
+    size_t n = (span.len < len - n_read) ? span.len : len - n_read;
+    memcpy(data + n_read, span.data, n);
+    n_read += n;
+  }
+  return n_read;
+}
@@ -0,0 +1,145 @@
+/* buffer.h */
+
+#ifndef BUFFER_H_FILE
+#define BUFFER_H_FILE
+
+#include "hed.h"
+
+#define HED_ADD_CHUNK_SIZE  (64*1024)
+
+struct hed_piece;
+struct hed_snapshot_piece;
+struct hed_undo_entry;
+struct hed_store;
+
+struct hed_extent {
+  size_t pos;
+  size_t len;
+};
+
+/*
+ * Sorted set of non-overlapping, non-adjacent ranges.
+ */
+struct hed_extent_set {
+  struct hed_extent *extents;
+  size_t num_extents;
+  size_t cap;
+  size_t num_bytes;
+};
+
+/*
+ * Piece table: the buffer contents are described by a list of
+ * pieces, each one pointing to a range of either the original data
+ * (which is never modified) or the add buffer (which only grows).
+ * The pieces are kept in a treap ordered by position, so inserting
+ * or deleting anywhere costs O(log pieces).
+ */
+struct hed_buffer {
+  struct hed_store *orig;
+
+  uint8_t **add_chunks;
+  size_t add_num_chunks;
+  size_t add_len;
+  size_t add_frozen;
+
+  struct hed_piece *root;
+  struct hed_piece *free_pieces;
+  size_t num_pieces;
+  size_t len;
+  uint32_t prio_seed;
+
+  unsigned int generation;
+  unsigned int num_snapshots;
+  unsigned int changes_generation;
+  struct hed_extent_set changes;
+  bool changes_in_place;
+
+  unsigned int holes_generation;
+  struct hed_extent_set holes;
+
+  struct hed_undo_entry *undo;
+  size_t undo_len;      // number of entries recorded
+  size_t undo_pos;      // number of entries applied (the rest can be redone)
+  size_t undo_cap;
+  size_t undo_clean;    // 'undo_pos' when the data matched the file, or SIZE_MAX
+  bool undo_open;       // the last entry can take the next change
+};
+
+/*
+ * A contiguous span of buffer data starting at 'pos'.
+ */
+struct hed_span {
+  size_t pos;
+  const uint8_t *data;
+  size_t len;
+};
+
+/*
+ * Description of the piece containing a position: 'len' bytes at
+ * 'pos' come either from offset 'orig_off' of the original data (if
+ * 'from_orig' is true) or from the add buffer.
+ */
+struct hed_piece_info {
+  size_t pos;
+  size_t len;
+  bool from_orig;
+  size_t orig_off;
+};
+
+/*
+ * Frozen copy of the piece list of a buffer, taken with
+ * hed_buffer_snapshot().  'changes' and 'in_place' are the buffer's
+ * changes (see hed_buffer_get_changes()) at the time, and 'holes'
+ * its holes (see hed_buffer_get_holes()).
+ */
+struct hed_snapshot {
+  struct hed_buffer *buf;
+  struct hed_store *orig;
+  uint8_t **add_chunks;
+  struct hed_snapshot_piece *pieces;
+  size_t num_pieces;
+  size_t len;
+  unsigned int generation;
+  struct hed_extent_set changes;
+  bool in_place;
+  struct hed_extent_set holes;
+};
+
+struct hed_buffer *hed_new_buffer(struct hed_store *orig);
+void hed_free_buffer(struct hed_buffer *buf);
+
+bool hed_buffer_get_span(struct hed_buffer *buf, size_t pos, struct hed_span *span);
+size_t hed_buffer_read(struct hed_buffer *buf, size_t pos, uint8_t *data, size_t len);
+bool hed_buffer_get_piece(struct hed_buffer *buf, size_t pos, struct hed_piece_info *info);
+
+int hed_buffer_replace(struct hed_buffer *buf, size_t pos, size_t del_len, const uint8_t *data, size_t len);
+int hed_buffer_insert(struct hed_buffer *buf, size_t pos, const uint8_t *data, size_t len);
+int hed_buffer_delete(struct hed_buffer *buf, size_t pos, size_t len);
+int hed_buffer_append_orig(struct hed_buffer *buf, size_t off, size_t len);
+
+int hed_buffer_undo(struct hed_buffer *buf, size_t *pos);
+int hed_buffer_redo(struct hed_buffer *buf, size_t *pos);
+void hed_buffer_mark_clean(struct hed_buffer *buf, bool clean);
+void hed_buffer_close_undo(struct hed_buffer *buf);
+bool hed_buffer_is_clean(struct hed_buffer *buf);
+
+bool hed_buffer_is_in_place(struct hed_buffer *buf);
+const struct hed_extent_set *hed_buffer_get_changes(struct hed_buffer *buf);
+int hed_buffer_reset(struct hed_buffer *buf, struct hed_store *orig);
+int hed_buffer_rebase(struct hed_buffer *buf, struct hed_store *orig);
+int hed_buffer_detach_orig(struct hed_buffer *buf, const struct hed_extent_set *extents);
+const struct hed_extent_set *hed_buffer_get_holes(struct hed_buffer *buf);
+size_t hed_buffer_get_run(struct hed_buffer *buf, size_t pos, bool *is_hole);
+bool hed_buffer_find_data(struct hed_buffer *buf, size_t pos, bool backward, size_t *data_pos);
+void hed_buffer_prefetch(struct hed_buffer *buf, size_t pos, size_t len, bool drop);
+
+struct hed_snapshot *hed_buffer_snapshot(struct hed_buffer *buf);
+void hed_free_snapshot(struct hed_snapshot *snap);
+bool hed_snapshot_get_span(struct hed_snapshot *snap, size_t pos, struct hed_span *span);
+size_t hed_snapshot_read(struct hed_snapshot *snap, size_t pos, uint8_t *data, size_t len);
+bool hed_snapshot_get_piece(struct hed_snapshot *snap, size_t pos, struct hed_piece_info *info);
+
+int hed_add_extent(struct hed_extent_set *set, size_t pos, size_t len);
+void hed_clear_extent_set(struct hed_extent_set *set);
+
+#endif /* BUFFER_H_FILE */
@@ -7,12 +7,19 @@
 #include <limits.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "editor.h"
 #include "screen.h"
 #include "term.h"
 #include "input.h"
 #include "file.h"
+#include "buffer.h"
+#include "store.h"
+#include "search.h"
 #include "file_sel.h"
 #include "help.h"
 #include "utf8.h"
@@ -20,15 +27,31 @@
 void hed_init_editor(struct hed_editor *editor)
 {
   editor->file = NULL;
+  editor->num_visits = 0;
   editor->mode = HED_MODE_DEFAULT;
   editor->half_byte_edited = false;
+  editor->insert_mode = false;
   editor->search_str[0] = '\0';
+  editor->search_pattern = NULL;
+  editor->search_hex = false;
+  editor->search_file = false;
+  editor->search = NULL;
   editor->read_only = false;
   editor->enable_byte_colors = true;
+  editor->prefetch_file = NULL;
+  editor->growth_poll_time = 0;
+  editor->change_check_time = 0;
 }
 
 static void destroy_editor(struct hed_editor *editor)
 {
+  if (editor->search) {
+    hed_cancel_search(editor->search);
+    editor->search = NULL;
+  }
+  hed_free_pattern(editor->search_pattern);
+  editor->search_pattern = NULL;
+
   struct hed_file *file = editor->file;
   if (! file)
     return;
@@ -57,12 +80,87 @@ static void close_current_file(struct hed_editor *editor)
   hed_free_file(file);
 }
 
+/*
+ * Release the data of the files that were not visited recently, so
+ * only the last EDITOR_MAX_LOADED_FILES visited stay in memory (plus
+ * the ones that can't be released, like modified files).  Files with
+ * several views are counted once.
+ */
+static void unload_old_files(struct hed_editor *editor)
+{
+  while (true) {
+    size_t num_loaded = 0;
+    struct hed_document *oldest = NULL;
+    struct hed_file *file = editor->file;
+    do {
+      struct hed_document *doc = file->doc;
+      struct hed_file *prev = editor->file;
+      while (prev != file && prev->doc != doc)
+        prev = prev->next;
+      if (prev == file && doc->loaded && doc->buf) {
+        num_loaded++;
+        if (doc != editor->file->doc && (! oldest || doc->last_visit < oldest->last_visit)
+            && ! doc->modified && ! doc->save && ! doc->journal && doc->filename)
+          oldest = doc;
+      }
+      file = file->next;
+    } while (file != editor->file);
+    if (num_loaded <= EDITOR_MAX_LOADED_FILES || ! oldest)
+      return;
+
+    file = editor->file;
+    while (file->doc != oldest)
+      file = file->next;
+    if (! hed_unload_file(file))
+      return;
+  }
+}
+
+static void check_file_journal(struct hed_editor *editor);
+static void check_file_changed(struct hed_editor *editor);
+
+/*
+ * Make 'file' the current file, reading its data if it's not loaded
+ * yet.  Files that can't be read are closed.
+ */
+static void switch_to_file(struct hed_editor *editor, struct hed_file *file)
+{
+  editor->file = file;
+  while (editor->file && hed_load_file(editor->file) < 0)
+    close_current_file(editor);
+  if (! editor->file) {
+    file = hed_new_file_from_data(NULL, 0);
+    if (! file)
+      return;
+    hed_add_file(editor, file);
+  }
+
+  editor->file->doc->last_visit = ++editor->num_visits;
+  editor->half_byte_edited = false;
+  hed_set_cursor_pos(editor, editor->file->cursor_pos, 0);
+  check_file_journal(editor);
+  check_file_changed(editor);
+  unload_old_files(editor);
+}
+
 void hed_add_file(struct hed_editor *editor, struct hed_file *file)
 {
   // close current file if it's the only one and it's empty
-  if (editor->file && editor->file == editor->file->next && ! editor->file->data)
+  if (editor->file && editor->file == editor->file->next && ! editor->file->doc->buf && ! editor->file->doc->filename)
     close_current_file(editor);
 
+  // make it another view of the file if it's already open
+  if (editor->file && ! file->doc->modified) {
+    struct hed_file *other = editor->file;
+    do {
+      if (hed_is_same_file(file, other)) {
+        hed_share_file(file, other);
+        break;
+      }
+      other = other->next;
+    } while (other != editor->file);
+  }
+
   if (! editor->file) {
     file->next = file;
     file->prev = file;
@@ -85,6 +183,18 @@ static int get_byte_color(struct hed_editor *editor, uint8_t b)
     return FG_CYAN;
 }
 
+static void format_size(char *str, size_t max_len, size_t size)
+{
+  if (size < 1024)
+    snprintf(str, max_len, "%zu bytes", size);
+  else if (size < 1024*1024)
+    snprintf(str, max_len, "%.1f KB", size / 1024.0);
+  else if (size < 1024*1024*1024)
+    snprintf(str, max_len, "%.1f MB", size / (1024.0*1024));
+  else
+    snprintf(str, max_len, "%.1f GB", size / (1024.0*1024*1024));
+}
+
 static void draw_header(struct hed_editor *editor)
 {
   struct hed_screen *scr = &editor->screen;
@@ -93,9 +203,33 @@ static void draw_header(struct hed_editor *editor)
   reset_color();
   set_color(FG_BLACK, BG_GRAY);
   move_cursor(1, 1);
-  out(" %s", (file->filename) ? file->filename : "New Buffer");
-  if (file->modified)
-    out(" (modified)");
+  if (file->doc->pid)
+    out(" Process %d", (int) file->doc->pid);
+  else
+    out(" %s", (file->doc->filename) ? file->doc->filename : "New Buffer");
+  if (file->doc->modified) {
+    const struct hed_extent_set *changes = hed_file_get_pending_changes(file);
+    if (changes)
+      out(" (modified: %zu bytes in %zu extents)", changes->num_bytes, changes->num_extents);
+    else
+      out(" (modified)");
+  }
+  if (file->doc->buf) {
+    const struct hed_extent_set *holes = hed_buffer_get_holes(file->doc->buf);
+    if (holes && file->doc->pid) {
+      char size[32];
+      format_size(size, sizeof(size), hed_file_len(file) - holes->num_bytes);
+      out(" (mapped: %s)", size);
+    } else if (holes && holes->num_bytes > 0) {
+      char size[32];
+      format_size(size, sizeof(size), holes->num_bytes);
+      out(" (holes: %s)", size);
+    }
+  }
+  if (file->doc->streaming)
+    out(" (streaming...)");
+  if (editor->insert_mode && ! editor->read_only)
+    out(" (insert)");
   if (editor->read_only)
     out(" (view mode)");
   clear_eol();
@@ -124,6 +258,76 @@ void hed_void_key_help(int x, int y)
   clear_eol();
 }
 
+/*
+ * Show the progress of the first file being saved, starting from
+ * the current one.
+ */
+static void draw_save_progress(struct hed_editor *editor)
+{
+  struct hed_file *file = editor->file;
+  struct hed_save_progress progress;
+  while (! hed_get_file_save_progress(file, &progress)) {
+    file = file->next;
+    if (file == editor->file)
+      return;
+  }
+
+  double rate = (progress.elapsed > 0) ? progress.done / progress.elapsed : 0;
+  set_color(FG_BLACK, BG_GRAY);
+  out(" Saving '%s': %zu%%", progress.filename, (progress.total > 0) ? (size_t) (progress.done * 100.0 / progress.total) : 0);
+  if (progress.elapsed >= 1 && rate > 0 && progress.done < progress.total) {
+    size_t eta = (progress.total - progress.done) / rate;
+    out(" (%.1f MB/s, ETA %zu:%02zu)", rate / (1024*1024), eta / 60, eta % 60);
+  }
+}
+
+/*
+ * Show the progress of the running search as a bar with the
+ * percentage, the scan rate and the estimated time left.
+ */
+static void draw_search_progress(struct hed_editor *editor)
+{
+  struct hed_search_progress progress;
+  hed_get_search_progress(editor->search, &progress);
+
+  size_t percent = (progress.total > 0) ? (size_t) (progress.done * 100.0 / progress.total) : 0;
+  char bar[EDITOR_SEARCH_BAR_LEN + 1];
+  size_t filled = percent * EDITOR_SEARCH_BAR_LEN / 100;
+  for (size_t i = 0; i < EDITOR_SEARCH_BAR_LEN; i++)
+    bar[i] = (i < filled) ? '#' : ' ';
+  bar[EDITOR_SEARCH_BAR_LEN] = '\0';
+
+  double rate = (progress.elapsed > 0) ? progress.done / progress.elapsed : 0;
+  set_color(FG_BLACK, BG_GRAY);
+  out(" Searching: [%s] %zu%%", bar, percent);
+  if (progress.elapsed >= 1 && rate > 0 && progress.done < progress.total) {
+    size_t eta = (progress.total - progress.done) / rate;
+    out(" (%.2f GB/s, ETA %zu:%02zu)", rate / (1024*1024*1024), eta / 60, eta % 60);
+  }
+}
+
+/*
+ * Show the progress of a file being read into memory.  Called from
+ * the store while the editor waits for the read to finish.
+ */
+static void draw_load_progress(void *data, size_t done, size_t total, double elapsed)
+{
+  struct hed_editor *editor = data;
+  struct hed_screen *scr = &editor->screen;
+
+  double rate = (elapsed > 0) ? done / elapsed : 0;
+  reset_color();
+  move_cursor(1, scr->h - EDITOR_FOOTER_LINES + 1);
+  set_color(FG_BLACK, BG_GRAY);
+  out(" Reading file: %zu%%", (total > 0) ? (size_t) (done * 100.0 / total) : 0);
+  if (elapsed >= 1 && rate > 0 && done < total) {
+    size_t eta = (total - done) / rate;
+    out(" (%.1f MB/s, ETA %zu:%02zu)", rate / (1024*1024), eta / 60, eta % 60);
+  }
+  clear_eol();
+  hed_scr_flush();
+}
+
 static void draw_footer(struct hed_editor *editor)
 {
   struct hed_screen *scr = &editor->screen;
@@ -133,7 +337,10 @@ static void draw_footer(struct hed_editor *editor)
   if (scr->cur_msg[0] != '\0') {
     set_color(FG_BLACK, BG_GRAY);
     out(" %s", scr->cur_msg);
-  }
+  } else if (editor->search)
+    draw_search_progress(editor);
+  else
+    draw_save_progress(editor);
   clear_eol();
 
   switch (editor->mode) {
@@ -164,6 +371,14 @@ static void draw_footer(struct hed_editor *editor)
     hed_void_key_help(1 + 2*EDITOR_KEY_HELP_SPACING, scr->h-0);
     break;
 
+  case HED_MODE_SEARCHING:
+    hed_void_key_help(1 + 0*EDITOR_KEY_HELP_SPACING, scr->h-1);
+    hed_draw_key_help(1 + 0*EDITOR_KEY_HELP_SPACING, scr->h-0, "^C", "Cancel");
+
+    hed_void_key_help(1 + 1*EDITOR_KEY_HELP_SPACING, scr->h-1);
+    hed_void_key_help(1 + 1*EDITOR_KEY_HELP_SPACING, scr->h-0);
+    break;
+
   case HED_MODE_DEFAULT:
     hed_draw_key_help(1 + 0*EDITOR_KEY_HELP_SPACING, scr->h-1, "^G",  "Get Help");
     hed_draw_key_help(1 + 0*EDITOR_KEY_HELP_SPACING, scr->h-0, "^X",  (editor->file->next == editor->file) ? "Exit" : "Close");
@@ -183,6 +398,19 @@ static void draw_footer(struct hed_editor *editor)
   clear_eol();
 }
 
+/*
+ * Return the number of valid cursor positions.  In insert mode the
+ * cursor can also be placed right after the last byte, so data can
+ * be appended to the file.
+ */
+static size_t get_cursor_limit(struct hed_editor *editor)
+{
+  size_t len = hed_file_len(editor->file);
+  if (editor->insert_mode && ! editor->read_only)
+    return len + 1;
+  return len;
+}
+
 static int get_num_displayed_file_lines(struct hed_editor *editor)
 {
   struct hed_screen *scr = &editor->screen;
@@ -194,9 +422,27 @@ static int get_num_displayed_file_lines(struct hed_editor *editor)
   return scr->h - EDITOR_BORDER_LINES;
 }
 
+/*
+ * Return the number of hex digits in the offset column: 8, or more
+ * if the file is 4 GB or bigger.
+ */
+static int get_offset_width(struct hed_editor *editor)
+{
+  size_t last_pos = get_cursor_limit(editor);
+  if (last_pos > 0)
+    last_pos--;
+  int width = 8;
+  while (width < 16 && (last_pos >> (4*width)) != 0)
+    width++;
+  return width;
+}
+
 static void draw_file_dump(struct hed_editor *editor)
 {
   struct hed_file *file = editor->file;
+  size_t data_len = hed_file_len(file);
+  size_t cursor_limit = get_cursor_limit(editor);
+  int offset_width = get_offset_width(editor);
 
   move_cursor(1, EDITOR_HEADER_LINES + 1);
 
@@ -204,15 +450,16 @@ static void draw_file_dump(struct hed_editor *editor)
   int num_lines = get_num_displayed_file_lines(editor);
   for (int i = 0; i < num_lines; i++) {
     size_t pos = 16 * (file->top_line + i);
-    if (pos >= file->data_len) {
+    if (pos >= cursor_limit) {
       clear_space_at_line = i;
       break;
     }
     set_bold(false);
-    out("%08x ", (unsigned) pos);
+    out("%0*zx ", offset_width, pos);
     box_draw("| ");
-    int len = (file->data_len - pos < 16) ? file->data_len - pos : 16;
-    char txt_buf[5 + 16*(10+1) + 5+4+5 + 1];  // bold + 16*(color+char) + bold+reset+bold + nul
+    uint8_t line[16];
+    int len = hed_buffer_read(file->doc->buf, pos, line, (data_len - pos < 16) ? data_len - pos : 16);
+    char txt_buf[5 + 16*(10+1) + 15+4+5 + 1];  // bold + 16*(color+char) + cursor+reset+bold + nul
     int txt_buf_len = 0;
     if (! editor->read_only) {
         set_bold(file->pane == HED_PANE_HEX);
@@ -220,7 +467,7 @@ static void draw_file_dump(struct hed_editor *editor)
     }
     int last_byte_color = -1;
     for (int j = 0; j < len; j++) {
-      uint8_t b = file->data[pos+j];
+      uint8_t b = line[j];
       int byte_color = get_byte_color(editor, b);
       int set_byte_color = byte_color != last_byte_color;
       last_byte_color = byte_color;
@@ -232,7 +479,7 @@ static void draw_file_dump(struct hed_editor *editor)
       if (file->cursor_pos == pos + j) {
         int cur_x = file->cursor_pos % 16;
         int cur_y = file->cursor_pos / 16 - file->top_line;
-        move_cursor(11 + 3*cur_x + (j >= 8), 3 + cur_y);
+        move_cursor(offset_width + 3 + 3*cur_x + (j >= 8), 3 + cur_y);
         set_color(FG_BLACK,
                   ((editor->half_byte_edited) ? BG_YELLOW
                     : (file->pane == HED_PANE_HEX && ! editor->read_only) ? BG_GREEN
@@ -275,9 +522,20 @@ static void draw_file_dump(struct hed_editor *editor)
 
     // empty space
     for (int j = len; j < 16; j++) {
-      out("   ");
       if (j == 8)
         out(" ");
+      if (file->cursor_pos == pos + j) {
+        // cursor after the end of the file (insert mode)
+        int bg_color = (file->pane == HED_PANE_HEX) ? BG_GREEN : BG_GRAY;
+        move_cursor(offset_width + 3 + 3*j + (j >= 8), 3 + i);
+        set_color(FG_BLACK, bg_color);
+        out("    ");
+        reset_color();
+        bg_color = (file->pane == HED_PANE_TEXT) ? BG_GREEN : BG_GRAY;
+        txt_buf_len += snprintf(txt_buf + txt_buf_len, sizeof(txt_buf) - txt_buf_len, "\x1b[22m\x1b[%dm\x1b[%dm \x1b[0m", FG_BLACK, bg_color);
+        continue;
+      }
+      out("   ");
       txt_buf[txt_buf_len++] = ' ';
     }
     txt_buf[txt_buf_len] = '\0';
@@ -424,7 +682,7 @@ static void draw_main_screen(struct hed_editor *editor)
   struct hed_screen *scr = &editor->screen;
   struct hed_file *file = editor->file;
 
-  if (scr->window_changed || ! file->data) {
+  if (scr->window_changed || ! file->doc->buf) {
     reset_color();
     clear_screen();
     scr->window_changed = false;
@@ -433,7 +691,7 @@ static void draw_main_screen(struct hed_editor *editor)
   draw_header(editor);
   draw_footer(editor);
 
-  if (file->data) {
+  if (file->doc->buf) {
     draw_file_dump(editor);
     draw_pos_data_dump(editor);
   }
@@ -447,12 +705,13 @@ void hed_set_cursor_pos(struct hed_editor *editor, size_t pos, size_t visible_le
   struct hed_screen *scr = &editor->screen;
   struct hed_file *file = editor->file;
   size_t n_page_lines = get_num_displayed_file_lines(editor);
-  size_t last_line = file->data_len / 16 + (file->data_len % 16 != 0);
+  size_t data_len = get_cursor_limit(editor);
+  size_t last_line = data_len / 16 + (data_len % 16 != 0);
 
-  if (pos >= file->data_len)
-    pos = (file->data_len == 0) ? 0 : file->data_len-1;
-  if (pos + visible_len_after >= file->data_len)
-    visible_len_after = file->data_len - pos;
+  if (pos >= data_len)
+    pos = (data_len == 0) ? 0 : data_len-1;
+  if (pos + visible_len_after >= data_len)
+    visible_len_after = data_len - pos;
 
   file->cursor_pos = pos;
 
@@ -487,7 +746,7 @@ static void cursor_right(struct hed_editor *editor)
   struct hed_screen *scr = &editor->screen;
   struct hed_file *file = editor->file;
 
-  if (file->cursor_pos + 1 < file->data_len) {
+  if (file->cursor_pos + 1 < get_cursor_limit(editor)) {
     file->cursor_pos++;
     size_t n_page_lines = get_num_displayed_file_lines(editor);
     while (file->cursor_pos >= 16 * (file->top_line + n_page_lines))
@@ -527,7 +786,7 @@ static void cursor_down(struct hed_editor *editor)
   struct hed_screen *scr = &editor->screen;
   struct hed_file *file = editor->file;
 
-  if (file->cursor_pos + 16 < file->data_len) {
+  if (file->cursor_pos + 16 < get_cursor_limit(editor)) {
     file->cursor_pos += 16;
     size_t n_page_lines = get_num_displayed_file_lines(editor);
     while (file->cursor_pos >= 16 * (file->top_line + n_page_lines))
@@ -559,12 +818,13 @@ static void cursor_page_down(struct hed_editor *editor)
   struct hed_file *file = editor->file;
   int cursor_delta = file->cursor_pos - 16*file->top_line;
   size_t n_page_lines = get_num_displayed_file_lines(editor);
-  size_t last_line = file->data_len / 16 + (file->data_len % 16 != 0);
+  size_t data_len = get_cursor_limit(editor);
+  size_t last_line = data_len / 16 + (data_len % 16 != 0);
 
   if (last_line < n_page_lines || file->top_line == last_line - n_page_lines) {
     if (last_line < n_page_lines)
       file->top_line = 0;
-    cursor_delta = file->data_len - 16*file->top_line - 1;
+    cursor_delta = data_len - 16*file->top_line - 1;
   } else if (last_line > n_page_lines && file->top_line + 2*n_page_lines < last_line)
     file->top_line += n_page_lines;
   else
@@ -587,9 +847,11 @@ static void cursor_end(struct hed_editor *editor)
   struct hed_screen *scr = &editor->screen;
   struct hed_file *file = editor->file;
 
+  size_t data_len = get_cursor_limit(editor);
+
   file->cursor_pos = file->cursor_pos / 16 * 16 + 15;
-  if (file->cursor_pos >= file->data_len)
-    file->cursor_pos = file->data_len - 1;
+  if (file->cursor_pos >= data_len)
+    file->cursor_pos = data_len - 1;
   scr->redraw_needed = true;
 }
 
@@ -608,9 +870,10 @@ static void cursor_end_of_file(struct hed_editor *editor)
   struct hed_screen *scr = &editor->screen;
   struct hed_file *file = editor->file;
   size_t n_page_lines = get_num_displayed_file_lines(editor);
-  size_t last_line = file->data_len / 16 + (file->data_len % 16 != 0);
+  size_t data_len = get_cursor_limit(editor);
+  size_t last_line = data_len / 16 + (data_len % 16 != 0);
 
-  file->cursor_pos = file->data_len - 1;
+  file->cursor_pos = data_len - 1;
   if (last_line < n_page_lines)
     file->top_line = 0;
   else
@@ -618,6 +881,42 @@ static void cursor_end_of_file(struct hed_editor *editor)
   scr->redraw_needed = true;
 }
 
+static void clamp_cursor_pos(struct hed_editor *editor)
+{
+  struct hed_file *file = editor->file;
+  size_t limit = get_cursor_limit(editor);
+
+  if (file->cursor_pos >= limit && limit > 0)
+    hed_set_cursor_pos(editor, limit - 1, 0);
+}
+
+/*
+ * Write a byte at the cursor position, either replacing the byte
+ * there or inserting it before it.
+ */
+static int put_byte_at_cursor(struct hed_editor *editor, uint8_t b, bool insert)
+{
+  struct hed_file *file = editor->file;
+
+  if (hed_replace_file_data(file, file->cursor_pos, (insert) ? 0 : 1, &b, 1) < 0)
+    return show_msg("ERROR: out of memory");
+  editor->screen.redraw_needed = true;
+  return 0;
+}
+
+static int delete_byte_at_cursor(struct hed_editor *editor)
+{
+  struct hed_file *file = editor->file;
+
+  if (file->cursor_pos >= hed_file_len(file))
+    return -1;
+  if (hed_replace_file_data(file, file->cursor_pos, 1, NULL, 0) < 0)
+    return show_msg("ERROR: out of memory");
+  clamp_cursor_pos(editor);
+  editor->screen.redraw_needed = true;
+  return 0;
+}
+
 static int prompt_get_yesno(struct hed_editor *editor, const char *prompt, bool *response)
 {
   struct hed_screen *scr = &editor->screen;
@@ -661,6 +960,96 @@ static int prompt_get_yesno(struct hed_editor *editor, const char *prompt, bool
   return -1;
 }
 
+/*
+ * If the current file was changed on disk by another program, offer
+ * to reload it.  Local changes are kept, and the places where they
+ * conflict with the new data are shown.
+ */
+static void check_file_changed(struct hed_editor *editor)
+{
+  struct hed_file *file = editor->file;
+  if (! hed_poll_file_change(file))
+    return;
+
+  char prompt[256];
+  snprintf(prompt, sizeof(prompt), "'%s' was changed on disk.  Reload it%s?", file->doc->filename,
+           (file->doc->modified) ? " (keeping your changes)" : "");
+  bool reload = false;
+  if (prompt_get_yesno(editor, prompt, &reload) < 0 || ! reload)
+    return;
+
+  struct hed_extent_set conflicts = { NULL, 0, 0, 0 };
+  if (hed_reload_file(file, &conflicts) == 0) {
+    editor->half_byte_edited = false;
+    hed_set_cursor_pos(editor, file->cursor_pos, 0);
+    if (conflicts.num_extents == 0)
+      show_msg("File reloaded");
+    else {
+      char list[128];
+      size_t list_len = 0;
+      list[0] = '\0';
+      for (size_t i = 0; i < conflicts.num_extents && i < 3; i++) {
+        struct hed_extent *e = &conflicts.extents[i];
+        list_len += snprintf(list + list_len, sizeof(list) - list_len, "%s%08zx-%08zx",
+                             (i > 0) ? ", " : "", e->pos, e->pos + e->len - 1);
+      }
+      if (conflicts.num_extents > 3)
+        show_msg("File reloaded; your changes conflict at %s and %zu more places", list, conflicts.num_extents - 3);
+      else
+        show_msg("File reloaded; your changes conflict at %s", list);
+    }
+  }
+  free(conflicts.extents);
+  editor->screen.redraw_needed = true;
+}
+
+/*
+ * Write the current file, asking first if that would overwrite
+ * changes someone else made to it on disk.
+ */
+static int save_file(struct hed_editor *editor, const char *filename)
+{
+  struct hed_file *file = editor->file;
+  if (file->doc->filename && strcmp(filename, file->doc->filename) == 0 && hed_file_changed_on_disk(file)) {
+    char prompt[256];
+    snprintf(prompt, sizeof(prompt), "'%s' was changed on disk since it was read.  Overwrite it?", filename);
+    bool overwrite = false;
+    if (prompt_get_yesno(editor, prompt, &overwrite) < 0 || ! overwrite)
+      return -1;
+  }
+  return hed_write_file(file, filename);
+}
+
+/*
+ * If changes to the current file that were never saved were found in
+ * its journal, offer to recover them.  In view mode the journal is
+ * only reported and left for when the file is edited.
+ */
+static void check_file_journal(struct hed_editor *editor)
+{
+  struct hed_file *file = editor->file;
+  if (! hed_file_has_journal(file))
+    return;
+  if (editor->read_only) {
+    hed_keep_file_journal(file);
+    show_msg("Found unsaved changes to '%s' in its journal (open it without -v to recover them)", file->doc->filename);
+    return;
+  }
+
+  char prompt[256];
+  snprintf(prompt, sizeof(prompt), "Found unsaved changes to '%s' in its journal.  Recover them?", file->doc->filename);
+  bool recover = false;
+  if (prompt_get_yesno(editor, prompt, &recover) < 0 || ! recover) {
+    hed_discard_file_journal(file);
+    return;
+  }
+  size_t pos;
+  if (hed_recover_file_journal(file, &pos) == 0) {
+    hed_set_cursor_pos(editor, pos, 16);
+    show_msg("Changes recovered from journal");
+  }
+}
+
 static int prompt_get_text(struct hed_editor *editor, const char *prompt, char *str, size_t max_str_len)
 {
   struct hed_screen *scr = &editor->screen;
@@ -797,8 +1186,8 @@ static int prompt_get_filename(struct hed_editor *editor, const char *prompt, ch
 static int prompt_save_file(struct hed_editor *editor)
 {
   char filename[256];
-  if (editor->file->filename)
-    snprintf(filename, sizeof(filename), "%s", editor->file->filename);
+  if (editor->file->doc->filename)
+    snprintf(filename, sizeof(filename), "%s", editor->file->doc->filename);
   else
     filename[0] = '\0';
   if (prompt_get_filename(editor, "Write file", filename, sizeof(filename)) < 0) {
@@ -806,7 +1195,7 @@ static int prompt_save_file(struct hed_editor *editor)
     return -1;
   }
   editor->screen.redraw_needed = true;
-  return hed_write_file(editor->file, filename);
+  return save_file(editor, filename);
 }
 
 static int prompt_read_file(struct hed_editor *editor)
@@ -819,87 +1208,124 @@ static int prompt_read_file(struct hed_editor *editor)
   }
   editor->screen.redraw_needed = true;
 
-  struct hed_file *file = hed_read_file(filename);
+  struct hed_file *file = hed_open_file(filename);
   if (! file)
     return -1;
   hed_add_file(editor, file);
-  editor->file = file;
+  switch_to_file(editor, file);
   return 0;
 }
 
-static size_t conv_search_bytes(uint8_t *bytes, size_t max_len, const char *search_str)
+/*
+ * Make 'len' bytes the pattern for the next searches, shown as
+ * 'search_str' in the search prompt.  'mask' has the bits to compare
+ * in each byte, or is NULL to compare all.
+ */
+static int set_search_pattern(struct hed_editor *editor, const uint8_t *bytes, const uint8_t *mask, size_t len, const char *search_str)
 {
-  size_t len = 0;
-  const char *src = search_str;
-  while (*src != '\0' && len < 2*max_len) {
-    uint8_t nibble = 0;
-    while (*src != '\0') {
-      if (*src >= '0' && *src <= '9') {
-        nibble = *src - '0';
-        src++;
-        break;
-      } else if (*src >= 'a' && *src <= 'f') {
-        nibble = *src - 'a' + 10;
-        src++;
-        break;
-      } else if (*src >= 'A' && *src <= 'F') {
-        nibble = *src - 'A' + 10;
-        src++;
-        break;
-      } else if (*src == ' ' || *src == ',') {
-        src++;
-      } else
-        return 0;
-    }
+  struct hed_pattern *pat = hed_new_pattern(bytes, mask, len);
+  if (! pat)
+    return show_msg("ERROR: out of memory");
+  hed_free_pattern(editor->search_pattern);
+  editor->search_pattern = pat;
+  editor->search_hex = false;
+  editor->search_file = false;
+  if (search_str != editor->search_str)
+    snprintf(editor->search_str, sizeof(editor->search_str), "%s", search_str);
+  return 0;
+}
 
-    if (len % 2 == 0)
-      bytes[len/2] = nibble << 4;
-    else
-      bytes[len/2] |= nibble;
-    len++;
-  }
-  if (len % 2 != 0)
+/*
+ * Make 'search_str' the pattern for the next searches, as text or, in
+ * the hex pane, as a list of hex bytes.
+ */
+static int parse_search_pattern(struct hed_editor *editor, const char *search_str)
+{
+  if (editor->file->pane == HED_PANE_TEXT)
+    return set_search_pattern(editor, (const uint8_t *) search_str, NULL, strlen(search_str), search_str);
+
+  uint8_t search_bytes[sizeof(editor->search_str)];
+  uint8_t search_mask[sizeof(editor->search_str)];
+  size_t search_len = hed_parse_search_bytes(search_bytes, search_mask, sizeof(search_bytes), search_str);
+  if (search_len == 0)
+    return show_msg("Invalid byte sequence (must be a list pairs of hex numbers or ?)");
+  if (set_search_pattern(editor, search_bytes, search_mask, search_len, search_str) < 0)
+    return -1;
+  editor->search_hex = true;
+  return 0;
+}
+
+/*
+ * Repeating a search in the other pane searches for the same string
+ * as text or hex bytes like that pane does, not for the bytes it gave
+ * in the pane where it was typed.
+ */
+static int update_search_pattern(struct hed_editor *editor)
+{
+  if (! editor->search_pattern || editor->search_file)
+    return 0;
+  if (editor->search_hex == (editor->file->pane == HED_PANE_HEX))
     return 0;
-  return len/2;
+  return parse_search_pattern(editor, editor->search_str);
 }
 
-static int perform_search(struct hed_editor *editor)
+/*
+ * Start searching for the last pattern from the cursor, forward or
+ * backward.  The search runs in the background; the cursor is moved
+ * when it ends (see finish_search()).
+ */
+static int perform_search(struct hed_editor *editor, bool backward)
 {
   struct hed_file *file = editor->file;
+  if (backward && file->cursor_pos == 0)
+    return show_msg((file->pane == HED_PANE_HEX) ? "Byte sequence not found" : "Text not found");
 
-  size_t search_len = strlen(editor->search_str);
-  uint8_t *search_bytes;
-  uint8_t search_buf[sizeof(editor->search_str)];
-  if (file->pane == HED_PANE_TEXT) {
-    search_bytes = (uint8_t *) editor->search_str;
-  } else {
-    search_len = conv_search_bytes(search_buf, sizeof(search_buf), editor->search_str);
-    if (search_len == 0)
-      return show_msg("Invalid byte sequence (must be a list pairs of hex numbers)");
-    search_bytes = search_buf;
-  }
+  // the unmapped gaps of a process don't match anything
+  bool match_holes = ! file->doc->pid;
+  size_t pos = (backward) ? file->cursor_pos - 1 : file->cursor_pos + 1;
+  editor->search = hed_start_search(file->doc->buf, editor->search_pattern, pos, backward, match_holes);
+  if (! editor->search)
+    return show_msg("ERROR: can't start search");
+  editor->mode = HED_MODE_SEARCHING;
+  editor->screen.redraw_needed = true;
+  return 0;
+}
 
-  // TODO: Boyer-Moore search?
-  bool found = false;
+/*
+ * Move the cursor to the result of the search that just ended.
+ */
+static void finish_search(struct hed_editor *editor)
+{
+  struct hed_file *file = editor->file;
   size_t pos;
-  for (pos = file->cursor_pos+1; pos + search_len < file->data_len; pos++) {
-    if (memcmp(file->data + pos, search_bytes, search_len) == 0) {
-      found = true;
-      file->cursor_pos = pos;
-      break;
-    }
-  }
-  if (! found)
-    return show_msg((file->pane == HED_PANE_HEX) ? "Byte sequence not found" : "Text not found");
-  hed_set_cursor_pos(editor, pos, search_len);
-  return 0;
+  int ret = hed_finish_search(editor->search, &pos);
+  editor->search = NULL;
+  editor->mode = HED_MODE_DEFAULT;
+  if (ret < 0)
+    show_msg("ERROR: out of memory");
+  else if (ret == 0)
+    show_msg((file->pane == HED_PANE_HEX) ? "Byte sequence not found" : "Text not found");
+  else
+    hed_set_cursor_pos(editor, pos, editor->search_pattern->len);
 }
 
-static int prompt_search(struct hed_editor *editor)
+static void cancel_search(struct hed_editor *editor)
+{
+  hed_cancel_search(editor->search);
+  editor->search = NULL;
+  editor->mode = HED_MODE_DEFAULT;
+  show_msg("Search cancelled");
+}
+
+static int prompt_search(struct hed_editor *editor, bool backward)
 {
   struct hed_file *file = editor->file;
-  const char *prompt = (file->pane == HED_PANE_HEX) ? "Search bytes" : "Search text";
-  char prompt_str[40];
+  const char *prompt;
+  if (file->pane == HED_PANE_HEX)
+    prompt = (backward) ? "Search bytes backward" : "Search bytes";
+  else
+    prompt = (backward) ? "Search text backward" : "Search text";
+  char prompt_str[48];
   if (editor->search_str[0] != '\0') {
     size_t prompt_len = strlen(prompt);
     size_t len = strlen(editor->search_str);
@@ -914,12 +1340,261 @@ static int prompt_search(struct hed_editor *editor)
   search_str[0] = '\0';
   if (prompt_get_filename(editor, prompt, search_str, sizeof(search_str)) < 0)
     return -1;
-  if (search_str[0] != '\0')
-    strcpy(editor->search_str, search_str);
-  perform_search(editor);
+  if (search_str[0] != '\0') {
+    if (parse_search_pattern(editor, search_str) < 0)
+      return -1;
+  } else if (update_search_pattern(editor) < 0)
+    return -1;
+  if (! editor->search_pattern)
+    return 0;
+  perform_search(editor, backward);
+  return 0;
+}
+
+/*
+ * Search for the contents of a file (which can be longer than what
+ * fits in the search prompt).
+ */
+static int prompt_search_file(struct hed_editor *editor)
+{
+  char filename[256];
+  filename[0] = '\0';
+  if (prompt_get_filename(editor, "Search for contents of file", filename, sizeof(filename)) < 0 || filename[0] == '\0')
+    return -1;
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return show_msg("Can't open %s: %s", filename, strerror(errno));
+  struct stat st;
+  if (fstat(fd, &st) < 0 || ! S_ISREG(st.st_mode)) {
+    close(fd);
+    return show_msg("Not a regular file: %s", filename);
+  }
+  if (st.st_size == 0 || st.st_size > EDITOR_MAX_PATTERN_FILE) {
+    close(fd);
+    return show_msg((st.st_size == 0) ? "File is empty: %s" : "File is too large: %s", filename);
+  }
+
+  size_t len = st.st_size;
+  uint8_t *bytes = malloc(len);
+  if (! bytes) {
+    close(fd);
+    return show_msg("ERROR: out of memory");
+  }
+  size_t n_read = 0;
+  while (n_read < len) {
+    ssize_t n = read(fd, bytes + n_read, len - n_read);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    n_read += n;
+  }
+  close(fd);
+  if (n_read < len) {
+    free(bytes);
+    return show_msg("Error reading %s", filename);
+  }
+
+  char search_str[sizeof(editor->search_str)];
+  snprintf(search_str, sizeof(search_str), "<%.*s>", (int) sizeof(search_str) - 3, filename);
+  int ret = set_search_pattern(editor, bytes, NULL, len, search_str);
+  free(bytes);
+  if (ret < 0)
+    return -1;
+  editor->search_file = true;
+  perform_search(editor, false);
   return 0;
 }
 
+/*
+ * Finish the background saves and search that are done, add the
+ * data that arrived for streamed and followed files and flush the
+ * journals.  New data is checked for at most every
+ * EDITOR_GROWTH_POLL_TIME seconds, so a fast writer causes one redraw
+ * per batch instead of one per write.  If the cursor was on the last
+ * line of the current file, it's moved to the new end (unless a
+ * search is running, since the cursor stays put until it ends).
+ * Returns true if the screen has to be updated.
+ */
+static bool poll_background_jobs(struct hed_editor *editor)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  double now = ts.tv_sec + ts.tv_nsec / 1e9;
+  bool poll_growth = (now - editor->growth_poll_time >= EDITOR_GROWTH_POLL_TIME);
+  if (poll_growth)
+    editor->growth_poll_time = now;
+
+  size_t old_len = hed_file_len(editor->file);
+  bool changed = false;
+  struct hed_file *file = editor->file;
+  do {
+    if (hed_poll_file_save(file) > 0)
+      changed = true;
+    if (poll_growth && hed_poll_file_stream(file) && file->doc == editor->file->doc)
+      changed = true;
+    hed_sync_file_journal(file);
+    file = file->next;
+  } while (file != editor->file);
+
+  size_t len = hed_file_len(editor->file);
+  if (len > old_len && ! editor->half_byte_edited && ! editor->search
+      && (old_len == 0 || editor->file->cursor_pos / 16 >= (old_len - 1) / 16))
+    hed_set_cursor_pos(editor, len - 1, 0);
+
+  // the search progress is shown while it runs
+  if (editor->search) {
+    if (hed_search_finished(editor->search))
+      finish_search(editor);
+    changed = true;
+  }
+  return changed;
+}
+
+/*
+ * Wait for the background save of a file to finish, showing its
+ * progress.  Returns -1 if the save failed.
+ */
+static int wait_for_save(struct hed_editor *editor, struct hed_file *file)
+{
+  struct timespec tick = { 0, 100*1000*1000 };
+  int ret;
+  while ((ret = hed_poll_file_save(file)) > 0) {
+    draw_main_screen(editor);
+    nanosleep(&tick, NULL);
+  }
+  return ret;
+}
+
+/*
+ * Read the data the user is likely to look at next before it's
+ * needed.  The scroll speed is measured from the movement of the top
+ * line, and the data it'll reach in about a second (at least two
+ * screens, at most EDITOR_PREFETCH_MAX bytes) is prefetched in the
+ * direction of the movement; the data that falls more than
+ * 4*EDITOR_PREFETCH_MAX bytes behind is dropped.  A jump to a
+ * different place (like "go to" or a search) just prefetches the
+ * screens around it.
+ */
+static void prefetch_data(struct hed_editor *editor)
+{
+  struct hed_file *file = editor->file;
+  if (! file->doc->buf)
+    return;
+  size_t screen_len = 16 * get_num_displayed_file_lines(editor);
+  size_t pos = 16 * file->top_line;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  double now = ts.tv_sec + ts.tv_nsec / 1e9;
+
+  size_t last_pos = editor->prefetch_pos;
+  double elapsed = now - editor->prefetch_time;
+  bool moved_forward = (pos > last_pos);
+  size_t dist = (moved_forward) ? pos - last_pos : last_pos - pos;
+  if (file == editor->prefetch_file && dist == 0)
+    return;
+  editor->prefetch_pos = pos;
+  editor->prefetch_time = now;
+
+  if (file != editor->prefetch_file || dist > 4 * screen_len) {
+    editor->prefetch_file = file;
+    size_t start = (pos > 2 * screen_len) ? pos - 2 * screen_len : 0;
+    hed_buffer_prefetch(file->doc->buf, start, pos - start + 3 * screen_len, false);
+    return;
+  }
+
+  double ahead = (elapsed > 0) ? dist / elapsed : EDITOR_PREFETCH_MAX;
+  if (ahead < 2 * screen_len)
+    ahead = 2 * screen_len;
+  if (ahead > EDITOR_PREFETCH_MAX)
+    ahead = EDITOR_PREFETCH_MAX;
+  size_t ahead_len = (size_t) ahead;
+  size_t behind_len = 4 * EDITOR_PREFETCH_MAX;
+
+  if (moved_forward) {
+    hed_buffer_prefetch(file->doc->buf, pos + screen_len, ahead_len, false);
+    if (pos > behind_len) {
+      size_t drop_start = (last_pos > behind_len) ? last_pos - behind_len : 0;
+      hed_buffer_prefetch(file->doc->buf, drop_start, pos - behind_len - drop_start, true);
+    }
+  } else {
+    size_t start = (pos > ahead_len) ? pos - ahead_len : 0;
+    hed_buffer_prefetch(file->doc->buf, start, pos - start, false);
+    hed_buffer_prefetch(file->doc->buf, pos + screen_len + behind_len, dist, true);
+  }
+}
+
+/*
+ * Check if the current file changed on disk, at most every
+ * EDITOR_CHANGE_CHECK_TIME seconds.
+ */
+static void poll_file_change(struct hed_editor *editor)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  double now = ts.tv_sec + ts.tv_nsec / 1e9;
+  if (now - editor->change_check_time < EDITOR_CHANGE_CHECK_TIME || editor->mode != HED_MODE_DEFAULT)
+    return;
+  editor->change_check_time = now;
+  check_file_changed(editor);
+  if (editor->file->doc->pid) {
+    hed_refresh_file(editor->file);
+    editor->screen.redraw_needed = true;
+  }
+}
+
+/*
+ * If the cursor was moved into an unmapped gap of a process's memory,
+ * move it on to the next mapped region in the same direction.
+ */
+static void skip_unmapped_gap(struct hed_editor *editor, bool backward)
+{
+  struct hed_file *file = editor->file;
+  bool is_hole;
+  if (! file->doc->pid || ! file->doc->buf)
+    return;
+  hed_buffer_get_run(file->doc->buf, file->cursor_pos, &is_hole);
+  if (! is_hole)
+    return;
+
+  size_t data_pos;
+  if (! hed_buffer_find_data(file->doc->buf, file->cursor_pos, backward, &data_pos)) {
+    // nothing mapped that way: go back to the other side of the gap
+    backward = ! backward;
+    if (! hed_buffer_find_data(file->doc->buf, file->cursor_pos, backward, &data_pos))
+      return;
+  }
+  if (backward) {
+    // to the last byte of the region
+    size_t run = hed_buffer_get_run(file->doc->buf, data_pos, &is_hole);
+    data_pos += run - 1;
+  }
+  hed_set_cursor_pos(editor, data_pos, 0);
+}
+
+/*
+ * While a search runs, only redraws and ^C (to cancel it) are handled.
+ */
+static void process_search_input(struct hed_editor *editor, int k)
+{
+  struct hed_screen *scr = &editor->screen;
+
+  switch (k) {
+  case KEY_REDRAW:
+  case CTRL_KEY('l'):
+    reset_color();
+    clear_screen();
+    scr->redraw_needed = true;
+    break;
+
+  case CTRL_KEY('c'):
+    cancel_search(editor);
+    scr->redraw_needed = true;
+    break;
+  }
+}
+
 static void process_input(struct hed_editor *editor)
 {
   struct hed_screen *scr = &editor->screen;
@@ -929,6 +1604,19 @@ static void process_input(struct hed_editor *editor)
   int k = read_key(scr->term_fd, key_err, sizeof(key_err));
 
   scr->msg_was_set = false;
+  if (poll_background_jobs(editor) || scr->msg_was_set)
+    scr->redraw_needed = true;
+  if (k == KEY_NONE)
+    return;
+
+  if (editor->mode == HED_MODE_SEARCHING) {
+    process_search_input(editor, k);
+    return;
+  }
+
+  struct hed_file *old_file = file;
+  size_t old_cursor_pos = file->cursor_pos;
+
   switch (k) {
   case KEY_REDRAW:
     reset_color();
@@ -947,31 +1635,35 @@ static void process_input(struct hed_editor *editor)
     break;
 
   case CTRL_KEY('x'):
-    if (editor->file->modified) {
+    wait_for_save(editor, editor->file);
+    if (editor->file->doc->modified && editor->file->doc->refs == 1) {
       bool save_changes = true;
       if (prompt_get_yesno(editor, "Save changes?  (Answering no will DISCARD changes.)", &save_changes) < 0)
         break;
       if (save_changes) {
-        if (editor->file->filename) {
-          if (hed_write_file(editor->file, editor->file->filename) < 0)
+        if (editor->file->doc->filename) {
+          if (save_file(editor, editor->file->doc->filename) < 0)
             break;
         } else {
           if (prompt_save_file(editor) < 0)
             break;
         }
+        if (wait_for_save(editor, editor->file) < 0)
+          break;
       }
     }
     close_current_file(editor);
-    file = editor->file;
     if (! editor->file) {
       editor->quit = true;
       return;
     }
+    switch_to_file(editor, editor->file);
+    file = editor->file;
     scr->redraw_needed = true;
     break;
 
   case ALT_KEY('.'):
-    editor->file = editor->file->next;
+    switch_to_file(editor, editor->file->next);
     file = editor->file;
     scr->redraw_needed = true;
     reset_color();
@@ -979,7 +1671,7 @@ static void process_input(struct hed_editor *editor)
     break;
 
   case ALT_KEY(','):
-    editor->file = editor->file->prev;
+    switch_to_file(editor, editor->file->prev);
     file = editor->file;
     scr->redraw_needed = true;
     reset_color();
@@ -990,7 +1682,7 @@ static void process_input(struct hed_editor *editor)
     if (editor->file)
       show_msg("Current position: %08zx (dec %zu) %zu%%",
                editor->file->cursor_pos, editor->file->cursor_pos,
-               (editor->file->data_len>0) ? editor->file->cursor_pos*100/(editor->file->data_len-1) : 0);
+               (hed_file_len(editor->file)>1) ? editor->file->cursor_pos*100/(hed_file_len(editor->file)-1) : 0);
     break;
 
   case '\t':
@@ -1002,6 +1694,7 @@ static void process_input(struct hed_editor *editor)
     break;
 
   case CTRL_KEY('l'):
+    hed_refresh_file(file);
     clear_screen();
     scr->redraw_needed = true;
     break;
@@ -1021,7 +1714,7 @@ static void process_input(struct hed_editor *editor)
     break;
 
   case CTRL_KEY('o'):
-    if (! file->data)
+    if (! file->doc->buf)
       show_msg("No data to write!");
     else
       prompt_save_file(editor);
@@ -1033,25 +1726,32 @@ static void process_input(struct hed_editor *editor)
     break;
 
   case ALT_KEY('w'):
-    if (file && file->data && editor->search_str[0] != '\0')
-      perform_search(editor);
+  case ALT_KEY('q'):
+    if (file && file->doc->buf && editor->search_pattern && update_search_pattern(editor) == 0)
+      perform_search(editor, k == ALT_KEY('q'));
     break;
 
   case CTRL_KEY('w'):
-    if (file && file->data)
-      prompt_search(editor);
+  case CTRL_KEY('q'):
+    if (file && file->doc->buf)
+      prompt_search(editor, k == CTRL_KEY('q'));
+    break;
+
+  case ALT_KEY('f'):
+    if (file && file->doc->buf)
+      prompt_search_file(editor);
     break;
 
   case ALT_KEY('g'):
-    if (file->data) {
+    if (file->doc->buf) {
       char location_str[256];
       location_str[0] = '\0';
       if (prompt_get_string(editor, "Go to offset", location_str, sizeof(location_str)) < 0)
         break;
       char *end = NULL;
       errno = 0;
-      unsigned long offset = strtoul(location_str, &end, 16);
-      if (errno != 0 || *end != '\0') {
+      unsigned long long offset = strtoull(location_str, &end, 16);
+      if (errno != 0 || *end != '\0' || offset > SIZE_MAX) {
         show_msg("Bad offset: %s", location_str);
         break;
       }
@@ -1059,6 +1759,55 @@ static void process_input(struct hed_editor *editor)
     }
     break;
 
+  case KEY_INS:
+  case ALT_KEY('i'):
+    if (! editor->read_only) {
+      editor->insert_mode = ! editor->insert_mode;
+      clamp_cursor_pos(editor);
+      scr->redraw_needed = true;
+    }
+    break;
+
+  case KEY_DEL:
+    if (! editor->read_only)
+      delete_byte_at_cursor(editor);
+    break;
+
+  case 8:
+  case 127:
+    if (! editor->read_only && file->cursor_pos > 0) {
+      cursor_left(editor);
+      delete_byte_at_cursor(editor);
+    }
+    break;
+
+  case CTRL_KEY('z'):
+  case ALT_KEY('r'):
+    if (! editor->read_only) {
+      size_t pos;
+      int ret = hed_undo_file_change(file, k == ALT_KEY('r'), &pos);
+      if (ret < 0)
+        show_msg("ERROR: out of memory");
+      else if (ret == 0)
+        show_msg((k == ALT_KEY('r')) ? "Nothing to redo" : "Nothing to undo");
+      else {
+        editor->half_byte_edited = false;
+        hed_set_cursor_pos(editor, pos, 16);
+      }
+    }
+    break;
+
+  case ALT_KEY('j'):
+  case ALT_KEY('k'):
+    if (file->doc->buf) {
+      size_t data_pos;
+      if (hed_buffer_find_data(file->doc->buf, file->cursor_pos, k == ALT_KEY('k'), &data_pos))
+        hed_set_cursor_pos(editor, data_pos, 16);
+      else
+        show_msg("No more data extents");
+    }
+    break;
+
   case ALT_KEY('y'):
     editor->enable_byte_colors = ! editor->enable_byte_colors;
     clear_screen();
@@ -1138,34 +1887,36 @@ static void process_input(struct hed_editor *editor)
 #endif
   }
 
+  if (editor->file == old_file && file->cursor_pos != old_cursor_pos)
+    skip_unmapped_gap(editor, file->cursor_pos < old_cursor_pos);
+
   if (! editor->read_only) {
     bool reset_editing_byte = true;
-    if (file->data && file->cursor_pos < file->data_len) {
+    if (file->cursor_pos < get_cursor_limit(editor)) {
       if (file->pane == HED_PANE_TEXT) {
         if (k >= 32 && k < 0x7f) {
-          file->data[file->cursor_pos] = k;
-          editor->file->modified = true;
-          cursor_right(editor);
-          scr->redraw_needed = true;
+          if (put_byte_at_cursor(editor, k, editor->insert_mode) >= 0)
+            cursor_right(editor);
         }
       } else {
         int c = ((k >= '0' && k <= '9') ? k - '0' :
                  (k >= 'a' && k <= 'f') ? k - 'a' + 10 :
                  (k >= 'A' && k <= 'F') ? k - 'A' + 10 : -1);
         if (c >= 0) {
-          reset_editing_byte = false;
+          uint8_t b = 0;
+          get_file_u8(file, file->cursor_pos, &b);
           if (! editor->half_byte_edited) {
-            editor->half_byte_edited = true;
-            file->data[file->cursor_pos] &= 0x0f;
-            file->data[file->cursor_pos] |= c << 4;
+            bool insert = editor->insert_mode;
+            if (put_byte_at_cursor(editor, (insert) ? c << 4 : (b & 0x0f) | (c << 4), insert) >= 0) {
+              editor->half_byte_edited = true;
+              reset_editing_byte = false;
+            }
           } else {
-            editor->half_byte_edited = false;
-            file->data[file->cursor_pos] &= 0xf0;
-            file->data[file->cursor_pos] |= c;
-            cursor_right(editor);
+            if (put_byte_at_cursor(editor, (b & 0xf0) | c, false) >= 0) {
+              editor->half_byte_edited = false;
+              cursor_right(editor);
+            }
           }
-          editor->file->modified = true;
-          scr->redraw_needed = true;
         }
       }
     }
@@ -1200,18 +1951,24 @@ int hed_run_editor(struct hed_editor *editor, size_t start_cursor_pos)
     fprintf(stderr, "ERROR setting up terminal\n");
     return -1;
   }
-  hed_set_cursor_pos(editor, start_cursor_pos, 16);
-
   show_cursor(false);
   clear_screen();
+  hed_set_load_progress_func(draw_load_progress, editor);
+  switch_to_file(editor, editor->file);
+  hed_set_cursor_pos(editor, start_cursor_pos, 16);
 
   editor->quit = false;
   while (! editor->quit) {
     if (editor->screen.redraw_needed)
       draw_main_screen(editor);
     process_input(editor);
+    if (! editor->quit) {
+      poll_file_change(editor);
+      prefetch_data(editor);
+    }
   }
 
+  hed_set_load_progress_func(NULL, NULL);
   reset_color();
   clear_screen();
   show_cursor(true);
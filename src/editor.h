@@ -12,24 +12,47 @@
 #define EDITOR_BORDER_LINES     (EDITOR_HEADER_LINES+EDITOR_FOOTER_LINES)
 #define EDITOR_KEY_HELP_SPACING 16
 
+#define EDITOR_PREFETCH_MAX     (16*1024*1024)
+#define EDITOR_MAX_LOADED_FILES 8
+#define EDITOR_GROWTH_POLL_TIME 0.1     // seconds between checks for appended data
+#define EDITOR_CHANGE_CHECK_TIME 1.0    // seconds between checks for changes on disk
+#define EDITOR_MAX_PATTERN_FILE (64*1024*1024)
+#define EDITOR_SEARCH_BAR_LEN   20
+
 enum hed_editor_mode {
   HED_MODE_DEFAULT,
   HED_MODE_READ_FILENAME,
   HED_MODE_READ_STRING,
   HED_MODE_READ_YESNO,
+  HED_MODE_SEARCHING,
 };
 
 struct hed_file;
+struct hed_pattern;
+struct hed_search;
 
 struct hed_editor {
   bool quit;
   bool half_byte_edited;
+  bool insert_mode;
   bool read_only;
   bool enable_byte_colors;
   char search_str[256];
+  struct hed_pattern *search_pattern;
+  bool search_hex;              // 'search_pattern' has 'search_str' parsed as hex
+  bool search_file;             // 'search_pattern' was read from a file
+  struct hed_search *search;
   enum hed_editor_mode mode;
   struct hed_screen screen;
   struct hed_file *file;
+  size_t num_visits;
+
+  struct hed_file *prefetch_file;
+  size_t prefetch_pos;
+  double prefetch_time;
+
+  double growth_poll_time;
+  double change_check_time;
 };
 
 void hed_init_editor(struct hed_editor *editor);
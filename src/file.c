@@ -1,12 +1,30 @@
 /* file.c */
 
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 
 #include "file.h"
+#include "buffer.h"
+#include "store.h"
+#include "journal.h"
 #include "screen.h"
 
+// only the ends of longer runs of data touched by a change are checksummed
+#define MAX_SUM_PAGES_PER_CHANGE  64
+
 static int is_cpu_float_little_endian(void)
 {
   static int cpu_float_is_little_endian = -1;
@@ -19,15 +37,44 @@ static int is_cpu_float_little_endian(void)
   return cpu_float_is_little_endian;
 }
 
+static struct hed_document *new_document(void)
+{
+  struct hed_document *doc = malloc(sizeof(struct hed_document));
+  if (! doc)
+    return NULL;
+  doc->refs = 1;
+  doc->dev = 0;
+  doc->ino = 0;
+  doc->filename = NULL;
+  doc->buf = NULL;
+  doc->save = NULL;
+  doc->journal = NULL;
+  doc->journal_undo_base = 0;
+  doc->loaded = true;
+  doc->modified = false;
+  doc->streaming = false;
+  doc->last_visit = 0;
+  doc->pid = 0;
+  memset(&doc->disk, 0, sizeof(struct hed_disk_state));
+  doc->seen_disk = doc->disk;
+  doc->page_sums = NULL;
+  doc->num_page_sums = 0;
+  doc->page_sums_cap = 0;
+  return doc;
+}
+
 static struct hed_file *new_file(void)
 {
   struct hed_file *file = malloc(sizeof(struct hed_file));
+  if (! file)
+    return NULL;
+  file->doc = new_document();
+  if (! file->doc) {
+    free(file);
+    return NULL;
+  }
   file->next = NULL;
   file->prev = NULL;
-  file->filename = NULL;
-  file->data = NULL;
-  file->data_len = 0;
-  file->modified = false;
   file->show_data = false;
   file->pane = HED_PANE_HEX;
   file->top_line = 0;
@@ -40,205 +87,1443 @@ struct hed_file *hed_new_file_from_data(uint8_t *data, size_t data_len)
   struct hed_file *file = new_file();
   if (! file)
     return NULL;
-  
-  file->data = data;
-  file->data_len = data_len;
-  file->modified = (data != NULL);
+
+  if (data) {
+    struct hed_store *store = hed_new_memory_store(data, data_len);
+    if (store)
+      file->doc->buf = hed_new_buffer(store);
+    if (! file->doc->buf) {
+      if (store)
+        hed_free_store(store);
+      hed_free_file(file);
+      return NULL;
+    }
+    hed_buffer_mark_clean(file->doc->buf, false);
+  }
+  file->doc->modified = (data != NULL);
+  return file;
+}
+
+/*
+ * Create a file with the data arriving on 'fd', which is read in
+ * the background (see hed_poll_file_stream()) unless it's a regular
+ * file.
+ */
+struct hed_file *hed_read_stream(int fd)
+{
+  // A regular file (redirected stdin) doesn't have to be copied
+  struct stat st;
+  bool is_file = (fstat(fd, &st) == 0 && S_ISREG(st.st_mode));
+  struct hed_store *store = NULL;
+  if (is_file) {
+    int file_fd = dup(fd);
+    if (file_fd >= 0 && ! (store = hed_open_file_store(file_fd)))
+      close(file_fd);
+  } else
+    store = hed_open_stream_store(fd);
+  if (! store)
+    return NULL;
+  struct hed_buffer *buf = hed_new_buffer(store);
+  if (! buf) {
+    show_msg("ERROR: out of memory");
+    hed_free_store(store);
+    return NULL;
+  }
+  struct hed_file *file = new_file();
+  if (! file) {
+    show_msg("ERROR: out of memory");
+    hed_free_buffer(buf);
+    return NULL;
+  }
+  file->doc->buf = buf;
+  file->doc->modified = true;
+  file->doc->streaming = ! is_file;
+  hed_buffer_mark_clean(buf, false);
   return file;
 }
 
+/*
+ * Create a file showing the memory of process 'pid', at offsets equal
+ * to its virtual addresses (see hed_open_process_store()).
+ */
+struct hed_file *hed_read_process(pid_t pid)
+{
+  struct hed_store *store = hed_open_process_store(pid);
+  if (! store)
+    return NULL;
+  struct hed_buffer *buf = hed_new_buffer(store);
+  if (! buf) {
+    show_msg("ERROR: out of memory");
+    hed_free_store(store);
+    return NULL;
+  }
+  struct hed_file *file = new_file();
+  if (! file) {
+    show_msg("ERROR: out of memory");
+    hed_free_buffer(buf);
+    return NULL;
+  }
+  file->doc->buf = buf;
+  file->doc->pid = pid;
+  return file;
+}
+
+/*
+ * Drop the cached memory of a process, so what's shown next is
+ * current.
+ */
+void hed_refresh_file(struct hed_file *file)
+{
+  if (file->doc->pid && file->doc->buf)
+    hed_store_refresh(file->doc->buf->orig);
+}
+
+/*
+ * Add the data that was appended to a followed file (see
+ * hed_set_follow_files()) since the last call to the end of the
+ * file.  The file isn't marked as modified, since the data is the
+ * file's.  Returns true if the file changed.
+ */
+static bool poll_followed_file(struct hed_file *file)
+{
+  struct hed_buffer *buf = file->doc->buf;
+  if (! buf)
+    return false;
+  struct hed_store *store = buf->orig;
+  size_t old_len = store->len;
+  if (! hed_store_poll_follow(store))
+    return false;
+  if (hed_buffer_append_orig(buf, old_len, store->len - old_len) < 0) {
+    store->len = old_len;
+    show_msg("ERROR: out of memory");
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Add the stream data that arrived since the last call (or the data
+ * appended to a followed file) to the end of the file.  Returns true
+ * if the file changed.
+ */
+bool hed_poll_file_stream(struct hed_file *file)
+{
+  if (! file->doc->streaming)
+    return poll_followed_file(file);
+  struct hed_buffer *buf = file->doc->buf;
+  struct hed_store *stream = buf->orig;
+  size_t old_len = stream->len;
+  int ret = hed_store_poll_stream(stream);
+  if (ret <= 0) {
+    file->doc->streaming = false;
+    if (ret < 0)
+      show_msg("ERROR: error reading input");
+  }
+  if (stream->len == old_len)
+    return ! file->doc->streaming;
+  if (hed_buffer_append_orig(buf, old_len, stream->len - old_len) < 0) {
+    stream->len = old_len;
+    return false;
+  }
+  file->doc->modified = true;
+  return true;
+}
+
+static void release_document(struct hed_file *file)
+{
+  struct hed_document *doc = file->doc;
+  if (--doc->refs > 0)
+    return;
+  hed_wait_file_save(file);
+  if (doc->journal)
+    hed_close_journal(doc->journal, true);
+  if (doc->filename)
+    free(doc->filename);
+  if (doc->buf)
+    hed_free_buffer(doc->buf);
+  free(doc->page_sums);
+  free(doc);
+}
+
 void hed_free_file(struct hed_file *file)
 {
-  if (file->filename)
-    free(file->filename);
-  if (file->data)
-    free(file->data);
+  release_document(file);
   free(file);
 }
 
-struct hed_file *hed_read_file(const char *filename)
+/*
+ * Return true if 'other' is a view of the same file on disk as
+ * 'file' (even if opened through a different path).
+ */
+bool hed_is_same_file(struct hed_file *file, struct hed_file *other)
+{
+  if (file->doc == other->doc)
+    return true;
+  return (file->doc->filename && other->doc->filename && ! file->doc->streaming && ! other->doc->streaming
+          && file->doc->ino != 0 && file->doc->dev == other->doc->dev && file->doc->ino == other->doc->ino);
+}
+
+/*
+ * Make 'file' another view of the data of 'other', dropping its own.
+ * 'file' must not be modified.
+ */
+void hed_share_file(struct hed_file *file, struct hed_file *other)
+{
+  if (file->doc == other->doc)
+    return;
+  release_document(file);
+  file->doc = other->doc;
+  file->doc->refs++;
+}
+
+static void close_file_journal(struct hed_file *file)
+{
+  if (file->doc->journal) {
+    hed_close_journal(file->doc->journal, true);
+    file->doc->journal = NULL;
+  }
+}
+
+/*
+ * Start journaling the changes to the file.  This is only possible
+ * while the file is not modified, since the journal has to start
+ * from the data on disk.
+ */
+static void start_file_journal(struct hed_file *file)
+{
+  struct stat st;
+  if (file->doc->journal || file->doc->modified || file->doc->streaming || ! file->doc->filename
+      || stat(file->doc->filename, &st) < 0 || ! S_ISREG(st.st_mode))
+    return;
+  file->doc->journal = hed_create_journal(file->doc->filename, &st);
+  file->doc->journal_undo_base = file->doc->buf->undo_pos;
+}
+
+static uint64_t checksum_page(struct hed_store *store, size_t index)
+{
+  // FNV-1a, starting with the page length so a page that got shorter
+  // (or is now past the end) never matches
+  size_t off = index * HED_PAGE_SIZE;
+  size_t end = (store->len > off) ? off + HED_PAGE_SIZE : off;
+  if (end > store->len)
+    end = store->len;
+  uint64_t sum = 0xcbf29ce484222325ull ^ (end - off);
+  while (off < end) {
+    const uint8_t *data;
+    size_t n = hed_store_get_span(store, off, &data);
+    if (n == 0)
+      break;
+    if (n > end - off)
+      n = end - off;
+    for (size_t i = 0; i < n; i++)
+      sum = (sum ^ data[i]) * 0x100000001b3ull;
+    off += n;
+  }
+  return sum;
+}
+
+/*
+ * Return the position of the checksum of a page in the document's
+ * sorted list (or where it would be inserted).
+ */
+static size_t find_page_sum(struct hed_document *doc, size_t index)
+{
+  size_t lo = 0, hi = doc->num_page_sums;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (doc->page_sums[mid].index < index)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static int record_page_sum(struct hed_document *doc, size_t index)
+{
+  size_t i = find_page_sum(doc, index);
+  if (i < doc->num_page_sums && doc->page_sums[i].index == index)
+    return 0;
+  if (doc->num_page_sums == doc->page_sums_cap) {
+    size_t cap = (doc->page_sums_cap == 0) ? 16 : 2 * doc->page_sums_cap;
+    struct hed_page_sum *page_sums = realloc(doc->page_sums, cap * sizeof(struct hed_page_sum));
+    if (! page_sums)
+      return -1;
+    doc->page_sums = page_sums;
+    doc->page_sums_cap = cap;
+  }
+  memmove(&doc->page_sums[i+1], &doc->page_sums[i], (doc->num_page_sums - i) * sizeof(struct hed_page_sum));
+  doc->page_sums[i].index = index;
+  doc->page_sums[i].sum = checksum_page(doc->buf->orig, index);
+  doc->num_page_sums++;
+  return 0;
+}
+
+static void clear_page_sums(struct hed_document *doc)
+{
+  doc->num_page_sums = 0;
+}
+
+/*
+ * Record the checksums of the pages of original data that are about
+ * to be touched by a change to 'del_len' bytes at 'pos' (including
+ * the bytes around it).  Only the first and last pages of a long run
+ * of original data are recorded, so deleting or overwriting a big
+ * range doesn't read it all.
+ */
+static void record_changed_pages(struct hed_file *file, size_t pos, size_t del_len)
+{
+  struct hed_buffer *buf = file->doc->buf;
+  if (! file->doc->filename || file->doc->streaming || ! buf->orig || buf->orig->fd < 0)
+    return;
+  size_t end = (del_len < buf->len - pos) ? pos + del_len + 1 : buf->len;
+  if (pos > 0)
+    pos--;
+  while (pos < end) {
+    struct hed_piece_info info;
+    if (! hed_buffer_get_piece(buf, pos, &info))
+      break;
+    size_t piece_end = (info.pos + info.len < end) ? info.pos + info.len : end;
+    if (info.from_orig) {
+      size_t first = (info.orig_off + (pos - info.pos)) / HED_PAGE_SIZE;
+      size_t last = (info.orig_off + (piece_end - info.pos) - 1) / HED_PAGE_SIZE;
+      for (size_t index = first; index <= last; index++) {
+        if (last - first >= MAX_SUM_PAGES_PER_CHANGE && index == first + 1)
+          index = last;
+        if (record_page_sum(file->doc, index) < 0)
+          return;
+      }
+    }
+    pos = piece_end;
+  }
+}
+
+/*
+ * Replace 'del_len' bytes at 'pos' with 'len' bytes from 'data',
+ * recording the change in the journal.
+ */
+int hed_replace_file_data(struct hed_file *file, size_t pos, size_t del_len, const uint8_t *data, size_t len)
+{
+  if (! file->doc->buf && ! (file->doc->buf = hed_new_buffer(NULL)))
+    return -1;
+  struct hed_buffer *buf = file->doc->buf;
+  if (pos > buf->len)
+    return -1;
+  if (del_len > buf->len - pos)
+    del_len = buf->len - pos;
+  start_file_journal(file);
+
+  record_changed_pages(file, pos, del_len);
+
+  size_t undo_pos = buf->undo_pos;
+  if (hed_buffer_replace(buf, pos, del_len, data, len) < 0)
+    return -1;
+  file->doc->modified = true;
+  bool merged = (buf->undo_pos == undo_pos && undo_pos > 0);
+  if (file->doc->journal && hed_journal_replace(file->doc->journal, pos, del_len, data, len, merged) < 0) {
+    close_file_journal(file);
+    show_msg("ERROR: can't write journal for '%s'", file->doc->filename);
+  }
+  return 0;
+}
+
+/*
+ * Undo (or redo) the last change to the file, setting 'pos' to where
+ * it was.  Returns 0 if there was nothing to undo, 1 if a change was
+ * undone and -1 on errors.  Undoing changes made before the journal
+ * was started can't be journaled, so the journal is dropped then.
+ */
+int hed_undo_file_change(struct hed_file *file, bool redo, size_t *pos)
+{
+  if (! file->doc->buf)
+    return 0;
+  if (file->doc->journal && ! redo && file->doc->buf->undo_pos <= file->doc->journal_undo_base)
+    close_file_journal(file);
+  int ret = (redo) ? hed_buffer_redo(file->doc->buf, pos) : hed_buffer_undo(file->doc->buf, pos);
+  if (ret <= 0)
+    return ret;
+  file->doc->modified = file->doc->streaming || ! hed_buffer_is_clean(file->doc->buf);
+  if (! file->doc->modified)
+    clear_page_sums(file->doc);
+  if (file->doc->journal && hed_journal_undo(file->doc->journal, redo) < 0) {
+    close_file_journal(file);
+    show_msg("ERROR: can't write journal for '%s'", file->doc->filename);
+  }
+  return ret;
+}
+
+/*
+ * Return true if changes to the file that were never saved were
+ * found in its journal when it was opened.
+ */
+bool hed_file_has_journal(struct hed_file *file)
 {
-  FILE *f = fopen(filename, "r");
-  if (! f) {
+  return file->doc->journal && ! file->doc->modified;
+}
+
+/*
+ * Apply the changes found in the file's journal, setting 'pos' to
+ * where the last one was made.
+ */
+int hed_recover_file_journal(struct hed_file *file, size_t *pos)
+{
+  *pos = 0;
+  int ret = hed_replay_journal(file->doc->journal, file->doc->buf, pos);
+  if (ret != 0)
+    file->doc->modified = true;
+  file->doc->journal_undo_base = 0;
+  if (ret < 0) {
+    close_file_journal(file);
+    return show_msg("ERROR: can't read journal for '%s'", file->doc->filename);
+  }
+  return 0;
+}
+
+void hed_discard_file_journal(struct hed_file *file)
+{
+  close_file_journal(file);
+}
+
+/*
+ * Close the journal found for the file without applying or removing
+ * it, so the changes in it can still be recovered later.
+ */
+void hed_keep_file_journal(struct hed_file *file)
+{
+  if (file->doc->journal) {
+    hed_close_journal(file->doc->journal, false);
+    file->doc->journal = NULL;
+  }
+}
+
+void hed_sync_file_journal(struct hed_file *file)
+{
+  if (file->doc->journal && hed_sync_journal(file->doc->journal) < 0) {
+    close_file_journal(file);
+    show_msg("ERROR: can't write journal for '%s'", file->doc->filename);
+  }
+}
+
+static void get_disk_state(const struct stat *st, struct hed_disk_state *disk)
+{
+  disk->dev = st->st_dev;
+  disk->ino = st->st_ino;
+  disk->size = st->st_size;
+  disk->mtime = st->st_mtim;
+}
+
+static bool same_disk_state(const struct hed_disk_state *a, const struct hed_disk_state *b)
+{
+  return (a->dev == b->dev && a->ino == b->ino && a->size == b->size
+          && a->mtime.tv_sec == b->mtime.tv_sec && a->mtime.tv_nsec == b->mtime.tv_nsec);
+}
+
+/*
+ * Note 'st' as the state of the file on disk matching the document's
+ * original data.
+ */
+static void set_disk_state(struct hed_document *doc, const struct stat *st)
+{
+  doc->dev = st->st_dev;
+  doc->ino = st->st_ino;
+  get_disk_state(st, &doc->disk);
+  doc->seen_disk = doc->disk;
+}
+
+/*
+ * Get the current state on disk of a file whose changes are
+ * tracked: a loaded regular file that's not being saved or followed.
+ */
+static bool get_current_disk_state(struct hed_file *file, struct hed_disk_state *disk)
+{
+  struct hed_document *doc = file->doc;
+  if (! doc->loaded || ! doc->buf || ! doc->filename || doc->streaming || doc->save
+      || ! doc->buf->orig || doc->buf->orig->fd < 0 || doc->buf->orig->follow)
+    return false;
+  struct stat st;
+  if (stat(doc->filename, &st) < 0 || ! S_ISREG(st.st_mode))
+    return false;
+  get_disk_state(&st, disk);
+  return true;
+}
+
+/*
+ * Return true if the file was changed on disk by someone else since
+ * the last call (or since it was read or saved).  While a snapshot of
+ * the data is in use (by a search or a save) the file can't be
+ * reloaded, so the change is left to be seen when it's released.
+ */
+bool hed_poll_file_change(struct hed_file *file)
+{
+  struct hed_disk_state disk;
+  if (file->doc->buf && file->doc->buf->num_snapshots > 0)
+    return false;
+  if (! get_current_disk_state(file, &disk) || same_disk_state(&disk, &file->doc->seen_disk))
+    return false;
+  file->doc->seen_disk = disk;
+  return true;
+}
+
+/*
+ * Return true if the file on disk is not the one the data was read
+ * from (or last saved to), so saving would overwrite someone else's
+ * changes.
+ */
+bool hed_file_changed_on_disk(struct hed_file *file)
+{
+  struct hed_disk_state disk;
+  return get_current_disk_state(file, &disk) && ! same_disk_state(&disk, &file->doc->disk);
+}
+
+/*
+ * Read the file again after it was changed on disk.  Local changes
+ * are kept (see hed_buffer_rebase()): the parts of the file that
+ * weren't edited show the new data, without reading anything now.
+ * The pages with local changes that also changed on disk are added
+ * to 'conflicts' (as offsets in the file).  The journal is dropped,
+ * since it describes changes to the old data.
+ */
+int hed_reload_file(struct hed_file *file, struct hed_extent_set *conflicts)
+{
+  struct hed_document *doc = file->doc;
+  if (! doc->loaded || ! doc->buf || ! doc->filename || doc->streaming)
+    return 0;
+  if (doc->save)
+    return show_msg("ERROR: the file is still being saved");
+  if (doc->buf->num_snapshots > 0)
+    return show_msg("ERROR: the file is still being searched");
+
+  int fd = open(doc->filename, O_RDONLY);
+  if (fd < 0)
+    return show_msg("ERROR: can't open file '%s'", doc->filename);
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return show_msg("ERROR: can't open file '%s'", doc->filename);
+  }
+  struct hed_store *store = hed_open_file_store(fd);
+  if (! store) {
+    close(fd);
+    return -1;
+  }
+
+  int ret;
+  if (doc->modified) {
+    for (size_t i = 0; i < doc->num_page_sums; i++) {
+      struct hed_page_sum *page_sum = &doc->page_sums[i];
+      uint64_t sum = checksum_page(store, page_sum->index);
+      if (sum != page_sum->sum && hed_add_extent(conflicts, page_sum->index * HED_PAGE_SIZE, HED_PAGE_SIZE) < 0) {
+        hed_free_store(store);
+        return show_msg("ERROR: out of memory");
+      }
+      page_sum->sum = sum;
+    }
+    ret = hed_buffer_rebase(doc->buf, store);
+  } else {
+    clear_page_sums(doc);
+    ret = hed_buffer_reset(doc->buf, store);
+  }
+  if (ret < 0) {
+    hed_free_store(store);
+    return show_msg("ERROR: out of memory");
+  }
+  close_file_journal(file);
+  set_disk_state(doc, &st);
+  return 0;
+}
+
+size_t hed_file_len(struct hed_file *file)
+{
+  return (file->doc->buf) ? file->doc->buf->len : 0;
+}
+
+/*
+ * Create a file for 'filename' without reading anything yet: the
+ * data is only opened by hed_load_file().
+ */
+struct hed_file *hed_open_file(const char *filename)
+{
+  struct stat st;
+  if (stat(filename, &st) < 0) {
     show_msg("ERROR: can't open file '%s'", filename);
     return NULL;
   }
 
-  uint8_t *data = NULL;
+  struct hed_file *file = new_file();
+  if (! file) {
+    show_msg("ERROR: out of memory");
+    return NULL;
+  }
   char *new_filename = malloc(strlen(filename) + 1);
   if (! new_filename) {
     show_msg("ERROR: out of memory");
-    goto err;
+    hed_free_file(file);
+    return NULL;
   }
   strcpy(new_filename, filename);
-  
-  if (fseek(f, 0, SEEK_END) < 0) {
-    show_msg("ERROR: can't determine file size");
-    goto err;
-  }
-  long size = ftell(f);
-  if (size < 0 || (unsigned long) size > SIZE_MAX) {
-    show_msg("ERROR: file is too large");
-    goto err;
-  }
-  if (fseek(f, 0, SEEK_SET) == -1) {
-    show_msg("ERROR: can't seek to start of file");
-    goto err;
-  }
-  data = malloc((size_t) size);
-  if (! data) {
-    show_msg("ERROR: not enough memory for %ld bytes", size);
-    goto err;
-  }
-  
-  if (fread(data, 1, size, f) != (size_t) size) {
-    show_msg("ERROR: error reading file");
-    goto err;
-  }
-  
-  struct hed_file *file = new_file();
-  if (! file) {
-    show_msg("ERROR: error reading file");
-    goto err;
+  file->doc->filename = new_filename;
+  file->doc->dev = st.st_dev;
+  file->doc->ino = st.st_ino;
+  file->doc->loaded = false;
+  return file;
+}
+
+/*
+ * Open the data of a file created by hed_open_file() (or released by
+ * hed_unload_file()), if it's not open yet.
+ */
+int hed_load_file(struct hed_file *file)
+{
+  if (file->doc->loaded)
+    return 0;
+
+  int fd = open(file->doc->filename, O_RDONLY);
+  if (fd < 0)
+    return show_msg("ERROR: can't open file '%s'", file->doc->filename);
+
+  struct hed_store *store = hed_open_file_store(fd);
+  if (! store) {
+    close(fd);
+    return -1;
+  }
+
+  struct hed_buffer *buf = hed_new_buffer(store);
+  if (! buf) {
+    hed_free_store(store);
+    return show_msg("ERROR: out of memory");
+  }
+  struct stat st;
+  if (fstat(fd, &st) == 0)
+    set_disk_state(file->doc, &st);
+  file->doc->buf = buf;
+  file->doc->journal = hed_open_journal(file->doc->filename, fd);
+  file->doc->loaded = true;
+  return 0;
+}
+
+/*
+ * Release the data of a file that can be opened again from disk
+ * without losing anything: one that's not modified, saving or being
+ * journaled.  The undo history goes with it.  Returns true if the
+ * data was released.
+ */
+bool hed_unload_file(struct hed_file *file)
+{
+  if (! file->doc->loaded || ! file->doc->filename || file->doc->modified || file->doc->streaming || file->doc->save || file->doc->journal)
+    return false;
+  if (file->doc->buf)
+    hed_free_buffer(file->doc->buf);
+  file->doc->buf = NULL;
+  file->doc->loaded = false;
+  return true;
+}
+
+struct hed_file *hed_read_file(const char *filename)
+{
+  struct hed_file *file = hed_open_file(filename);
+  if (! file)
+    return NULL;
+  if (hed_load_file(file) < 0) {
+    hed_free_file(file);
+    return NULL;
   }
-  file->data = data;
-  file->data_len = size;
-  file->filename = new_filename;
-  fclose(f);
   return file;
+}
+
+#define COPY_STEP_SIZE     (16*1024*1024)
+#define DEVICE_WRITE_SIZE  (1024*1024)
+
+enum hed_save_method {
+  HED_SAVE_EXTENTS,
+  HED_SAVE_REPLACE,
+  HED_SAVE_DIRECT,
+  HED_SAVE_DEVICE,
+};
+
+/*
+ * A save running in a worker thread.  The worker writes a snapshot
+ * of the buffer, so the file can be edited while it's being saved;
+ * it never touches the file itself or the screen.
+ */
+struct hed_save {
+  pthread_t thread;
+  struct hed_snapshot *snap;
+  enum hed_save_method method;
+  char *filename;
+  char *target;
+  bool exists;
+  struct stat st;
+  size_t journal_off;
+  size_t undo_pos;
+  const struct hed_extent_set *extents;
+  struct hed_extent_set whole;
+  size_t block_size;
+  struct timespec start;
+  size_t total_bytes;
+  atomic_size_t done_bytes;
+  atomic_bool finished;
+  int ret;
+};
+
+static int write_range(struct hed_save *save, int fd, size_t pos, size_t len)
+{
+  struct hed_span span;
+  size_t end = pos + len;
+  while (pos < end && hed_snapshot_get_span(save->snap, pos, &span)) {
+    size_t span_len = (span.len < end - pos) ? span.len : end - pos;
+    size_t done = 0;
+    while (done < span_len) {
+      size_t step = (span_len - done < COPY_STEP_SIZE) ? span_len - done : COPY_STEP_SIZE;
+      ssize_t n = pwrite(fd, span.data + done, step, pos + done);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return -1;
+      done += n;
+      atomic_fetch_add(&save->done_bytes, n);
+    }
+    pos += span_len;
+  }
+  return (pos == end) ? 0 : -1;
+}
+
+static int write_extents(struct hed_save *save, int fd, const struct hed_extent_set *extents)
+{
+  for (size_t i = 0; i < extents->num_extents; i++) {
+    if (write_range(save, fd, extents->extents[i].pos, extents->extents[i].len) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+/*
+ * Return the ranges that have to be written to bring the file the
+ * buffer was read from up to date, or NULL if the whole file has to
+ * be written (because its size changed or data was moved around).
+ */
+static const struct hed_extent_set *get_changed_extents(struct hed_buffer *buf)
+{
+  if (! buf->orig || buf->orig->fd < 0 || buf->len != buf->orig->len || ! hed_buffer_is_in_place(buf))
+    return NULL;
+  return hed_buffer_get_changes(buf);
+}
+
+const struct hed_extent_set *hed_file_get_pending_changes(struct hed_file *file)
+{
+  if (! file->doc->buf || ! file->doc->filename)
+    return NULL;
+  return get_changed_extents(file->doc->buf);
+}
+
+/*
+ * Replace the buffer's original data with the file it was just
+ * written to, so the next save can again write only what changed.
+ * Returns -1 if that's not possible (the buffer can't be reset while
+ * it has snapshots).
+ */
+static int reopen_orig(struct hed_buffer *buf, const char *filename)
+{
+  if (buf->num_snapshots > 0)
+    return -1;
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  struct hed_store *store = hed_open_file_store(fd);
+  if (! store) {
+    close(fd);
+    return -1;
+  }
+  if (hed_buffer_reset(buf, store) < 0) {
+    hed_free_store(store);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Copy a range of the original file to 'fd' with copy_file_range(),
+ * so the data doesn't have to pass through user space.  Returns the
+ * number of bytes copied, which may be less than requested if the
+ * filesystems don't support it.
+ */
+static size_t copy_file_data(struct hed_save *save, int src_fd, int fd, size_t off, size_t pos, size_t len)
+{
+  loff_t in_off = off;
+  loff_t out_off = pos;
+  size_t done = 0;
+  while (done < len) {
+    // copy in steps, so the save progress keeps moving
+    size_t step = (len - done < COPY_STEP_SIZE) ? len - done : COPY_STEP_SIZE;
+    ssize_t n = copy_file_range(src_fd, &in_off, fd, &out_off, step, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    done += n;
+    atomic_fetch_add(&save->done_bytes, n);
+  }
+  return done;
+}
+
+/*
+ * Share a range of the original file's blocks with 'fd' using
+ * FICLONERANGE.  The offsets and length must be multiples of the
+ * filesystem block size (except that the range may end at the end of
+ * the original file).  Returns false if the filesystem can't do it.
+ */
+static bool clone_file_data(struct hed_save *save, struct hed_store *orig, int fd, size_t off, size_t pos, size_t len)
+{
+  struct file_clone_range range = {
+    .src_fd = orig->fd,
+    .src_offset = off,
+    .src_length = (off + len == orig->len) ? 0 : len,
+    .dest_offset = pos,
+  };
+  if (ioctl(fd, FICLONERANGE, &range) != 0)
+    return false;
+  atomic_fetch_add(&save->done_bytes, len);
+  return true;
+}
+
+/*
+ * Copy a range of the original file to 'fd' without passing the
+ * data through user space: the block-aligned middle of the range is
+ * cloned if the filesystem supports reflinks, and the rest is copied
+ * with copy_file_range().  Returns the number of bytes copied.
+ */
+static size_t copy_orig_range(struct hed_save *save, int fd, size_t off, size_t pos, size_t len, size_t block_size, bool *can_clone)
+{
+  struct hed_store *orig = save->snap->orig;
+  if (*can_clone && off % block_size == pos % block_size) {
+    size_t head = (block_size - off % block_size) % block_size;
+    if (head < len) {
+      size_t mid = (len - head) / block_size * block_size;
+      if (off + len == orig->len)
+        mid = len - head;
+      if (mid > 0) {
+        if (copy_file_data(save, orig->fd, fd, off, pos, head) < head)
+          return 0;
+        if (clone_file_data(save, orig, fd, off + head, pos + head, mid)) {
+          size_t tail = len - head - mid;
+          return head + mid + copy_file_data(save, orig->fd, fd, off + head + mid, pos + head + mid, tail);
+        }
+        *can_clone = false;
+        return head + copy_file_data(save, orig->fd, fd, off + head, pos + head, len - head);
+      }
+    }
+  }
+  return copy_file_data(save, orig->fd, fd, off, pos, len);
+}
+
+/*
+ * Write the whole snapshot to a new file, sharing or copying the
+ * unmodified pieces directly from the original file when possible.
+ */
+static int write_buffer_copying(struct hed_save *save, int fd)
+{
+  struct hed_snapshot *snap = save->snap;
+  struct hed_store *orig = snap->orig;
+  bool can_copy = (orig && orig->fd >= 0);
+
+  // If the original data wasn't moved, clone the whole original file
+  // and write only the changes over it.  On filesystems with reflinks
+  // (btrfs, XFS) this costs almost nothing, however big the file is.
+  if (can_copy && snap->in_place && ioctl(fd, FICLONE, orig->fd) == 0) {
+    atomic_fetch_add(&save->done_bytes, snap->len - snap->changes.num_bytes);
+    if (write_extents(save, fd, &snap->changes) < 0)
+      return -1;
+    return ftruncate(fd, snap->len);
+  }
+
+  struct stat st;
+  size_t block_size = (can_copy && fstat(orig->fd, &st) == 0 && st.st_blksize > 0) ? st.st_blksize : 4096;
+  bool can_clone = can_copy;
+  struct hed_piece_info piece;
+  size_t pos = 0;
+  while (pos < snap->len && hed_snapshot_get_piece(snap, pos, &piece)) {
+    size_t off = piece.orig_off + (pos - piece.pos);
+    size_t len = piece.pos + piece.len - pos;
+    if (piece.from_orig && orig->holes) {
+      // Holes in the original data are left as holes in the new file
+      // (which gets its final size from ftruncate() below).
+      bool is_hole;
+      size_t run = hed_store_get_run(orig, off, &is_hole);
+      if (run > 0 && run < len)
+        len = run;
+      if (is_hole) {
+        atomic_fetch_add(&save->done_bytes, len);
+        pos += len;
+        continue;
+      }
+    }
+    size_t done = 0;
+    if (piece.from_orig && can_copy) {
+      done = copy_orig_range(save, fd, off, pos, len, block_size, &can_clone);
+      if (done < len)
+        can_copy = false;
+    }
+    if (write_range(save, fd, pos + done, len - done) < 0)
+      return -1;
+    pos += len;
+  }
+  return ftruncate(fd, snap->len);
+}
+
+static void sync_parent_dir(const char *filename)
+{
+  char *dir_end = strrchr(filename, '/');
+  char *dirname = malloc(strlen(filename) + 2);
+  if (! dirname)
+    return;
+  if (! dir_end)
+    strcpy(dirname, ".");
+  else if (dir_end == filename)
+    strcpy(dirname, "/");
+  else {
+    memcpy(dirname, filename, dir_end - filename);
+    dirname[dir_end - filename] = '\0';
+  }
+  int fd = open(dirname, O_RDONLY | O_DIRECTORY);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+  free(dirname);
+}
+
+/*
+ * Write the snapshot to a temporary file next to the target, sync it
+ * and rename it over the target.  If anything goes wrong (including
+ * errors reading the original data), the old file is left untouched.
+ */
+static int write_buffer_replacing(struct hed_save *save)
+{
+  const char *filename = save->target;
+  char *tmp_filename = malloc(strlen(filename) + sizeof(".hed-XXXXXX"));
+  if (! tmp_filename)
+    return -1;
+  strcpy(tmp_filename, filename);
+  strcat(tmp_filename, ".hed-XXXXXX");
+
+  mode_t mode;
+  if (save->exists)
+    mode = save->st.st_mode & 07777;
+  else {
+    mode_t mask = umask(0);
+    umask(mask);
+    mode = 0666 & ~mask;
+  }
+
+  int fd = mkstemp(tmp_filename);
+  if (fd < 0) {
+    free(tmp_filename);
+    return -1;
+  }
+  if (save->exists && fchown(fd, save->st.st_uid, save->st.st_gid) < 0) {
+    // not an error: we may not be allowed to give the file away
+  }
+  if (fchmod(fd, mode) < 0 || write_buffer_copying(save, fd) < 0 || fsync(fd) < 0 || hed_store_had_read_errors()) {
+    close(fd);
+    unlink(tmp_filename);
+    free(tmp_filename);
+    return -1;
+  }
+  if (close(fd) < 0 || rename(tmp_filename, filename) < 0) {
+    unlink(tmp_filename);
+    free(tmp_filename);
+    return -1;
+  }
+  free(tmp_filename);
+  sync_parent_dir(filename);
+  return 0;
+}
+
+/*
+ * Write the snapshot directly to the target, for targets that can't
+ * be replaced by renaming (like character devices).
+ */
+static int write_buffer_direct(struct hed_save *save)
+{
+  int fd = open(save->filename, O_WRONLY);
+  if (fd < 0)
+    return -1;
+  int ret = write_range(save, fd, 0, save->snap->len);
+  if (close(fd) < 0)
+    ret = -1;
+  return ret;
+}
+
+/*
+ * Write the changed extents over the file the buffer was read from.
+ */
+static int write_buffer_extents(struct hed_save *save)
+{
+  int fd = open(save->filename, O_WRONLY);
+  if (fd < 0)
+    return -1;
+  int ret = write_extents(save, fd, &save->snap->changes);
+  if (ret == 0)
+    ret = fdatasync(fd);
+  if (close(fd) < 0)
+    ret = -1;
+  return ret;
+}
+
+static int pread_full(int fd, uint8_t *data, size_t len, size_t pos)
+{
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = pread(fd, data + done, len - done, pos + done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    done += n;
+  }
+  return 0;
+}
+
+static int pwrite_full(int fd, const uint8_t *data, size_t len, size_t pos)
+{
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = pwrite(fd, data + done, len - done, pos + done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    done += n;
+  }
+  return 0;
+}
+
+/*
+ * Write the range [pos, end) of the snapshot to a block device.  The
+ * range is block-aligned, so if it extends past the end of the data
+ * the rest of the last block is read back from the device first.
+ */
+static int write_device_range(struct hed_save *save, int fd, uint8_t *data, size_t pos, size_t end)
+{
+  struct hed_snapshot *snap = save->snap;
+  while (pos < end) {
+    size_t len = (end - pos < DEVICE_WRITE_SIZE) ? end - pos : DEVICE_WRITE_SIZE;
+    size_t have = (snap->len - pos < len) ? snap->len - pos : len;
+    if (have < len) {
+      size_t tail = (pos + have) / save->block_size * save->block_size;
+      if (pread_full(fd, data + (tail - pos), pos + len - tail, tail) < 0)
+        return -1;
+    }
+    if (hed_snapshot_read(snap, pos, data, have) < have || pwrite_full(fd, data, len, pos) < 0)
+      return -1;
+    atomic_fetch_add(&save->done_bytes, len);
+    pos += len;
+  }
+  return 0;
+}
+
+static size_t align_down(size_t pos, size_t block_size)
+{
+  return pos / block_size * block_size;
+}
 
- err:
-  if (new_filename)
-    free(new_filename);
-  if (data)
-    free(data);
-  fclose(f);
+static size_t align_up(size_t pos, size_t block_size)
+{
+  return (pos + block_size - 1) / block_size * block_size;
+}
+
+/*
+ * Return the number of bytes written to a device for the save's
+ * extents, which are rounded out to whole blocks.
+ */
+static size_t get_device_write_len(struct hed_save *save)
+{
+  const struct hed_extent_set *extents = save->extents;
+  size_t total = 0;
+  size_t last_end = 0;
+  for (size_t i = 0; i < extents->num_extents; i++) {
+    size_t start = align_down(extents->extents[i].pos, save->block_size);
+    size_t end = align_up(extents->extents[i].pos + extents->extents[i].len, save->block_size);
+    if (start < last_end)
+      start = last_end;
+    total += end - start;
+    last_end = end;
+  }
+  return total;
+}
+
+/*
+ * Write the save's extents to a block device, bypassing the kernel's
+ * page cache.  Extents are rounded out to whole sectors (the data
+ * around them comes from the snapshot, which has the original
+ * device data there), and extents that share a sector are written
+ * together.
+ */
+static int write_buffer_device(struct hed_save *save)
+{
+  int fd = open(save->filename, O_RDWR | O_DIRECT);
+  if (fd < 0)
+    fd = open(save->filename, O_RDWR);
+  if (fd < 0)
+    return -1;
+  void *data;
+  size_t align = (save->block_size > 4096) ? save->block_size : 4096;
+  if (posix_memalign(&data, align, DEVICE_WRITE_SIZE) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  int ret = 0;
+  const struct hed_extent_set *extents = save->extents;
+  size_t i = 0;
+  while (ret == 0 && i < extents->num_extents) {
+    size_t start = align_down(extents->extents[i].pos, save->block_size);
+    size_t end = align_up(extents->extents[i].pos + extents->extents[i].len, save->block_size);
+    for (i++; i < extents->num_extents && align_down(extents->extents[i].pos, save->block_size) <= end; i++) {
+      size_t ext_end = align_up(extents->extents[i].pos + extents->extents[i].len, save->block_size);
+      if (ext_end > end)
+        end = ext_end;
+    }
+    ret = write_device_range(save, fd, data, start, end);
+  }
+  if (ret == 0)
+    ret = fsync(fd);
+  free(data);
+  if (close(fd) < 0)
+    ret = -1;
+  return ret;
+}
+
+static void *save_thread(void *arg)
+{
+  struct hed_save *save = arg;
+
+  hed_store_enter_thread();
+  switch (save->method) {
+  case HED_SAVE_EXTENTS: save->ret = write_buffer_extents(save); break;
+  case HED_SAVE_REPLACE: save->ret = write_buffer_replacing(save); break;
+  case HED_SAVE_DIRECT:  save->ret = write_buffer_direct(save); break;
+  case HED_SAVE_DEVICE:  save->ret = write_buffer_device(save); break;
+  }
+  hed_store_leave_thread();
+
+  atomic_store(&save->finished, true);
   return NULL;
 }
 
+static void free_save(struct hed_save *save)
+{
+  if (save->snap)
+    hed_free_snapshot(save->snap);
+  free(save->filename);
+  free(save->target);
+  free(save->whole.extents);
+  free(save);
+}
+
+/*
+ * Check that the snapshot can be written to the block device
+ * 'save->target' and set up what to write: only the changed extents
+ * if it's the device the data was read from, or everything.
+ */
+static int prepare_device_save(struct hed_save *save, struct hed_buffer *buf, bool same_file, bool in_place)
+{
+  int fd = open(save->target, O_RDONLY);
+  if (fd < 0)
+    return show_msg("ERROR: can't open device '%s'", save->filename);
+  uint64_t size = 0;
+  int sector_size = 0;
+  if (ioctl(fd, BLKGETSIZE64, &size) < 0 || ioctl(fd, BLKSSZGET, &sector_size) < 0 || sector_size <= 0) {
+    close(fd);
+    return show_msg("ERROR: can't get size of device '%s'", save->filename);
+  }
+  close(fd);
+  save->block_size = sector_size;
+
+  if (save->snap->len > size)
+    return show_msg("ERROR: data doesn't fit in device '%s'", save->filename);
+  if (same_file) {
+    // Data read from the device can't be moved around on it, since
+    // it could be overwritten before being read.
+    if (! in_place)
+      return show_msg("ERROR: only overwriting is supported when saving to the same device");
+    // the undo history must not use the device data about to be
+    // overwritten (see hed_write_file())
+    if (hed_buffer_detach_orig(buf, &save->snap->changes) < 0)
+      return show_msg("ERROR: out of memory");
+    save->extents = &save->snap->changes;
+    return 0;
+  }
+  if (hed_add_extent(&save->whole, 0, save->snap->len) < 0)
+    return show_msg("ERROR: out of memory");
+  save->extents = &save->whole;
+  return 0;
+}
+
+/*
+ * Start saving the file to 'filename' in the background.  The data
+ * saved is the file contents at the time of the call; use
+ * hed_poll_file_save() to see when it's done.
+ */
 int hed_write_file(struct hed_file *file, const char *filename)
 {
-  if (! file->data)
+  if (! file->doc->buf)
     return 0;
+  if (file->doc->save)
+    return show_msg("ERROR: the file is still being saved");
 
-  char *new_filename = NULL;
-  if (! file->filename || strcmp(filename, file->filename) != 0) {
-    new_filename = malloc(strlen(filename) + 1);
-    if (! new_filename)
-      return show_msg("ERROR: out of memory");
-    strcpy(new_filename, filename);
+  struct hed_save *save = malloc(sizeof(struct hed_save));
+  if (! save)
+    return show_msg("ERROR: out of memory");
+  save->filename = malloc(strlen(filename) + 1);
+  save->snap = hed_buffer_snapshot(file->doc->buf);
+  save->journal_off = (file->doc->journal) ? hed_journal_size(file->doc->journal) : 0;
+  save->undo_pos = file->doc->buf->undo_pos;
+  save->extents = NULL;
+  save->whole.extents = NULL;
+  save->whole.num_extents = 0;
+  save->whole.cap = 0;
+  save->whole.num_bytes = 0;
+  // Replace the file a symbolic link points to, not the link
+  save->target = realpath(filename, NULL);
+  if (! save->filename || ! save->snap || (! save->target && ! (save->target = strdup(filename)))) {
+    free_save(save);
+    return show_msg("ERROR: out of memory");
   }
-  
-  FILE *f = fopen(filename, "w");
-  if (! f) {
-    free(new_filename);
-    return show_msg("ERROR: can't open file '%s'", filename);
+  strcpy(save->filename, filename);
+
+  save->exists = (stat(save->target, &save->st) == 0);
+  struct hed_store *orig = save->snap->orig;
+  bool same_file = (save->exists && orig && orig->fd >= 0 && save->st.st_dev == orig->dev && save->st.st_ino == orig->ino);
+  bool in_place = (same_file && save->snap->len == orig->len && save->snap->in_place);
+  if (save->exists && S_ISBLK(save->st.st_mode)) {
+    save->method = HED_SAVE_DEVICE;
+    if (prepare_device_save(save, file->doc->buf, same_file, in_place) < 0) {
+      free_save(save);
+      return -1;
+    }
+  } else if (save->exists && ! S_ISREG(save->st.st_mode))
+    save->method = HED_SAVE_DIRECT;
+  else if (in_place && hed_buffer_detach_orig(file->doc->buf, &save->snap->changes) == 0) {
+    // Writing in place changes the original data under the buffer,
+    // so the undo history (which may be used while saving) now keeps
+    // its own copy of the data that will be overwritten
+    save->method = HED_SAVE_EXTENTS;
+  } else
+    save->method = HED_SAVE_REPLACE;
+
+  switch (save->method) {
+  case HED_SAVE_EXTENTS: save->total_bytes = save->snap->changes.num_bytes; break;
+  case HED_SAVE_DEVICE:  save->total_bytes = get_device_write_len(save); break;
+  default:               save->total_bytes = save->snap->len; break;
   }
-  if (fwrite(file->data, 1, file->data_len, f) != file->data_len) {
-    free(new_filename);
-    fclose(f);
-    return show_msg("ERROR: can't write file '%s'", filename);
+  atomic_init(&save->done_bytes, 0);
+  atomic_init(&save->finished, false);
+  save->ret = 0;
+  clock_gettime(CLOCK_MONOTONIC, &save->start);
+  if (pthread_create(&save->thread, NULL, save_thread, save) != 0) {
+    free_save(save);
+    return show_msg("ERROR: can't start saving file '%s'", filename);
   }
-  fclose(f);
-  show_msg("File saved: '%s'", filename);
-  file->modified = false;
+  file->doc->save = save;
+  return 0;
+}
 
-  if (new_filename) {
-    if (file->filename)
-      free(file->filename);
-    file->filename = new_filename;
+/*
+ * Collect the result of a finished save.  The file is marked as not
+ * modified only if it wasn't changed since the save started.
+ */
+static int finish_save(struct hed_file *file)
+{
+  struct hed_save *save = file->doc->save;
+  pthread_join(save->thread, NULL);
+  file->doc->save = NULL;
+
+  if (save->ret < 0) {
+    show_msg("ERROR: can't write file '%s'", save->filename);
+    free_save(save);
+    return -1;
   }
+  if (save->method == HED_SAVE_EXTENTS)
+    show_msg("File saved: '%s' (%zu bytes in %zu extents)", save->filename,
+             save->snap->changes.num_bytes, save->snap->changes.num_extents);
+  else
+    show_msg("File saved: '%s'", save->filename);
+
+  bool current = (save->snap->generation == file->doc->buf->generation);
+  hed_free_snapshot(save->snap);
+  save->snap = NULL;
+  hed_buffer_mark_clean(file->doc->buf, current && ! file->doc->streaming);
+  if (current && ! file->doc->streaming) {
+    file->doc->modified = false;
+    clear_page_sums(file->doc);
+    if (reopen_orig(file->doc->buf, save->filename) < 0) {
+      // The buffer still shows the saved data: nothing refers to the
+      // original data overwritten in place, and a replaced file keeps
+      // its old data.  Only the next save may write more than needed.
+      show_msg("File saved: '%s' (the next save will write all changes again)", save->filename);
+    }
+    close_file_journal(file);
+  } else if (file->doc->journal) {
+    // the changes made during the save now apply to the saved file
+    // (the buffer keeps the old original data, but nothing refers to
+    // the parts an in-place save overwrote)
+    file->doc->journal = hed_rebase_journal(file->doc->journal, save->journal_off, save->filename);
+    file->doc->journal_undo_base = save->undo_pos;
+  }
+
+  struct stat st;
+  if (stat(save->filename, &st) == 0)
+    set_disk_state(file->doc, &st);
+  if (! file->doc->filename || strcmp(file->doc->filename, save->filename) != 0) {
+    free(file->doc->filename);
+    file->doc->filename = save->filename;
+    save->filename = NULL;
+  }
+  free_save(save);
   return 0;
 }
 
-bool get_file_u8(struct hed_file *file, size_t pos, uint8_t *data)
+/*
+ * Check on the file's background save, finishing it if it's done.
+ * Returns 1 while the save is still running, -1 if it failed and 0
+ * otherwise.
+ */
+int hed_poll_file_save(struct hed_file *file)
+{
+  if (! file->doc->save)
+    return 0;
+  if (! atomic_load(&file->doc->save->finished))
+    return 1;
+  // finishing resets the buffer, so wait for other snapshots (of a
+  // background search) to be released
+  if (file->doc->buf->num_snapshots > 1)
+    return 1;
+  return finish_save(file);
+}
+
+/*
+ * Wait for the file's background save to finish.  Returns -1 if it
+ * failed.
+ */
+int hed_wait_file_save(struct hed_file *file)
+{
+  if (! file->doc->save)
+    return 0;
+  return finish_save(file);
+}
+
+bool hed_get_file_save_progress(struct hed_file *file, struct hed_save_progress *progress)
 {
-  if (! file->data || pos + 1 > file->data_len) return false;
-  *data = file->data[pos];
+  struct hed_save *save = file->doc->save;
+  if (! save)
+    return false;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  progress->filename = save->filename;
+  progress->done = atomic_load(&save->done_bytes);
+  progress->total = save->total_bytes;
+  progress->elapsed = (now.tv_sec - save->start.tv_sec) + (now.tv_nsec - save->start.tv_nsec) / 1e9;
   return true;
 }
 
+static bool read_file_bytes(struct hed_file *file, size_t pos, uint8_t *data, size_t len)
+{
+  if (! file->doc->buf || pos + len > file->doc->buf->len) return false;
+  return hed_buffer_read(file->doc->buf, pos, data, len) == len;
+}
+
+bool get_file_u8(struct hed_file *file, size_t pos, uint8_t *data)
+{
+  return read_file_bytes(file, pos, data, 1);
+}
+
 bool get_file_u16(struct hed_file *file, size_t pos, uint16_t *data)
 {
-  if (! file->data || pos + 2 > file->data_len) return false;
+  uint8_t b[2];
+  if (! read_file_bytes(file, pos, b, 2)) return false;
 
   if (file->endianess == HED_DATA_LITTLE_ENDIAN) {
-    *data = (((uint16_t) file->data[pos+1] << 8) |
-             ((uint16_t) file->data[pos+0] << 0));
+    *data = (((uint16_t) b[1] << 8) |
+             ((uint16_t) b[0] << 0));
   } else {
-    *data = (((uint16_t) file->data[pos+0] << 8) |
-             ((uint16_t) file->data[pos+1] << 0));
+    *data = (((uint16_t) b[0] << 8) |
+             ((uint16_t) b[1] << 0));
   }
   return true;
 }
 
 bool get_file_u32(struct hed_file *file, size_t pos, uint32_t *data)
 {
-  if (! file->data || pos + 4 > file->data_len) return false;
+  uint8_t b[4];
+  if (! read_file_bytes(file, pos, b, 4)) return false;
 
   if (file->endianess == HED_DATA_LITTLE_ENDIAN) {
-    *data = (((uint32_t) file->data[pos+3] << 24) |
-             ((uint32_t) file->data[pos+2] << 16) |
-             ((uint32_t) file->data[pos+1] <<  8) |
-             ((uint32_t) file->data[pos+0] <<  0));
+    *data = (((uint32_t) b[3] << 24) |
+             ((uint32_t) b[2] << 16) |
+             ((uint32_t) b[1] <<  8) |
+             ((uint32_t) b[0] <<  0));
   } else {
-    *data = (((uint32_t) file->data[pos+0] << 24) |
-             ((uint32_t) file->data[pos+1] << 16) |
-             ((uint32_t) file->data[pos+2] <<  8) |
-             ((uint32_t) file->data[pos+3] <<  0));
+    *data = (((uint32_t) b[0] << 24) |
+             ((uint32_t) b[1] << 16) |
+             ((uint32_t) b[2] <<  8) |
+             ((uint32_t) b[3] <<  0));
   }
   return true;
 }
 
 bool get_file_u64(struct hed_file *file, size_t pos, uint64_t *data)
 {
-  if (! file->data || pos + 8 > file->data_len) return false;
+  uint8_t b[8];
+  if (! read_file_bytes(file, pos, b, 8)) return false;
 
   if (file->endianess == HED_DATA_LITTLE_ENDIAN) {
-    *data = (((uint64_t) file->data[pos+7] << 56) |
-             ((uint64_t) file->data[pos+6] << 48) |
-             ((uint64_t) file->data[pos+5] << 40) |
-             ((uint64_t) file->data[pos+4] << 32) |
-             ((uint64_t) file->data[pos+3] << 24) |
-             ((uint64_t) file->data[pos+2] << 16) |
-             ((uint64_t) file->data[pos+1] <<  8) |
-             ((uint64_t) file->data[pos+0] <<  0));
+    *data = (((uint64_t) b[7] << 56) |
+             ((uint64_t) b[6] << 48) |
+             ((uint64_t) b[5] << 40) |
+             ((uint64_t) b[4] << 32) |
+             ((uint64_t) b[3] << 24) |
+             ((uint64_t) b[2] << 16) |
+             ((uint64_t) b[1] <<  8) |
+             ((uint64_t) b[0] <<  0));
   } else {
-    *data = (((uint64_t) file->data[pos+0] << 56) |
-             ((uint64_t) file->data[pos+1] << 48) |
-             ((uint64_t) file->data[pos+2] << 40) |
-             ((uint64_t) file->data[pos+3] << 32) |
-             ((uint64_t) file->data[pos+4] << 24) |
-             ((uint64_t) file->data[pos+5] << 16) |
-             ((uint64_t) file->data[pos+6] <<  8) |
-             ((uint64_t) file->data[pos+7] <<  0));
+    *data = (((uint64_t) b[0] << 56) |
+             ((uint64_t) b[1] << 48) |
+             ((uint64_t) b[2] << 40) |
+             ((uint64_t) b[3] << 32) |
+             ((uint64_t) b[4] << 24) |
+             ((uint64_t) b[5] << 16) |
+             ((uint64_t) b[6] <<  8) |
+             ((uint64_t) b[7] <<  0));
   }
   return true;
 }
 
 bool get_file_f32(struct hed_file *file, size_t pos, float *data)
 {
-  if (! file->data || pos + 4 > file->data_len) return false;
+  uint8_t b[4];
+  if (! read_file_bytes(file, pos, b, 4)) return false;
+
   if (is_cpu_float_little_endian() == (file->endianess == HED_DATA_LITTLE_ENDIAN)) {
-    memcpy(data, &file->data[pos], 4);
+    memcpy(data, b, 4);
     return true;
   }
-  uint8_t buf[4] = { file->data[pos+3], file->data[pos+2], file->data[pos+1], file->data[pos+0] };
+  uint8_t buf[4] = { b[3], b[2], b[1], b[0] };
   memcpy(data, buf, 4);
   return true;
 }
 
 bool get_file_f64(struct hed_file *file, size_t pos, double *data)
 {
-  if (! file->data || pos + 8 > file->data_len) return false;
+  uint8_t b[8];
+  if (! read_file_bytes(file, pos, b, 8)) return false;
 
   if (is_cpu_float_little_endian() == (file->endianess == HED_DATA_LITTLE_ENDIAN)) {
-    memcpy(data, &file->data[pos], 8);
+    memcpy(data, b, 8);
     return true;
   }
   uint8_t buf[8] = {
-    file->data[pos+7], file->data[pos+6], file->data[pos+5], file->data[pos+4],
-    file->data[pos+3], file->data[pos+2], file->data[pos+1], file->data[pos+0],
+    b[7], b[6], b[5], b[4],
+    b[3], b[2], b[1], b[0],
   };
   memcpy(data, buf, 8);
   return true;
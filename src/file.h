@@ -3,6 +3,9 @@
 #ifndef FILE_H_FILE
 #define FILE_H_FILE
 
+#include <sys/types.h>
+#include <time.h>
+
 #include "hed.h"
 
 enum hed_edit_pane {
@@ -20,14 +23,75 @@ enum hed_data_signedness {
   HED_DATA_SIGNED,
 };
 
+struct hed_buffer;
+struct hed_extent_set;
+struct hed_save;
+struct hed_journal;
+
+/*
+ * What tells versions of a file on disk apart.
+ */
+struct hed_disk_state {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+};
+
+/*
+ * Checksum of a page (HED_PAGE_SIZE bytes) of the original data.
+ */
+struct hed_page_sum {
+  size_t index;
+  uint64_t sum;
+};
+
+struct hed_save_progress {
+  const char *filename;
+  size_t done;
+  size_t total;
+  double elapsed;
+};
+
+/*
+ * The data of a file and its state.  It's shared by all the views of
+ * the file (several hed_files can show the same file), so changes
+ * made in one of them are seen in the others.  'disk' is the state of
+ * the file when it was read or saved, and 'seen_disk' the last state
+ * reported by hed_poll_file_change().  'page_sums' has the checksums
+ * of the original pages the local changes touch, sorted by index, to
+ * find conflicts when the file is reloaded.  'pid' is the process
+ * whose memory is shown, if it's not a file.
+ */
+struct hed_document {
+  unsigned int refs;
+  dev_t dev;
+  ino_t ino;
+  struct hed_buffer *buf;
+  struct hed_save *save;
+  struct hed_journal *journal;
+  size_t journal_undo_base;
+  char *filename;
+  bool loaded;
+  bool modified;
+  bool streaming;
+  pid_t pid;
+  size_t last_visit;
+  struct hed_disk_state disk;
+  struct hed_disk_state seen_disk;
+  struct hed_page_sum *page_sums;
+  size_t num_page_sums;
+  size_t page_sums_cap;
+};
+
+/*
+ * A view of a file in the editor.
+ */
 struct hed_file {
   struct hed_file *next;
   struct hed_file *prev;
   
-  uint8_t *data;
-  size_t data_len;
-  char *filename;
-  bool modified;
+  struct hed_document *doc;
   bool show_data;
   enum hed_data_endianess endianess;
   enum hed_data_signedness signedness;
@@ -37,12 +101,35 @@ struct hed_file {
   size_t top_line;
 };
 
+struct hed_file *hed_open_file(const char *filename);
+int hed_load_file(struct hed_file *file);
+bool hed_unload_file(struct hed_file *file);
 struct hed_file *hed_read_file(const char *filename);
 struct hed_file *hed_new_file_from_data(uint8_t *data, size_t data_len);
+struct hed_file *hed_read_stream(int fd);
+struct hed_file *hed_read_process(pid_t pid);
+void hed_refresh_file(struct hed_file *file);
+bool hed_poll_file_stream(struct hed_file *file);
 void hed_free_file(struct hed_file *file);
+bool hed_is_same_file(struct hed_file *file, struct hed_file *other);
+void hed_share_file(struct hed_file *file, struct hed_file *other);
+int hed_replace_file_data(struct hed_file *file, size_t pos, size_t del_len, const uint8_t *data, size_t len);
+int hed_undo_file_change(struct hed_file *file, bool redo, size_t *pos);
+bool hed_file_has_journal(struct hed_file *file);
+int hed_recover_file_journal(struct hed_file *file, size_t *pos);
+void hed_discard_file_journal(struct hed_file *file);
+void hed_keep_file_journal(struct hed_file *file);
+void hed_sync_file_journal(struct hed_file *file);
+bool hed_poll_file_change(struct hed_file *file);
+bool hed_file_changed_on_disk(struct hed_file *file);
+int hed_reload_file(struct hed_file *file, struct hed_extent_set *conflicts);
 
 int hed_write_file(struct hed_file *file, const char *filename);
-struct hed_file *hed_read_file(const char *filename);
+int hed_poll_file_save(struct hed_file *file);
+int hed_wait_file_save(struct hed_file *file);
+bool hed_get_file_save_progress(struct hed_file *file, struct hed_save_progress *progress);
+size_t hed_file_len(struct hed_file *file);
+const struct hed_extent_set *hed_file_get_pending_changes(struct hed_file *file);
 
 bool get_file_u8(struct hed_file *file, size_t pos, uint8_t *data);
 bool get_file_u16(struct hed_file *file, size_t pos, uint16_t *data);
@@ -34,19 +34,32 @@ static const char *help_page[] = {
   "",
   "   ^C                    Show current position",
   "   M-G                   Go to position",
+  "   M-J                   Go to next data extent (skipping holes)",
+  "   M-K                   Go to previous data extent",
   "   M-Y                   Enable/disable byte colors",
   "",
   "   M-W                   Repeat last search",
+  "   M-Q                   Repeat last search backward",
+  "   M-F                   Search for the contents of a file",
   "   TAB                   Switch between hex and text panes",
   "",
+  "   M-I   (Ins)           Toggle insert mode",
+  "   Del                   Delete byte under cursor",
+  "   Backspace             Delete byte before cursor",
+  "   ^Z                    Undo",
+  "   M-R                   Redo",
+  "",
   "Only on hex pane:",
   "",
   "   ^W                    Search byte sequence",
+  "   ^Q                    Search byte sequence backward",
+  "                         (? matches any hex digit: 4D 5A ?? ?? E?)",
   "   0-9, a-f, A-F         Change file bytes",
   "",
   "Only on text pane:",
   "",
   "   ^W                    Search text",
+  "   ^Q                    Search text backward",
   "   any ASCII char        Change file text",
   "",
 };
@@ -110,11 +110,12 @@ int read_key(int fd, char *seq, size_t max_seq_len)
 {
   int nread;
   unsigned char c;
-  while ((nread = read(fd, &c, 1)) != 1) {
+  if ((nread = read(fd, &c, 1)) != 1) {
     if (nread == -1 && errno != EAGAIN && errno != EINTR)
       return KEY_READ_ERROR;
     if (nread == -1 && errno == EINTR)
       return KEY_REDRAW;
+    return KEY_NONE;    // timeout: let the caller check on background jobs
   }
 
 #define NEXT()        do { if (read(fd, &seq[len], 1) != 1) return read_key_seq(seq, len); len++; } while (0)
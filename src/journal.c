@@ -0,0 +1,475 @@
+/* journal.c */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include "journal.h"
+#include "buffer.h"
+
+#define JOURNAL_MAGIC          "HEDJRNL1"
+#define JOURNAL_SUFFIX         ".hedj"
+#define JOURNAL_SYNC_INTERVAL  1.0     // seconds between fdatasync() calls
+#define JOURNAL_MAX_MERGE_LEN  4096
+
+/*
+ * The journal of a file is a file next to it (".NAME.hedj") where
+ * every change is appended as it's made, so the changes can be
+ * recovered if hed dies before saving them.  The header identifies
+ * the version of the file the changes apply to, and is followed by
+ * the records.  Each record has a checksum, so a record that didn't
+ * fully reach the disk before a crash ends the journal.  The journal
+ * is locked while it's open, so two instances of hed never share it.
+ * Replaces record whether they joined the last undo entry, so the
+ * replayed undo history is the same as the one that was lost.
+ */
+enum hed_journal_record_type {
+  HED_JOURNAL_REPLACE = 1,
+  HED_JOURNAL_UNDO,
+  HED_JOURNAL_REDO,
+  HED_JOURNAL_MERGED_REPLACE,   // a replace that joined the last undo entry
+};
+
+struct hed_journal_header {
+  char magic[8];
+  uint64_t size;
+  uint64_t ino;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+};
+
+struct hed_journal_record {
+  uint32_t type;
+  uint32_t checksum;
+  uint64_t pos;
+  uint64_t del_len;
+  uint64_t len;
+};
+
+/*
+ * 'last_off' is the offset of the last record if it's a replace
+ * small enough to keep a copy of its data in 'last_data', so that a
+ * change that overwrites the same bytes (like the second nibble of a
+ * byte) can be merged into it.
+ */
+struct hed_journal {
+  int fd;
+  char *filename;
+  size_t size;
+  size_t last_off;
+  struct hed_journal_record last_rec;
+  uint8_t last_data[JOURNAL_MAX_MERGE_LEN];
+  bool dirty;
+  struct timespec last_sync;
+};
+
+static char *get_journal_filename(const char *filename, const char *suffix)
+{
+  const char *base = strrchr(filename, '/');
+  size_t dir_len = (base) ? base + 1 - filename : 0;
+  base = filename + dir_len;
+  char *name = malloc(dir_len + strlen(base) + strlen(JOURNAL_SUFFIX) + strlen(suffix) + 2);
+  if (! name)
+    return NULL;
+  sprintf(name, "%.*s.%s%s%s", (int) dir_len, filename, base, JOURNAL_SUFFIX, suffix);
+  return name;
+}
+
+static uint32_t get_checksum(const struct hed_journal_record *rec, const uint8_t *data)
+{
+  // FNV-1a
+  struct hed_journal_record r = *rec;
+  r.checksum = 0;
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < sizeof(r); i++)
+    h = (h ^ ((const uint8_t *) &r)[i]) * 16777619u;
+  for (size_t i = 0; i < rec->len; i++)
+    h = (h ^ data[i]) * 16777619u;
+  return h;
+}
+
+static int pread_full(int fd, void *data, size_t len, size_t pos)
+{
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = pread(fd, (uint8_t *) data + done, len - done, pos + done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    done += n;
+  }
+  return 0;
+}
+
+static int pwrite_full(int fd, const void *data, size_t len, size_t pos)
+{
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = pwrite(fd, (const uint8_t *) data + done, len - done, pos + done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    done += n;
+  }
+  return 0;
+}
+
+static void fill_header(struct hed_journal_header *header, const struct stat *st)
+{
+  memset(header, 0, sizeof(struct hed_journal_header));
+  memcpy(header->magic, JOURNAL_MAGIC, sizeof(header->magic));
+  header->size = st->st_size;
+  header->ino = st->st_ino;
+  header->mtime_sec = st->st_mtim.tv_sec;
+  header->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+static struct hed_journal *new_journal(int fd, char *filename)
+{
+  struct hed_journal *journal = malloc(sizeof(struct hed_journal));
+  if (! journal)
+    return NULL;
+  journal->fd = fd;
+  journal->filename = filename;
+  journal->size = sizeof(struct hed_journal_header);
+  journal->last_off = 0;
+  journal->dirty = false;
+  clock_gettime(CLOCK_MONOTONIC, &journal->last_sync);
+  return journal;
+}
+
+/*
+ * Open and lock a journal file.  Fails if another instance of hed
+ * has it locked.
+ */
+static int open_journal_file(const char *filename, int flags)
+{
+  int fd = open(filename, flags | O_RDWR | O_CLOEXEC, 0600);
+  if (fd < 0)
+    return -1;
+  if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static struct hed_journal *create_journal_file(char *filename, const struct stat *st)
+{
+  struct hed_journal_header header;
+  fill_header(&header, st);
+  int fd = open_journal_file(filename, O_CREAT);
+  if (fd < 0)
+    return NULL;
+  if (ftruncate(fd, 0) < 0 || pwrite_full(fd, &header, sizeof(header), 0) < 0) {
+    close(fd);
+    unlink(filename);
+    return NULL;
+  }
+  struct hed_journal *journal = new_journal(fd, filename);
+  if (! journal) {
+    close(fd);
+    unlink(filename);
+  }
+  return journal;
+}
+
+/*
+ * Start a new (empty) journal for the file 'filename', whose current
+ * state on disk is 'st'.  Returns NULL if the journal can't be
+ * created (for example, if the directory is not writable).
+ */
+struct hed_journal *hed_create_journal(const char *filename, const struct stat *st)
+{
+  char *journal_filename = get_journal_filename(filename, "");
+  if (! journal_filename)
+    return NULL;
+  struct hed_journal *journal = create_journal_file(journal_filename, st);
+  if (! journal)
+    free(journal_filename);
+  return journal;
+}
+
+/*
+ * Open the journal left for the file 'filename', if there's one and
+ * it applies to the file as it is now (open in 'fd').
+ */
+struct hed_journal *hed_open_journal(const char *filename, int fd)
+{
+  struct stat st;
+  if (fstat(fd, &st) < 0 || ! S_ISREG(st.st_mode))
+    return NULL;
+  char *journal_filename = get_journal_filename(filename, "");
+  if (! journal_filename)
+    return NULL;
+  int journal_fd = open_journal_file(journal_filename, 0);
+  if (journal_fd < 0) {
+    free(journal_filename);
+    return NULL;
+  }
+
+  struct hed_journal_header header, expected;
+  fill_header(&expected, &st);
+  struct hed_journal *journal = NULL;
+  if (pread_full(journal_fd, &header, sizeof(header), 0) == 0 && memcmp(&header, &expected, sizeof(header)) == 0)
+    journal = new_journal(journal_fd, journal_filename);
+  if (! journal) {
+    close(journal_fd);
+    free(journal_filename);
+  }
+  return journal;
+}
+
+/*
+ * Read the record at 'off' and its data (which must be freed).
+ * Returns -1 at the end of the journal.
+ */
+static int read_record(int fd, size_t off, size_t journal_len, struct hed_journal_record *rec, uint8_t **data)
+{
+  *data = NULL;
+  if (journal_len - off < sizeof(struct hed_journal_record) || pread_full(fd, rec, sizeof(*rec), off) < 0)
+    return -1;
+  if (rec->len > journal_len - off - sizeof(*rec))
+    return -1;
+  if (rec->len > 0) {
+    *data = malloc(rec->len);
+    if (! *data || pread_full(fd, *data, rec->len, off + sizeof(*rec)) < 0) {
+      free(*data);
+      *data = NULL;
+      return -1;
+    }
+  }
+  if (rec->checksum != get_checksum(rec, *data)) {
+    free(*data);
+    *data = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+static size_t get_journal_len(struct hed_journal *journal)
+{
+  struct stat st;
+  if (fstat(journal->fd, &st) < 0)
+    return journal->size;
+  return st.st_size;
+}
+
+/*
+ * Apply the changes in the journal to 'buf' (which must have the
+ * file data the journal applies to), setting 'pos' to where the last
+ * change was made.  Anything after the last good record is cut off,
+ * and new changes are appended after it.  Returns the number of
+ * changes applied or -1 on errors.
+ */
+int hed_replay_journal(struct hed_journal *journal, struct hed_buffer *buf, size_t *pos)
+{
+  size_t journal_len = get_journal_len(journal);
+  size_t off = sizeof(struct hed_journal_header);
+  int num_changes = 0;
+  int ret = 0;
+  struct hed_journal_record rec;
+  uint8_t *data;
+  while (read_record(journal->fd, off, journal_len, &rec, &data) == 0) {
+    switch (rec.type) {
+    case HED_JOURNAL_REPLACE:
+    case HED_JOURNAL_MERGED_REPLACE:
+      if (rec.type == HED_JOURNAL_REPLACE)
+        hed_buffer_close_undo(buf);
+      ret = (rec.pos > buf->len) ? -1 : hed_buffer_replace(buf, rec.pos, rec.del_len, data, rec.len);
+      *pos = rec.pos;
+      break;
+    case HED_JOURNAL_UNDO:
+      ret = (hed_buffer_undo(buf, pos) > 0) ? 0 : -1;
+      break;
+    case HED_JOURNAL_REDO:
+      ret = (hed_buffer_redo(buf, pos) > 0) ? 0 : -1;
+      break;
+    default:
+      ret = -1;
+      break;
+    }
+    if (ret < 0) {
+      free(data);
+      break;
+    }
+    journal->last_off = 0;
+    if (rec.type != HED_JOURNAL_UNDO && rec.type != HED_JOURNAL_REDO && rec.len <= JOURNAL_MAX_MERGE_LEN) {
+      journal->last_off = off;
+      journal->last_rec = rec;
+      if (rec.len > 0)
+        memcpy(journal->last_data, data, rec.len);
+    }
+    free(data);
+    off += sizeof(rec) + rec.len;
+    num_changes++;
+  }
+  journal->size = off;
+  if (ftruncate(journal->fd, off) < 0)
+    return -1;
+  return (ret < 0) ? -1 : num_changes;
+}
+
+static int write_record(struct hed_journal *journal, struct hed_journal_record *rec, const uint8_t *data)
+{
+  rec->checksum = get_checksum(rec, data);
+  if ((rec->len > 0 && pwrite_full(journal->fd, data, rec->len, journal->size + sizeof(*rec)) < 0)
+      || pwrite_full(journal->fd, rec, sizeof(*rec), journal->size) < 0)
+    return -1;
+  journal->size += sizeof(*rec) + rec->len;
+  journal->dirty = true;
+  return 0;
+}
+
+/*
+ * Record the replacement of 'del_len' bytes at 'pos' by 'data', and
+ * whether it was merged into the last undo entry ('merged').  If it
+ * was and it only overwrites bytes written by the last record, it's
+ * merged into that record instead.
+ */
+int hed_journal_replace(struct hed_journal *journal, size_t pos, size_t del_len, const uint8_t *data, size_t len, bool merged)
+{
+  struct hed_journal_record *last = &journal->last_rec;
+  if (merged && journal->last_off > 0 && del_len == len
+      && pos >= last->pos && pos + len <= last->pos + last->len) {
+    memcpy(journal->last_data + (pos - last->pos), data, len);
+    last->checksum = get_checksum(last, journal->last_data);
+    if (pwrite_full(journal->fd, data, len, journal->last_off + sizeof(*last) + (pos - last->pos)) < 0
+        || pwrite_full(journal->fd, last, sizeof(*last), journal->last_off) < 0)
+      return -1;
+    journal->dirty = true;
+    return 0;
+  }
+
+  struct hed_journal_record rec;
+  memset(&rec, 0, sizeof(rec));
+  rec.type = (merged) ? HED_JOURNAL_MERGED_REPLACE : HED_JOURNAL_REPLACE;
+  rec.pos = pos;
+  rec.del_len = del_len;
+  rec.len = len;
+  size_t off = journal->size;
+  if (write_record(journal, &rec, data) < 0)
+    return -1;
+  journal->last_off = 0;
+  if (len <= JOURNAL_MAX_MERGE_LEN) {
+    journal->last_off = off;
+    journal->last_rec = rec;
+    if (len > 0)
+      memcpy(journal->last_data, data, len);
+  }
+  return 0;
+}
+
+/*
+ * Record an undo (or redo).
+ */
+int hed_journal_undo(struct hed_journal *journal, bool redo)
+{
+  struct hed_journal_record rec;
+  memset(&rec, 0, sizeof(rec));
+  rec.type = (redo) ? HED_JOURNAL_REDO : HED_JOURNAL_UNDO;
+  journal->last_off = 0;
+  return write_record(journal, &rec, NULL);
+}
+
+size_t hed_journal_size(struct hed_journal *journal)
+{
+  return journal->size;
+}
+
+/*
+ * Make sure the records written reach the disk.  To keep the cost
+ * down while typing, this is done at most once per
+ * JOURNAL_SYNC_INTERVAL: call it periodically.
+ */
+int hed_sync_journal(struct hed_journal *journal)
+{
+  if (! journal->dirty)
+    return 0;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double elapsed = (now.tv_sec - journal->last_sync.tv_sec) + (now.tv_nsec - journal->last_sync.tv_nsec) / 1e9;
+  if (elapsed < JOURNAL_SYNC_INTERVAL)
+    return 0;
+  journal->last_sync = now;
+  journal->dirty = false;
+  return fdatasync(journal->fd);
+}
+
+/*
+ * Move the records from offset 'from' on to a new journal for the
+ * file 'filename' as it is now on disk.  Used when the file is saved
+ * but changed while it was being saved: the file has the data as it
+ * was when the save started, and the records after that point apply
+ * to it.  Undo records can't be moved, since the changes they undo
+ * are not in the new journal.  The old journal is closed (and
+ * removed); returns the new one, or NULL if it can't be made.
+ */
+struct hed_journal *hed_rebase_journal(struct hed_journal *journal, size_t from, const char *filename)
+{
+  struct hed_journal *new_journal = NULL;
+  char *new_filename = get_journal_filename(filename, "");
+  char *tmp_filename = get_journal_filename(filename, ".new");
+  struct stat st;
+  if (! new_filename || ! tmp_filename || stat(filename, &st) < 0
+      || ! (new_journal = create_journal_file(tmp_filename, &st)))
+    goto err;
+
+  if (from < sizeof(struct hed_journal_header))
+    from = sizeof(struct hed_journal_header);
+  size_t off = from;
+  bool first = true;
+  while (off < journal->size) {
+    struct hed_journal_record rec;
+    uint8_t *data;
+    if (read_record(journal->fd, off, journal->size, &rec, &data) < 0)
+      goto err;
+    bool is_replace = (rec.type == HED_JOURNAL_REPLACE || rec.type == HED_JOURNAL_MERGED_REPLACE);
+    if (first)
+      rec.type = HED_JOURNAL_REPLACE;   // the entry it joined is not in the new journal
+    first = false;
+    int ret = (is_replace) ? write_record(new_journal, &rec, data) : -1;
+    free(data);
+    if (ret < 0)
+      goto err;
+    off += sizeof(rec) + rec.len;
+  }
+  if (fdatasync(new_journal->fd) < 0 || rename(tmp_filename, new_filename) < 0)
+    goto err;
+  new_journal->dirty = false;
+  free(new_journal->filename);
+  new_journal->filename = new_filename;
+  hed_close_journal(journal, strcmp(journal->filename, new_filename) != 0);
+  return new_journal;
+
+ err:
+  if (new_journal)
+    hed_close_journal(new_journal, true);
+  else
+    free(tmp_filename);
+  free(new_filename);
+  hed_close_journal(journal, true);
+  return NULL;
+}
+
+/*
+ * Close a journal, removing its file if 'remove' is true (when the
+ * changes were saved or discarded).
+ */
+void hed_close_journal(struct hed_journal *journal, bool remove)
+{
+  if (remove)
+    unlink(journal->filename);
+  close(journal->fd);
+  free(journal->filename);
+  free(journal);
+}
@@ -0,0 +1,24 @@
+/* journal.h */
+
+#ifndef JOURNAL_H_FILE
+#define JOURNAL_H_FILE
+
+#include <sys/stat.h>
+
+#include "hed.h"
+
+struct hed_journal;
+struct hed_buffer;
+
+struct hed_journal *hed_create_journal(const char *filename, const struct stat *st);
+struct hed_journal *hed_open_journal(const char *filename, int fd);
+struct hed_journal *hed_rebase_journal(struct hed_journal *journal, size_t from, const char *filename);
+void hed_close_journal(struct hed_journal *journal, bool remove);
+
+int hed_replay_journal(struct hed_journal *journal, struct hed_buffer *buf, size_t *pos);
+int hed_journal_replace(struct hed_journal *journal, size_t pos, size_t del_len, const uint8_t *data, size_t len, bool merged);
+int hed_journal_undo(struct hed_journal *journal, bool redo);
+size_t hed_journal_size(struct hed_journal *journal);
+int hed_sync_journal(struct hed_journal *journal);
+
+#endif /* JOURNAL_H_FILE */
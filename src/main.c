@@ -4,47 +4,56 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include "editor.h"
 #include "file.h"
+#include "buffer.h"
+#include "store.h"
+#include "search.h"
 
-static uint8_t *read_stdin(size_t *ret_len)
+/*
+ * Parse a size in bytes, with an optional K, M or G suffix.
+ */
+static int parse_size(const char *str, size_t *size)
 {
-  uint8_t *data = NULL;
-  size_t len = 0;
-  size_t cap = 0;
-
-  while (true) {
-    char buf[4096];
-    size_t n = fread(buf, 1, sizeof(buf), stdin);
-    if (n == 0)
-      break;
-    if (len + n > cap) {
-      while (len + n > cap)
-        cap = (cap == 0) ? 16*1024 : cap * 2;
-      data = realloc(data, cap);
-      if (! data) {
-        fprintf(stderr, "ERROR: out of memory\n");
-        return NULL;
-      }
-    }
-    memcpy(data + len, buf, n);
-    len += n;
+  char *end = NULL;
+  errno = 0;
+  unsigned long long val = strtoull(str, &end, 0);
+  if (errno != 0 || end == str)
+    return -1;
+  switch (*end) {
+  case 'k': case 'K': val <<= 10; end++; break;
+  case 'm': case 'M': val <<= 20; end++; break;
+  case 'g': case 'G': val <<= 30; end++; break;
   }
-  *ret_len = len;
-  return data;
+  if (*end != '\0' || val > SIZE_MAX)
+    return -1;
+  *size = val;
+  return 0;
 }
 
 static void print_help(const char *progname)
 {
-  printf("%s [options] [+OFFSET [FILE]]\n", progname);
+  printf("%s [options] [+OFFSET] [FILE...]\n", progname);
   printf("\n"
          "options:\n"
          " -V               show version information and exit\n"
          " -h               show this help and exit\n"
          " -v               view mode (read-only)\n"
+         " -M BYTES         read files in pages, keeping at most BYTES of file data\n"
+         "                  in memory (may have suffix K, M or G); inserted or\n"
+         "                  changed data is not counted\n"
+         " -S BYTES         keep at most BYTES of stdin in memory, the rest goes\n"
+         "                  to a temporary file (default 256M)\n"
+         " -L               read whole files into memory instead of mapping them\n"
+         " -f               follow files as they grow (like tail -f)\n"
+         " -p PID           view the memory of process PID (implies -v)\n"
+         " -j THREADS       search with THREADS threads (default: one per CPU)\n"
+         " --cpu=NAME       search with scalar, sse2, avx2 or avx512 instructions\n"
+         "                  (default: the best the CPU supports)\n"
          " +OFFSET          start at OFFSET (may have prefix 0x or 0 for hex or octal)\n"
-         " FILE             file to edit or view, can be - for stdin\n");
+         " FILE             files to edit or view, one can be - for stdin\n");
 }
 
 static void print_version(void)
@@ -57,36 +66,106 @@ static void print_version(void)
 
 int main(int argc, char **argv)
 {
-  const char *filename = NULL;
+  const char **filenames = malloc(argc * sizeof(char *));
+  int num_files = 0;
+  bool read_stdin = false;
   bool view_mode = false;
-  unsigned long offset = 0;
+  pid_t pid = 0;
+  bool offset_given = false;
+  unsigned long long offset = 0;
+  if (! filenames) {
+    fprintf(stderr, "%s: out of memory\n", argv[0]);
+    exit(1);
+  }
 
   for (int i = 1; i < argc; i++) {
     if (argv[i][0] == '+') {
       char *end = NULL;
       errno = 0;
-      offset = strtoul(argv[i] + 1, &end, 0);
-      if (errno != 0 || *end != '\0') {
+      offset = strtoull(argv[i] + 1, &end, 0);
+      if (errno != 0 || *end != '\0' || offset > SIZE_MAX) {
         fprintf(stderr, "%s: invalid offset: %s\n", argv[0], argv[i] + 1);
         exit(1);
       }
+      offset_given = true;
     } else if (argv[i][0] == '-') {
       switch (argv[i][1]) {
+      case '-':
+        if (strncmp(argv[i], "--cpu=", 6) == 0) {
+          if (hed_set_search_cpu(argv[i] + 6) < 0) {
+            fprintf(stderr, "%s: unknown or unsupported CPU for --cpu: %s\n", argv[0], argv[i] + 6);
+            exit(1);
+          }
+          break;
+        }
+        fprintf(stderr, "%s: unknown option '%s'\n", argv[0], argv[i]);
+        exit(1);
       case 'V': print_version(); exit(0);
       case 'h': print_help(argv[0]); exit(0);
       case 'v': view_mode = true; break;
-      case '\0': filename = argv[i]; break;
+      case 'L': hed_set_load_into_memory(true); break;
+      case 'f': hed_set_follow_files(true); break;
+      case 'M':
+        {
+          size_t max_mem;
+          if (i + 1 >= argc || parse_size(argv[i+1], &max_mem) < 0) {
+            fprintf(stderr, "%s: invalid memory size for -M\n", argv[0]);
+            exit(1);
+          }
+          hed_set_memory_limit(max_mem);
+          i++;
+        }
+        break;
+      case 'p':
+        {
+          char *end = NULL;
+          long val = (i + 1 < argc) ? strtol(argv[i+1], &end, 10) : 0;
+          if (val <= 0 || *end != '\0') {
+            fprintf(stderr, "%s: invalid process id for -p\n", argv[0]);
+            exit(1);
+          }
+          pid = val;
+          view_mode = true;
+          i++;
+        }
+        break;
+      case 'j':
+        {
+          char *end = NULL;
+          long val = (i + 1 < argc) ? strtol(argv[i+1], &end, 10) : 0;
+          if (val <= 0 || *end != '\0') {
+            fprintf(stderr, "%s: invalid number of threads for -j\n", argv[0]);
+            exit(1);
+          }
+          hed_set_search_threads(val);
+          i++;
+        }
+        break;
+      case 'S':
+        {
+          size_t spill_size;
+          if (i + 1 >= argc || parse_size(argv[i+1], &spill_size) < 0) {
+            fprintf(stderr, "%s: invalid size for -S\n", argv[0]);
+            exit(1);
+          }
+          hed_set_stream_spill_size(spill_size);
+          i++;
+        }
+        break;
+      case '\0':
+        if (read_stdin) {
+          fprintf(stderr, "%s: stdin given more than once\n", argv[0]);
+          exit(1);
+        }
+        read_stdin = true;
+        filenames[num_files++] = argv[i];
+        break;
       default:
         fprintf(stderr, "%s: unknown option '%s'\n", argv[0], argv[i]);
         exit(1);
       }
-    } else {
-      if (filename) {
-        fprintf(stderr, "%s: too many files given\n", argv[0]);
-        exit(1);
-      }
-      filename = argv[i];
-    }
+    } else
+      filenames[num_files++] = argv[i];
   }
 
   struct hed_editor editor;
@@ -94,20 +173,31 @@ int main(int argc, char **argv)
   if (view_mode)
     editor.read_only = true;
 
-  if (filename) {
+  if (pid != 0) {
+    struct hed_file *file = hed_read_process(pid);
+    if (! file)
+      exit(1);
+    hed_add_file(&editor, file);
+    // start at the first mapped address
+    size_t data_pos;
+    if (! offset_given && hed_buffer_find_data(file->doc->buf, 0, false, &data_pos))
+      offset = data_pos;
+  }
+
+  // Only the first file is read now, the others when they're shown
+  for (int i = 0; i < num_files; i++) {
     struct hed_file *file;
-    if (strcmp(filename, "-") == 0) {
-      size_t data_len = 0;
-      uint8_t *data = read_stdin(&data_len);
-      if (! data)
-        exit(1);
-      file = hed_new_file_from_data(data, data_len);
-    } else
-      file = hed_read_file(argv[1]);
+    if (strcmp(filenames[i], "-") == 0)
+      file = hed_read_stream(STDIN_FILENO);
+    else if (i == 0 && pid == 0)
+      file = hed_read_file(filenames[i]);
+    else
+      file = hed_open_file(filenames[i]);
     if (! file)
       exit(1);
     hed_add_file(&editor, file);
   }
-  
+  free(filenames);
+
   return hed_run_editor(&editor, offset);
 }
@@ -0,0 +1,989 @@
+/* search.c */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HED_SEARCH_X86
+#include <immintrin.h>
+#endif
+
+#include "search.h"
+#include "buffer.h"
+#include "store.h"
+
+typedef bool (*vector_find_func)(const struct hed_pattern *pat, const uint8_t *data, size_t len, bool backward, size_t *off);
+
+static const char *const cpu_names[] = {
+  [HED_CPU_SCALAR] = "scalar",
+  [HED_CPU_SSE2]   = "sse2",
+  [HED_CPU_AVX2]   = "avx2",
+  [HED_CPU_AVX512] = "avx512",
+};
+
+static bool cpu_selected;
+static enum hed_search_cpu search_cpu;
+static vector_find_func vector_find;
+
+/*
+ * Choose the bytes compared by the vector kernels and used for the
+ * skip tables: 'first' is the start of the longest run of bytes
+ * without wildcards (the whole pattern if it has none, or the most
+ * specific byte if every byte has some), and 'anchor' the last byte of
+ * the run that differs from it.  If the run has a single byte, the
+ * anchor is the last of the most specific other bytes.
+ */
+static void choose_anchors(struct hed_pattern *pat)
+{
+  size_t run_start = 0;
+  size_t run_len = pat->len;
+  if (pat->mask) {
+    run_len = 0;
+    for (size_t i = 0; i < pat->len; ) {
+      size_t j = i;
+      while (j < pat->len && pat->mask[j] == 0xff)
+        j++;
+      if (j - i > run_len) {
+        run_start = i;
+        run_len = j - i;
+      }
+      i = (j > i) ? j : i + 1;
+    }
+  }
+
+  if (run_len == 0) {
+    int best_bits = -1;
+    for (size_t i = 0; i < pat->len; i++) {
+      int bits = __builtin_popcount(pat->mask[i]);
+      if (bits > best_bits) {
+        run_start = i;
+        best_bits = bits;
+      }
+    }
+  }
+
+  pat->first = run_start;
+  pat->first_len = (run_len > 0) ? run_len : 1;
+  pat->anchor = run_start;
+  for (size_t i = run_start + run_len; i > run_start + 1; i--) {
+    if (pat->bytes[i-1] != pat->bytes[run_start]) {
+      pat->anchor = i - 1;
+      break;
+    }
+  }
+  if (pat->anchor == run_start && run_len > 1)
+    pat->anchor = run_start + run_len - 1;
+  if (pat->anchor == run_start && pat->mask) {
+    int best_bits = 0;
+    for (size_t i = 0; i < pat->len; i++) {
+      int bits = __builtin_popcount(pat->mask[i]);
+      if (i != run_start && bits > 0 && bits >= best_bits) {
+        pat->anchor = i;
+        best_bits = bits;
+      }
+    }
+  }
+}
+
+/*
+ * Fill the bad character tables for the run of bytes at 'first': how
+ * far the window can move when the byte at the last (or first, going
+ * backward) position of the run is 'c'.  Without a mask the run is the
+ * whole pattern.
+ */
+static void fill_skip_tables(struct hed_pattern *pat)
+{
+  const uint8_t *run = pat->bytes + pat->first;
+  size_t m = pat->first_len;
+  for (int c = 0; c < 256; c++) {
+    pat->skip[c] = m;
+    pat->rskip[c] = m;
+  }
+  for (size_t i = 0; i + 1 < m; i++)
+    pat->skip[run[i]] = m - 1 - i;
+  for (size_t i = m - 1; i > 0; i--)
+    pat->rskip[run[i]] = i;
+}
+
+/*
+ * Prepare 'len' bytes for searching.  If 'mask' is not NULL, only the
+ * bits set in it are compared (so a 0x00 mask byte is a wildcard and
+ * 0xf0 matches only the high nibble).
+ */
+struct hed_pattern *hed_new_pattern(const uint8_t *bytes, const uint8_t *mask, size_t len)
+{
+  if (len == 0)
+    return NULL;
+  struct hed_pattern *pat = malloc(sizeof(struct hed_pattern));
+  if (! pat)
+    return NULL;
+  pat->bytes = malloc(len);
+  pat->mask = NULL;
+  if (! pat->bytes) {
+    free(pat);
+    return NULL;
+  }
+  memcpy(pat->bytes, bytes, len);
+  pat->len = len;
+
+  if (mask) {
+    bool all_bits = true;
+    for (size_t i = 0; i < len; i++) {
+      if (mask[i] != 0xff)
+        all_bits = false;
+    }
+    if (! all_bits) {
+      pat->mask = malloc(len);
+      if (! pat->mask) {
+        hed_free_pattern(pat);
+        return NULL;
+      }
+      for (size_t i = 0; i < len; i++) {
+        pat->mask[i] = mask[i];
+        pat->bytes[i] &= mask[i];
+      }
+    }
+  }
+
+  pat->all_zeros = true;
+  for (size_t i = 0; i < len; i++) {
+    if (pat->bytes[i] != 0) {
+      pat->all_zeros = false;
+      break;
+    }
+  }
+
+  choose_anchors(pat);
+  fill_skip_tables(pat);
+  return pat;
+}
+
+void hed_free_pattern(struct hed_pattern *pat)
+{
+  if (! pat)
+    return;
+  free(pat->bytes);
+  free(pat->mask);
+  free(pat);
+}
+
+/*
+ * Convert a list of hex digits (which can be separated by spaces or
+ * commas) to bytes.  A '?' matches any nibble: its bits are cleared in
+ * 'mask', which is set to 0xff for the others.  Returns the number of
+ * bytes, or 0 if the list is invalid, has an odd number of digits or
+ * doesn't fit in 'max_len' bytes.
+ */
+size_t hed_parse_search_bytes(uint8_t *bytes, uint8_t *mask, size_t max_len, const char *str)
+{
+  size_t len = 0;
+  for (const char *src = str; *src != '\0'; src++) {
+    uint8_t nibble = 0;
+    uint8_t nibble_mask = 0xf;
+    if (*src >= '0' && *src <= '9')
+      nibble = *src - '0';
+    else if (*src >= 'a' && *src <= 'f')
+      nibble = *src - 'a' + 10;
+    else if (*src >= 'A' && *src <= 'F')
+      nibble = *src - 'A' + 10;
+    else if (*src == '?')
+      nibble_mask = 0;
+    else if (*src == ' ' || *src == ',')
+      continue;
+    else
+      return 0;
+
+    if (len == 2*max_len)
+      return 0;
+    if (len % 2 == 0) {
+      bytes[len/2] = nibble << 4;
+      mask[len/2] = nibble_mask << 4;
+    } else {
+      bytes[len/2] |= nibble;
+      mask[len/2] |= nibble_mask;
+    }
+    len++;
+  }
+  if (len % 2 != 0)
+    return 0;
+  return len/2;
+}
+
+static inline uint8_t pattern_mask(const struct hed_pattern *pat, size_t i)
+{
+  return (pat->mask) ? pat->mask[i] : 0xff;
+}
+
+/*
+ * Check if the pattern matches at 'data', comparing eight bytes at a
+ * time under the mask if it has one.
+ */
+static inline bool matches_at(const struct hed_pattern *pat, const uint8_t *data)
+{
+  if (! pat->mask)
+    return memcmp(data, pat->bytes, pat->len) == 0;
+
+  size_t i = 0;
+  for (; i + 8 <= pat->len; i += 8) {
+    uint64_t d, mask, val;
+    memcpy(&d, data + i, 8);
+    memcpy(&mask, pat->mask + i, 8);
+    memcpy(&val, pat->bytes + i, 8);
+    if ((d & mask) != val)
+      return false;
+  }
+  for (; i < pat->len; i++) {
+    if ((data[i] & pat->mask[i]) != pat->bytes[i])
+      return false;
+  }
+  return true;
+}
+
+static bool find_short(const struct hed_pattern *pat, const uint8_t *data, size_t len, bool backward, size_t *off)
+{
+  const uint8_t *p = pat->bytes;
+  size_t m = pat->len;
+
+  if (! backward) {
+    // look for the first byte, then check the rest
+    const uint8_t *start = data;
+    const uint8_t *last = data + len - m;
+    while (start <= last) {
+      const uint8_t *found = memchr(start, p[0], last - start + 1);
+      if (! found)
+        break;
+      if (memcmp(found + 1, p + 1, m - 1) == 0) {
+        *off = found - data;
+        return true;
+      }
+      start = found + 1;
+    }
+    return false;
+  }
+
+  // look for the last byte, then check the rest
+  size_t end = len;
+  while (end >= m) {
+    const uint8_t *found = memrchr(data + m - 1, p[m-1], end - (m - 1));
+    if (! found)
+      break;
+    size_t pos = found - data - (m - 1);
+    if (memcmp(data + pos, p, m - 1) == 0) {
+      *off = pos;
+      return true;
+    }
+    end = found - data;
+  }
+  return false;
+}
+
+static bool find_horspool(const struct hed_pattern *pat, const uint8_t *data, size_t len, bool backward, size_t *off)
+{
+  const uint8_t *p = pat->bytes;
+  size_t m = pat->len;
+  uint8_t first = p[0];
+  uint8_t last = p[m-1];
+
+  if (! backward) {
+    size_t pos = 0;
+    while (pos + m <= len) {
+      uint8_t c = data[pos + m - 1];
+      if (c == last && data[pos] == first && memcmp(data + pos + 1, p + 1, m - 2) == 0) {
+        *off = pos;
+        return true;
+      }
+      pos += pat->skip[c];
+    }
+    return false;
+  }
+
+  size_t pos = len - m;
+  for (;;) {
+    uint8_t c = data[pos];
+    if (c == first && data[pos + m - 1] == last && memcmp(data + pos + 1, p + 1, m - 2) == 0) {
+      *off = pos;
+      return true;
+    }
+    if (pos < pat->rskip[c])
+      return false;
+    pos -= pat->rskip[c];
+  }
+}
+
+/*
+ * Boyer-Moore-Horspool for patterns with wildcards: the window moves
+ * by the skip tables of the run at 'first', so wildcards elsewhere
+ * don't limit the shifts, and is then checked under the mask.
+ */
+static bool find_masked(const struct hed_pattern *pat, const uint8_t *data, size_t len, bool backward, size_t *off)
+{
+  size_t m = pat->len;
+  size_t run_first = pat->first;
+  size_t run_last = pat->first + pat->first_len - 1;
+
+  if (! backward) {
+    size_t pos = 0;
+    while (pos + m <= len) {
+      if (matches_at(pat, data + pos)) {
+        *off = pos;
+        return true;
+      }
+      pos += pat->skip[data[pos + run_last]];
+    }
+    return false;
+  }
+
+  size_t pos = len - m;
+  for (;;) {
+    if (matches_at(pat, data + pos)) {
+      *off = pos;
+      return true;
+    }
+    size_t shift = pat->rskip[data[pos + run_first]];
+    if (pos < shift)
+      return false;
+    pos -= shift;
+  }
+}
+
+#ifdef HED_SEARCH_X86
+
+/*
+ * The vector kernels get a bit mask of the candidates among 'width'
+ * positions starting at 'data' from MASK(), and check them from the
+ * lowest (or, going backward, the highest) bit.  The positions too
+ * close to the end (or start) for a whole vector are left to the
+ * scalar code.
+ */
+#define VECTOR_FIND(width, MASK)                                        \
+  do {                                                                  \
+    size_t m = pat->len;                                                \
+    size_t f = pat->first;                                              \
+    size_t a = pat->anchor;                                             \
+    if (! backward) {                                                   \
+      size_t pos = 0;                                                   \
+      for (; pos + (width) + m - 1 <= len; pos += (width)) {            \
+        uint64_t mask = MASK(data + pos + f, data + pos + a);           \
+        while (mask != 0) {                                             \
+          size_t i = pos + __builtin_ctzll(mask);                       \
+          if (matches_at(pat, data + i)) {                              \
+            *off = i;                                                   \
+            return true;                                                \
+          }                                                             \
+          mask &= mask - 1;                                             \
+        }                                                               \
+      }                                                                 \
+      if (! find_scalar(pat, data + pos, len - pos, false, off))        \
+        return false;                                                   \
+      *off += pos;                                                      \
+      return true;                                                      \
+    }                                                                   \
+    size_t end = len - m + 1;                                           \
+    for (; end >= (width); end -= (width)) {                            \
+      size_t pos = end - (width);                                       \
+      uint64_t mask = MASK(data + pos + f, data + pos + a);             \
+      while (mask != 0) {                                               \
+        int bit = 63 - __builtin_clzll(mask);                           \
+        if (matches_at(pat, data + pos + bit)) {                        \
+          *off = pos + bit;                                             \
+          return true;                                                  \
+        }                                                               \
+        mask &= ~((uint64_t) 1 << bit);                                 \
+      }                                                                 \
+    }                                                                   \
+    return find_scalar(pat, data, end + m - 1, true, off);              \
+  } while (0)
+
+#define SSE2_MASK(x, y)                                                 \
+  (uint64_t) (uint32_t) _mm_movemask_epi8(_mm_and_si128(               \
+      _mm_cmpeq_epi8(_mm_and_si128(_mm_loadu_si128((const __m128i *) (x)), first_mask), first), \
+      _mm_cmpeq_epi8(_mm_and_si128(_mm_loadu_si128((const __m128i *) (y)), anchor_mask), anchor)))
+
+#define AVX2_MASK(x, y)                                                 \
+  (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_and_si256(         \
+      _mm256_cmpeq_epi8(_mm256_and_si256(_mm256_loadu_si256((const __m256i *) (x)), first_mask), first), \
+      _mm256_cmpeq_epi8(_mm256_and_si256(_mm256_loadu_si256((const __m256i *) (y)), anchor_mask), anchor)))
+
+#define AVX512_MASK(x, y)                                               \
+  (uint64_t) (_mm512_cmpeq_epi8_mask(_mm512_and_si512(_mm512_loadu_si512((const void *) (x)), first_mask), first) \
+              & _mm512_cmpeq_epi8_mask(_mm512_and_si512(_mm512_loadu_si512((const void *) (y)), anchor_mask), anchor))
+
+static bool find_scalar(const struct hed_pattern *pat, const uint8_t *data, size_t len, bool backward, size_t *off);
+
+__attribute__((target("sse2")))
+static bool find_sse2(const struct hed_pattern *pat, const uint8_t *data, size_t len, bool backward, size_t *off)
+{
+  __m128i first = _mm_set1_epi8((char) pat->bytes[pat->first]);
+  __m128i first_mask = _mm_set1_epi8((char) pattern_mask(pat, pat->first));
+  __m128i anchor = _mm_set1_epi8((char) pat->bytes[pat->anchor]);
+  __m128i anchor_mask = _mm_set1_epi8((char) pattern_mask(pat, pat->anchor));
+  VECTOR_FIND(16, SSE2_MASK);
+}
+
+__attribute__((target("avx2")))
+static bool find_avx2(const struct hed_pattern *pat, const uint8_t *data, size_t len, bool backward, size_t *off)
+{
+  __m256i first = _mm256_set1_epi8((char) pat->bytes[pat->first]);
+  __m256i first_mask = _mm256_set1_epi8((char) pattern_mask(pat, pat->first));
+  __m256i anchor = _mm256_set1_epi8((char) pat->bytes[pat->anchor]);
+  __m256i anchor_mask = _mm256_set1_epi8((char) pattern_mask(pat, pat->anchor));
+  VECTOR_FIND(32, AVX2_MASK);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static bool find_avx512(const struct hed_pattern *pat, const uint8_t *data, size_t len, bool backward, size_t *off)
+{
+  __m512i first = _mm512_set1_epi8((char) pat->bytes[pat->first]);
+  __m512i first_mask = _mm512_set1_epi8((char) pattern_mask(pat, pat->first));
+  __m512i anchor = _mm512_set1_epi8((char) pat->bytes[pat->anchor]);
+  __m512i anchor_mask = _mm512_set1_epi8((char) pattern_mask(pat, pat->anchor));
+  VECTOR_FIND(64, AVX512_MASK);
+}
+
+#endif /* HED_SEARCH_X86 */
+
+static bool cpu_supports(enum hed_search_cpu cpu)
+{
+  switch (cpu) {
+  case HED_CPU_SCALAR:
+    return true;
+#ifdef HED_SEARCH_X86
+  case HED_CPU_SSE2:
+    return __builtin_cpu_supports("sse2");
+  case HED_CPU_AVX2:
+    return __builtin_cpu_supports("avx2");
+  case HED_CPU_AVX512:
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+#else
+  default:
+    return false;
+#endif
+  }
+  return false;
+}
+
+static void select_cpu(enum hed_search_cpu cpu)
+{
+  search_cpu = cpu;
+  cpu_selected = true;
+  switch (cpu) {
+  case HED_CPU_SCALAR: vector_find = NULL; break;
+#ifdef HED_SEARCH_X86
+  case HED_CPU_SSE2:   vector_find = find_sse2; break;
+  case HED_CPU_AVX2:   vector_find = find_avx2; break;
+  case HED_CPU_AVX512: vector_find = find_avx512; break;
+#else
+  default:             vector_find = NULL; break;
+#endif
+  }
+}
+
+/*
+ * Select the search kernels by name ("auto" for the best the CPU
+ * supports).  Returns -1 if the name is unknown or the CPU doesn't
+ * support it.
+ */
+int hed_set_search_cpu(const char *name)
+{
+  if (strcmp(name, "auto") == 0) {
+    cpu_selected = false;
+    hed_get_search_cpu();
+    return 0;
+  }
+  for (size_t i = 0; i < sizeof(cpu_names)/sizeof(cpu_names[0]); i++) {
+    if (strcmp(name, cpu_names[i]) == 0) {
+      if (! cpu_supports(i))
+        return -1;
+      select_cpu(i);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/*
+ * Return the name of the search kernels in use, selecting the best
+ * ones for the CPU if none were selected yet.
+ */
+const char *hed_get_search_cpu(void)
+{
+  if (! cpu_selected) {
+#ifdef HED_SEARCH_X86
+    __builtin_cpu_init();
+#endif
+    enum hed_search_cpu cpu = HED_CPU_AVX512;
+    while (cpu != HED_CPU_SCALAR && ! cpu_supports(cpu))
+      cpu--;
+    select_cpu(cpu);
+  }
+  return cpu_names[search_cpu];
+}
+
+static bool find_scalar(const struct hed_pattern *pat, const uint8_t *data, size_t len, bool backward, size_t *off)
+{
+  if (len < pat->len)
+    return false;
+  if (pat->mask)
+    return find_masked(pat, data, len, backward, off);
+  if (pat->len == 1) {
+    const uint8_t *found = (backward) ? memrchr(data, pat->bytes[0], len) : memchr(data, pat->bytes[0], len);
+    if (! found)
+      return false;
+    *off = found - data;
+    return true;
+  }
+  if (pat->len <= HED_SEARCH_SHORT_LEN)
+    return find_short(pat, data, len, backward, off);
+  return find_horspool(pat, data, len, backward, off);
+}
+
+/*
+ * Find the first (or, if 'backward', the last) occurrence of the
+ * pattern entirely inside 'len' bytes of contiguous data.
+ */
+bool hed_pattern_find(const struct hed_pattern *pat, const uint8_t *data, size_t len, bool backward, size_t *off)
+{
+  if (len < pat->len)
+    return false;
+
+  if (! cpu_selected)
+    hed_get_search_cpu();
+  if (vector_find)
+    return vector_find(pat, data, len, backward, off);
+  return find_scalar(pat, data, len, backward, off);
+}
+
+/*
+ * Return the index of the first hole that ends after 'pos'.
+ */
+static size_t find_hole(const struct hed_extent_set *holes, size_t pos)
+{
+  size_t lo = 0;
+  size_t hi = holes->num_extents;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (holes->extents[mid].pos + holes->extents[mid].len <= pos)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/*
+ * A search running in the background on a snapshot of the buffer.
+ * The range is split in chunks searched from a number of threads;
+ * chunk 0 has the positions closest to 'start' in the search
+ * direction, so the match in the lowest chunk with a match is the
+ * result.  Each chunk also reads the pattern_len-1 bytes after (or
+ * before) it, so matches crossing chunk borders are seen.
+ * 'done_positions' counts the positions already searched, for the
+ * progress display; it's updated after each span or window searched.
+ */
+struct hed_search {
+  pthread_t thread;
+  struct hed_snapshot *snap;
+  const struct hed_pattern *pat;
+  bool backward;
+  bool match_holes;
+  size_t start;
+  size_t num_positions;
+  size_t num_chunks;
+  struct timespec start_time;
+  atomic_size_t next_chunk;
+  atomic_size_t found_chunk;    // lowest chunk with a match, or SIZE_MAX
+  atomic_size_t done_positions;
+  atomic_bool cancelled;
+  atomic_bool failed;
+  atomic_bool finished;
+  size_t match_pos;
+  pthread_mutex_t lock;
+};
+
+static unsigned int search_threads;
+
+/*
+ * Return true if a chunk before 'chunk' already has a match, so
+ * searching it can stop.
+ */
+static bool chunk_superseded(struct hed_search *search, size_t chunk)
+{
+  return atomic_load(&search->found_chunk) < chunk || atomic_load(&search->failed) || atomic_load(&search->cancelled);
+}
+
+/*
+ * Count the positions searched so far in a chunk ('searched', of
+ * which 'done' were already counted) for the progress display.
+ */
+static void count_searched(struct hed_search *search, size_t searched, size_t *done)
+{
+  if (searched > *done) {
+    atomic_fetch_add(&search->done_positions, searched - *done);
+    *done = searched;
+  }
+}
+
+/*
+ * Search for matches starting in [pos, last).  'done' is set to the
+ * number of positions counted as searched.
+ */
+static int search_forward(struct hed_search *search, size_t chunk, size_t pos, size_t last,
+                          uint8_t *window, size_t window_size, size_t *match_pos, size_t *done)
+{
+  struct hed_snapshot *snap = search->snap;
+  const struct hed_pattern *pat = search->pat;
+  size_t m = pat->len;
+  size_t first = pos;
+  if (last > snap->len - m + 1)
+    last = snap->len - m + 1;
+  for (;;) {
+    count_searched(search, ((pos < last) ? pos : last) - first, done);
+    if (pos >= last || chunk_superseded(search, chunk))
+      break;
+    const struct hed_extent_set *holes = &snap->holes;
+    size_t limit = last + m - 1;
+    if (holes->num_extents > 0) {
+      // A hole only matches a sequence of zeros, so skip the part of
+      // it where the sequence would fit entirely (or all of it, if
+      // holes don't match at all)
+      size_t i = find_hole(holes, pos);
+      if (i < holes->num_extents && holes->extents[i].pos <= pos) {
+        size_t hole_end = holes->extents[i].pos + holes->extents[i].len;
+        if (! search->match_holes) {
+          pos = hole_end;
+          continue;
+        }
+        if (hole_end - pos >= m) {
+          if (pat->all_zeros) {
+            *match_pos = pos;
+            return 1;
+          }
+          pos = hole_end - m + 1;
+          continue;
+        }
+        i++;
+      }
+      // don't look further than where the sequence would start
+      // overlapping the next hole (or reach it)
+      if (i < holes->num_extents) {
+        size_t hole_limit = holes->extents[i].pos;
+        if (search->match_holes)
+          hole_limit += m - 1;
+        if (hole_limit < limit)
+          limit = hole_limit;
+      }
+    }
+
+    if (limit - pos < m) {
+      // no room before the next hole
+      pos = limit;
+      continue;
+    }
+
+    // search the span at 'pos' in place if the sequence fits in it,
+    // otherwise a window copied from the buffer
+    size_t len = limit - pos;
+    struct hed_span span;
+    const uint8_t *data;
+    if (hed_snapshot_get_span(snap, pos, &span) && span.len >= m) {
+      data = span.data;
+      if (len > span.len)
+        len = span.len;
+      if (len > HED_SEARCH_CHUNK_SIZE)
+        len = HED_SEARCH_CHUNK_SIZE;
+    } else {
+      if (len > window_size)
+        len = window_size;
+      data = window;
+      len = hed_snapshot_read(snap, pos, window, len);
+    }
+    if (len < m)
+      return 0;
+
+    size_t off;
+    if (hed_pattern_find(pat, data, len, false, &off)) {
+      *match_pos = pos + off;
+      return 1;
+    }
+    pos += len - m + 1;
+  }
+  return 0;
+}
+
+/*
+ * Search for matches starting in [first, pos], like search_forward().
+ */
+static int search_backward(struct hed_search *search, size_t chunk, size_t first, size_t pos,
+                           uint8_t *window, size_t window_size, size_t *match_pos, size_t *done)
+{
+  struct hed_snapshot *snap = search->snap;
+  const struct hed_pattern *pat = search->pat;
+  size_t m = pat->len;
+
+  // 'end' is the end of the data where a match can be
+  size_t end = pos + m;
+  for (;;) {
+    count_searched(search, pos + 1 - ((end >= first + m) ? end - m + 1 : first), done);
+    if (end < first + m || chunk_superseded(search, chunk))
+      break;
+    const struct hed_extent_set *holes = &snap->holes;
+    size_t limit = first;
+    if (holes->num_extents > 0) {
+      size_t i = find_hole(holes, end - 1);
+      if (i < holes->num_extents && holes->extents[i].pos <= end - 1) {
+        size_t hole_start = holes->extents[i].pos;
+        if (! search->match_holes) {
+          end = hole_start;
+          continue;
+        }
+        if (end - hole_start >= m) {
+          if (pat->all_zeros) {
+            *match_pos = end - m;
+            return 1;
+          }
+          end = hole_start + m - 1;
+          continue;
+        }
+      }
+      if (i > 0) {
+        size_t hole_end = holes->extents[i-1].pos + holes->extents[i-1].len;
+        if (! search->match_holes) {
+          if (hole_end > limit)
+            limit = hole_end;
+        } else if (hole_end > limit + m - 1)
+          limit = hole_end - (m - 1);
+      }
+    }
+
+    if (end - limit < m) {
+      // no room after the previous hole
+      end = limit;
+      continue;
+    }
+
+    // try the chunk before 'end' in place, then a copied window
+    size_t len = end - limit;
+    if (len > HED_SEARCH_CHUNK_SIZE)
+      len = HED_SEARCH_CHUNK_SIZE;
+    struct hed_span span;
+    const uint8_t *data;
+    if (hed_snapshot_get_span(snap, end - len, &span) && span.len >= len) {
+      data = span.data;
+    } else {
+      if (len > window_size)
+        len = window_size;
+      data = window;
+      if (hed_snapshot_read(snap, end - len, window, len) < len)
+        return 0;
+    }
+
+    size_t off;
+    if (hed_pattern_find(pat, data, len, true, &off)) {
+      *match_pos = end - len + off;
+      return 1;
+    }
+    end -= len - (m - 1);
+  }
+  return 0;
+}
+
+static void search_chunks(struct hed_search *search)
+{
+  size_t window_size = HED_SEARCH_WINDOW_SIZE;
+  if (window_size < 2 * search->pat->len)
+    window_size = 2 * search->pat->len;
+  uint8_t *window = malloc(window_size);
+  if (! window) {
+    atomic_store(&search->failed, true);
+    return;
+  }
+
+  for (;;) {
+    size_t chunk = atomic_fetch_add(&search->next_chunk, 1);
+    if (chunk >= search->num_chunks || chunk_superseded(search, chunk))
+      break;
+
+    size_t first = chunk * HED_SEARCH_PARALLEL_CHUNK;
+    size_t last = first + HED_SEARCH_PARALLEL_CHUNK;
+    if (last > search->num_positions)
+      last = search->num_positions;
+    size_t match_pos;
+    size_t done = 0;
+    int found;
+    if (search->backward)
+      found = search_backward(search, chunk, search->start - (last - 1), search->start - first, window, window_size, &match_pos, &done);
+    else
+      found = search_forward(search, chunk, search->start + first, search->start + last, window, window_size, &match_pos, &done);
+    // the rest of the chunk doesn't need searching
+    atomic_fetch_add(&search->done_positions, (last - first) - done);
+    if (found) {
+      pthread_mutex_lock(&search->lock);
+      if (chunk < atomic_load(&search->found_chunk)) {
+        search->match_pos = match_pos;
+        atomic_store(&search->found_chunk, chunk);
+      }
+      pthread_mutex_unlock(&search->lock);
+    }
+  }
+
+  free(window);
+}
+
+static void *search_thread(void *arg)
+{
+  hed_store_enter_thread();
+  search_chunks(arg);
+  hed_store_leave_thread();
+  return NULL;
+}
+
+/*
+ * Set the number of threads used for searching (0 for one per CPU).
+ * With a single thread the chunks are searched in order by one thread.
+ */
+void hed_set_search_threads(unsigned int num_threads)
+{
+  search_threads = (num_threads > HED_SEARCH_MAX_THREADS) ? HED_SEARCH_MAX_THREADS : num_threads;
+}
+
+static unsigned int get_search_threads(void)
+{
+  if (search_threads == 0) {
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_cpus < 1)
+      return 1;
+    return (num_cpus > HED_SEARCH_MAX_THREADS) ? HED_SEARCH_MAX_THREADS : num_cpus;
+  }
+  return search_threads;
+}
+
+static void *run_search(void *arg)
+{
+  struct hed_search *search = arg;
+  hed_store_enter_thread();
+
+  size_t max_threads = get_search_threads();
+  if (max_threads > search->num_chunks)
+    max_threads = search->num_chunks;
+  pthread_t threads[HED_SEARCH_MAX_THREADS];
+  size_t num_threads = 0;
+  while (num_threads + 1 < max_threads && pthread_create(&threads[num_threads], NULL, search_thread, search) == 0)
+    num_threads++;
+  search_chunks(search);
+  for (size_t i = 0; i < num_threads; i++)
+    pthread_join(threads[i], NULL);
+
+  hed_store_leave_thread();
+  atomic_store(&search->finished, true);
+  return NULL;
+}
+
+/*
+ * Start searching the buffer in the background for the first
+ * occurrence of the pattern at or after 'pos' or, if 'backward' is
+ * set, the last one at or before 'pos'.  If 'match_holes' is set,
+ * holes match a pattern of zeros; otherwise no match overlaps a hole,
+ * not even partly.  The search uses a snapshot of the buffer,
+ * so the buffer can change meanwhile; the pattern must not.  Returns
+ * NULL on error.
+ */
+struct hed_search *hed_start_search(struct hed_buffer *buf, const struct hed_pattern *pat, size_t pos, bool backward, bool match_holes)
+{
+  struct hed_search *search = malloc(sizeof(struct hed_search));
+  if (! search)
+    return NULL;
+  search->snap = hed_buffer_snapshot(buf);
+  if (! search->snap) {
+    free(search);
+    return NULL;
+  }
+  search->pat = pat;
+  search->backward = backward;
+  search->match_holes = match_holes;
+  search->num_positions = 0;
+  search->match_pos = 0;
+  pthread_mutex_init(&search->lock, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &search->start_time);
+  atomic_init(&search->next_chunk, 0);
+  atomic_init(&search->found_chunk, SIZE_MAX);
+  atomic_init(&search->done_positions, 0);
+  atomic_init(&search->cancelled, false);
+  atomic_init(&search->failed, false);
+  atomic_init(&search->finished, false);
+
+  if (pat->len <= buf->len) {
+    size_t last_pos = buf->len - pat->len;
+    if (backward)
+      search->num_positions = ((pos < last_pos) ? pos : last_pos) + 1;
+    else if (pos <= last_pos)
+      search->num_positions = last_pos - pos + 1;
+    if (backward && pos > last_pos)
+      pos = last_pos;
+  }
+  search->start = pos;
+  search->num_chunks = (search->num_positions + HED_SEARCH_PARALLEL_CHUNK - 1) / HED_SEARCH_PARALLEL_CHUNK;
+
+  // select the kernels before the threads use them
+  hed_get_search_cpu();
+  if (pthread_create(&search->thread, NULL, run_search, search) != 0) {
+    pthread_mutex_destroy(&search->lock);
+    hed_free_snapshot(search->snap);
+    free(search);
+    return NULL;
+  }
+  return search;
+}
+
+/*
+ * Return true if the search is done (see hed_finish_search()).
+ */
+bool hed_search_finished(struct hed_search *search)
+{
+  return atomic_load(&search->finished);
+}
+
+void hed_get_search_progress(struct hed_search *search, struct hed_search_progress *progress)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  progress->done = atomic_load(&search->done_positions);
+  progress->total = search->num_positions;
+  progress->elapsed = (now.tv_sec - search->start_time.tv_sec) + (now.tv_nsec - search->start_time.tv_nsec) / 1e9;
+}
+
+/*
+ * Wait for the search to end and free it.  Returns 1 and sets
+ * 'match_pos' if the pattern was found, 0 if not (or if the search
+ * was cancelled) and -1 on error.
+ */
+int hed_finish_search(struct hed_search *search, size_t *match_pos)
+{
+  pthread_join(search->thread, NULL);
+  int ret = 0;
+  if (atomic_load(&search->cancelled))
+    ret = 0;
+  else if (atomic_load(&search->found_chunk) != SIZE_MAX) {
+    *match_pos = search->match_pos;
+    ret = 1;
+  } else if (atomic_load(&search->failed))
+    ret = -1;
+  pthread_mutex_destroy(&search->lock);
+  hed_free_snapshot(search->snap);
+  free(search);
+  return ret;
+}
+
+/*
+ * Stop the search and free it.
+ */
+void hed_cancel_search(struct hed_search *search)
+{
+  size_t match_pos;
+  atomic_store(&search->cancelled, true);
+  hed_finish_search(search, &match_pos);
+}
@@ -0,0 +1,86 @@
+/* search.h */
+
+#ifndef SEARCH_H_FILE
+#define SEARCH_H_FILE
+
+#include "hed.h"
+
+// the sizes can be made smaller to test the borders between chunks
+#ifndef HED_SEARCH_CHUNK_SIZE
+#define HED_SEARCH_CHUNK_SIZE   (1024*1024)
+#endif
+#ifndef HED_SEARCH_WINDOW_SIZE
+#define HED_SEARCH_WINDOW_SIZE  (64*1024)
+#endif
+#ifndef HED_SEARCH_PARALLEL_CHUNK
+#define HED_SEARCH_PARALLEL_CHUNK (16*1024*1024)
+#endif
+#define HED_SEARCH_SHORT_LEN    3
+#define HED_SEARCH_MAX_THREADS  64
+
+struct hed_buffer;
+struct hed_search;
+
+struct hed_search_progress {
+  size_t done;
+  size_t total;
+  double elapsed;
+};
+
+/*
+ * Instruction set used by the search kernels.
+ */
+enum hed_search_cpu {
+  HED_CPU_SCALAR,
+  HED_CPU_SSE2,
+  HED_CPU_AVX2,
+  HED_CPU_AVX512,
+};
+
+/*
+ * Byte sequence prepared for searching.  If 'mask' is not NULL, only
+ * the bits set in it are compared ('bytes' is stored already masked),
+ * so a 0x00 mask byte is a wildcard.  If the CPU has vector
+ * instructions, candidates are found by comparing the bytes at 'first'
+ * (the start of the longest run without wildcards) and 'anchor' (the
+ * last one of the run that differs from it, so runs of the same byte
+ * don't make every position a candidate) under their masks at 16, 32
+ * or 64 positions at once, and then checked in full.  Otherwise the
+ * algorithm is chosen by the length: memchr() for a single byte,
+ * memchr() for the first (or last) byte followed by a comparison for
+ * sequences of up to HED_SEARCH_SHORT_LEN bytes (too short for the
+ * skip tables to pay off), and Boyer-Moore-Horspool for the rest and
+ * for any pattern with a mask.  'skip' has the forward shift for the
+ * byte under the last position of the run of 'first_len' bytes at
+ * 'first' (the whole pattern if it has no mask), 'rskip' the backward
+ * shift for the byte under the first.
+ */
+struct hed_pattern {
+  uint8_t *bytes;
+  uint8_t *mask;
+  size_t len;
+  size_t first;
+  size_t first_len;
+  size_t anchor;
+  bool all_zeros;
+  size_t skip[256];
+  size_t rskip[256];
+};
+
+int hed_set_search_cpu(const char *name);
+const char *hed_get_search_cpu(void);
+void hed_set_search_threads(unsigned int num_threads);
+
+struct hed_pattern *hed_new_pattern(const uint8_t *bytes, const uint8_t *mask, size_t len);
+void hed_free_pattern(struct hed_pattern *pat);
+size_t hed_parse_search_bytes(uint8_t *bytes, uint8_t *mask, size_t max_len, const char *str);
+
+bool hed_pattern_find(const struct hed_pattern *pat, const uint8_t *data, size_t len, bool backward, size_t *off);
+
+struct hed_search *hed_start_search(struct hed_buffer *buf, const struct hed_pattern *pat, size_t pos, bool backward, bool match_holes);
+bool hed_search_finished(struct hed_search *search);
+void hed_get_search_progress(struct hed_search *search, struct hed_search_progress *progress);
+int hed_finish_search(struct hed_search *search, size_t *match_pos);
+void hed_cancel_search(struct hed_search *search);
+
+#endif /* SEARCH_H_FILE */
@@ -0,0 +1,1391 @@
+/* store.c */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/vfs.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "store.h"
+#include "buffer.h"
+#include "screen.h"
+
+#define NFS_SUPER_MAGIC    0x6969
+#define SMB_SUPER_MAGIC    0x517b
+#define CIFS_SUPER_MAGIC   0xff534d42
+#define SMB2_SUPER_MAGIC   0xfe534d42
+#define FUSE_SUPER_MAGIC   0x65735546
+#define CEPH_SUPER_MAGIC   0x00c36400
+#define V9FS_SUPER_MAGIC   0x01021997
+
+#define MIN_CACHE_PAGES    4
+#define PREFETCH_QUEUE_LEN 8
+
+#define LOAD_CHUNK_SIZE        (4*1024*1024)
+#define LOAD_MAX_THREADS       8
+#define LOAD_HUGE_PAGE_SIZE    (2*1024*1024)
+#define LOAD_PROGRESS_INTERVAL 100   // ms
+
+struct hed_page {
+  struct hed_page *lru_prev;
+  struct hed_page *lru_next;
+  struct hed_page *hash_next;
+  struct hed_store *store;
+  size_t index;
+  size_t len;
+  unsigned int pins;
+  uint8_t data[];
+};
+
+/*
+ * Page cache shared by all paged stores.  Pages are clean copies of
+ * file data, so they can be evicted at any time; the least recently
+ * used one goes first.  The cache can be used from several threads
+ * (a background save reads pages while the editor keeps running):
+ * each thread pins the last page it got, so the data it's looking
+ * at stays valid until it asks for another span.
+ */
+struct hed_page_cache {
+  bool limited;
+  size_t max_pages;
+  size_t num_pages;
+  struct hed_page *lru_first;   // most recently used
+  struct hed_page *lru_last;    // least recently used
+  struct hed_page **hash;
+  size_t hash_size;
+};
+
+static struct hed_page_cache page_cache = {
+  .limited = false,
+  .max_pages = HED_DEFAULT_CACHE_SIZE / HED_PAGE_SIZE,
+};
+
+/*
+ * Data arriving from a stream (like a pipe on stdin).  A thread
+ * moves it into a memfd, and past 'spill_off' bytes into an unlinked
+ * temporary file, so it never takes more memory than that; it's read
+ * back through the page cache.  'spill_off' is a multiple of the page
+ * size, so every page comes from only one of the files.
+ */
+struct hed_stream {
+  pthread_t thread;
+  int in_fd;
+  int mem_fd;
+  int spill_fd;
+  size_t spill_off;
+  atomic_size_t avail;
+  atomic_bool ended;
+  atomic_bool failed;
+};
+
+static size_t stream_spill_size = HED_DEFAULT_SPILL_SIZE;
+
+/*
+ * Requests to read pages of paged stores into the cache ahead of
+ * time, served by a thread that's started when the first request
+ * comes.  When the queue is full, the oldest request is dropped:
+ * it's the least likely to still be useful.  'busy_store' is the
+ * store the thread is reading from (with the cache unlocked).
+ */
+struct hed_prefetch_req {
+  struct hed_store *store;
+  size_t off;
+  size_t len;
+};
+
+struct hed_prefetcher {
+  bool started;
+  bool cancel;
+  pthread_cond_t wake;
+  pthread_cond_t done;
+  struct hed_prefetch_req queue[PREFETCH_QUEUE_LEN];
+  size_t first;
+  size_t num_reqs;
+  struct hed_store *busy_store;
+};
+
+static struct hed_prefetcher prefetcher = {
+  .wake = PTHREAD_COND_INITIALIZER,
+  .done = PTHREAD_COND_INITIALIZER,
+};
+
+/*
+ * Reading of a whole file into memory.  The file is split in chunks
+ * that a few threads read in parallel (a single reader can't keep a
+ * fast SSD busy); each thread takes the next chunk from 'next_off'
+ * until there are no more or one of them fails.
+ */
+struct hed_loader {
+  int fd;
+  uint8_t *data;
+  size_t size;
+  atomic_size_t next_off;
+  atomic_size_t done;
+  atomic_bool failed;
+  unsigned int num_running;
+  pthread_mutex_t lock;
+  pthread_cond_t finished;
+};
+
+static bool load_into_memory;
+static bool follow_files;
+static hed_load_progress_func load_progress_func;
+static void *load_progress_data;
+
+static const uint8_t zero_page[HED_PAGE_SIZE];
+
+static pthread_mutex_t page_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct hed_page *pinned_page;
+static __thread bool quiet_read_errors;
+static __thread size_t num_read_errors;
+
+/*
+ * Limit the memory used for file data.  All files opened after this
+ * is called will be paged, and all pages share a cache of at most
+ * 'max_bytes' bytes.  Only the data read from files is limited: data
+ * inserted or changed in a buffer is kept in its add chunks until
+ * it's saved.
+ */
+void hed_set_memory_limit(size_t max_bytes)
+{
+  page_cache.limited = true;
+  page_cache.max_pages = max_bytes / HED_PAGE_SIZE;
+  if (page_cache.max_pages < MIN_CACHE_PAGES)
+    page_cache.max_pages = MIN_CACHE_PAGES;
+}
+
+/*
+ * Read regular files opened from now on whole into memory instead of
+ * mapping them or reading them on demand.
+ */
+void hed_set_load_into_memory(bool load)
+{
+  load_into_memory = load;
+}
+
+/*
+ * Follow the growth of regular files opened from now on (like
+ * "tail -f"): they're always paged, so they can be extended without
+ * reading them again, and watched with inotify (see
+ * hed_store_poll_follow()).
+ */
+void hed_set_follow_files(bool follow)
+{
+  follow_files = follow;
+}
+
+/*
+ * Set the function called periodically while a file is being read
+ * into memory, with the number of bytes read so far.
+ */
+void hed_set_load_progress_func(hed_load_progress_func func, void *data)
+{
+  load_progress_func = func;
+  load_progress_data = data;
+}
+
+size_t hed_get_cache_usage(void)
+{
+  return page_cache.num_pages * HED_PAGE_SIZE;
+}
+
+static size_t hash_page(struct hed_store *store, size_t index)
+{
+  uintptr_t h = (uintptr_t) store / sizeof(struct hed_store) * 31 + index;
+  return (h ^ (h >> 16)) & (page_cache.hash_size - 1);
+}
+
+static int init_page_cache(void)
+{
+  if (page_cache.hash)
+    return 0;
+  size_t hash_size = 16;
+  while (hash_size < 2*page_cache.max_pages)
+    hash_size *= 2;
+  page_cache.hash = calloc(hash_size, sizeof(struct hed_page *));
+  if (! page_cache.hash)
+    return -1;
+  page_cache.hash_size = hash_size;
+  return 0;
+}
+
+static void lru_unlink(struct hed_page *page)
+{
+  if (page->lru_prev)
+    page->lru_prev->lru_next = page->lru_next;
+  else
+    page_cache.lru_first = page->lru_next;
+  if (page->lru_next)
+    page->lru_next->lru_prev = page->lru_prev;
+  else
+    page_cache.lru_last = page->lru_prev;
+}
+
+static void lru_push_first(struct hed_page *page)
+{
+  page->lru_prev = NULL;
+  page->lru_next = page_cache.lru_first;
+  if (page_cache.lru_first)
+    page_cache.lru_first->lru_prev = page;
+  else
+    page_cache.lru_last = page;
+  page_cache.lru_first = page;
+}
+
+static void hash_remove(struct hed_page *page)
+{
+  struct hed_page **p = &page_cache.hash[hash_page(page->store, page->index)];
+  while (*p != page)
+    p = &(*p)->hash_next;
+  *p = page->hash_next;
+}
+
+static void drop_page(struct hed_page *page)
+{
+  if (page == pinned_page)
+    pinned_page = NULL;
+  hash_remove(page);
+  lru_unlink(page);
+  page_cache.num_pages--;
+  free(page);
+}
+
+static void drop_store_pages(struct hed_store *store)
+{
+  struct hed_page *page = page_cache.lru_first;
+  while (page) {
+    struct hed_page *next = page->lru_next;
+    if (page->store == store)
+      drop_page(page);
+    page = next;
+  }
+}
+
+/*
+ * Return the length of the data available in a store.  For streams,
+ * this can be more than 'len' (which is only updated by the thread
+ * that owns the store).
+ */
+static size_t get_store_avail(struct hed_store *store)
+{
+  if (store->type == HED_STORE_STREAM)
+    return atomic_load(&store->stream->avail);
+  return atomic_load(&store->len);
+}
+
+/*
+ * Read the bytes from 'pos' to the end of the page.
+ */
+static int read_page(struct hed_store *store, struct hed_page *page, size_t pos)
+{
+  size_t off = page->index * HED_PAGE_SIZE;
+  int fd = store->fd;
+  if (store->type == HED_STORE_STREAM) {
+    struct hed_stream *stream = store->stream;
+    fd = stream->mem_fd;
+    if (off >= stream->spill_off) {
+      fd = stream->spill_fd;
+      off -= stream->spill_off;
+    }
+  }
+  while (pos < page->len) {
+    size_t len = page->len - pos;
+    if (store->holes) {
+      // holes read as zeros (and can't be read at all in a process)
+      bool is_hole;
+      size_t run = hed_store_get_run(store, off + pos, &is_hole);
+      if (run < len)
+        len = run;
+      if (is_hole) {
+        memset(page->data + pos, 0, len);
+        pos += len;
+        continue;
+      }
+    }
+    ssize_t n = pread(fd, page->data + pos, len, off + pos);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      memset(page->data + pos, 0, page->len - pos);
+      return -1;
+    }
+    pos += n;
+  }
+  return 0;
+}
+
+static void report_read_error(size_t off)
+{
+  num_read_errors++;
+  if (! quiet_read_errors)
+    show_msg("ERROR: error reading file at offset %zx", off);
+}
+
+static struct hed_page *find_page(struct hed_store *store, size_t index)
+{
+  struct hed_page *page = page_cache.hash[hash_page(store, index)];
+  while (page && (page->store != store || page->index != index))
+    page = page->hash_next;
+  return page;
+}
+
+/*
+ * Remove the least recently used page nobody is looking at from the
+ * cache if it's full, and return it so it can be reused.
+ */
+static struct hed_page *evict_page(void)
+{
+  if (page_cache.num_pages < page_cache.max_pages)
+    return NULL;
+  struct hed_page *page = page_cache.lru_last;
+  while (page && page->pins > 0)
+    page = page->lru_prev;
+  if (page) {
+    hash_remove(page);
+    lru_unlink(page);
+    page_cache.num_pages--;
+  }
+  return page;
+}
+
+static void insert_page(struct hed_page *page)
+{
+  struct hed_page **bucket = &page_cache.hash[hash_page(page->store, page->index)];
+  page->hash_next = *bucket;
+  *bucket = page;
+  lru_push_first(page);
+  page_cache.num_pages++;
+}
+
+static size_t get_page_len(struct hed_store *store, size_t index)
+{
+  size_t off = index * HED_PAGE_SIZE;
+  size_t avail = get_store_avail(store);
+  return (avail - off < HED_PAGE_SIZE) ? avail - off : HED_PAGE_SIZE;
+}
+
+static struct hed_page *get_page(struct hed_store *store, size_t index)
+{
+  size_t off = index * HED_PAGE_SIZE;
+  size_t len = get_page_len(store, index);
+  struct hed_page *page = find_page(store, index);
+  if (page) {
+    if (page->len < len) {
+      // the last page of a stream (or followed file) got more data
+      size_t old_len = page->len;
+      page->len = len;
+      if (read_page(store, page, old_len) < 0)
+        report_read_error(off + old_len);
+    }
+    lru_unlink(page);
+    lru_push_first(page);
+    return page;
+  }
+
+  page = evict_page();
+  if (! page) {
+    page = malloc(sizeof(struct hed_page) + HED_PAGE_SIZE);
+    if (! page)
+      return NULL;
+  }
+  page->store = store;
+  page->index = index;
+  page->len = len;
+  page->pins = 0;
+  if (read_page(store, page, 0) < 0)
+    report_read_error(off);
+  insert_page(page);
+  return page;
+}
+
+/*
+ * Read the pages of a prefetch request that are not in the cache
+ * yet.  The cache is unlocked while reading, so the store must not
+ * be freed until 'busy_store' is cleared (see cancel_prefetch()).
+ * Pages with read errors are just left out: they'll be read again
+ * (and the error reported) if they're ever looked at.  Prefetching
+ * never grows the cache past its limit, so it stops if the cache is
+ * full of pinned pages.
+ */
+static void prefetch_pages(struct hed_prefetch_req *req)
+{
+  struct hed_store *store = req->store;
+  size_t index = req->off / HED_PAGE_SIZE;
+  size_t end = req->off + req->len;
+  for (; index * HED_PAGE_SIZE < end && ! prefetcher.cancel; index++) {
+    size_t len = get_page_len(store, index);
+    if (find_page(store, index))
+      continue;
+    if (store->holes) {
+      bool is_hole;
+      if (hed_store_get_run(store, index * HED_PAGE_SIZE, &is_hole) >= len && is_hole)
+        continue;
+    }
+
+    pthread_mutex_unlock(&page_cache_lock);
+    struct hed_page *page = malloc(sizeof(struct hed_page) + HED_PAGE_SIZE);
+    if (page) {
+      page->store = store;
+      page->index = index;
+      page->len = len;
+      page->pins = 0;
+      if (read_page(store, page, 0) < 0) {
+        free(page);
+        page = NULL;
+      }
+    }
+    pthread_mutex_lock(&page_cache_lock);
+    if (! page)
+      break;
+    if (prefetcher.cancel || find_page(store, index)) {
+      free(page);
+      continue;
+    }
+    struct hed_page *old_page = evict_page();
+    if (! old_page && page_cache.num_pages >= page_cache.max_pages) {
+      // every page is pinned: the cache can't take more data
+      free(page);
+      break;
+    }
+    free(old_page);
+    insert_page(page);
+  }
+}
+
+static void *prefetch_thread(void *arg)
+{
+  (void) arg;
+  pthread_mutex_lock(&page_cache_lock);
+  while (true) {
+    while (prefetcher.num_reqs == 0)
+      pthread_cond_wait(&prefetcher.wake, &page_cache_lock);
+    struct hed_prefetch_req req = prefetcher.queue[prefetcher.first];
+    prefetcher.first = (prefetcher.first + 1) % PREFETCH_QUEUE_LEN;
+    prefetcher.num_reqs--;
+
+    prefetcher.busy_store = req.store;
+    prefetcher.cancel = false;
+    prefetch_pages(&req);
+    prefetcher.busy_store = NULL;
+    pthread_cond_broadcast(&prefetcher.done);
+  }
+  return NULL;
+}
+
+/*
+ * Remove the queued prefetch requests for a store and wait for the
+ * thread to stop reading from it.  Must be called with the cache
+ * locked.
+ */
+static void cancel_prefetch(struct hed_store *store)
+{
+  size_t num_reqs = 0;
+  for (size_t i = 0; i < prefetcher.num_reqs; i++) {
+    struct hed_prefetch_req *req = &prefetcher.queue[(prefetcher.first + i) % PREFETCH_QUEUE_LEN];
+    if (req->store != store)
+      prefetcher.queue[(prefetcher.first + num_reqs++) % PREFETCH_QUEUE_LEN] = *req;
+  }
+  prefetcher.num_reqs = num_reqs;
+  while (prefetcher.busy_store == store) {
+    prefetcher.cancel = true;
+    pthread_cond_wait(&prefetcher.done, &page_cache_lock);
+  }
+}
+
+static struct hed_store *new_store(enum hed_store_type type, size_t len)
+{
+  struct hed_store *store = malloc(sizeof(struct hed_store));
+  if (! store)
+    return NULL;
+  store->type = type;
+  store->len = len;
+  store->fd = -1;
+  store->follow = false;
+  store->watch_fd = -1;
+  store->dev = 0;
+  store->ino = 0;
+  store->data = NULL;
+  store->data_mapped = false;
+  store->stream = NULL;
+  store->holes = NULL;
+  return store;
+}
+
+/*
+ * Find the holes of a sparse file with SEEK_DATA/SEEK_HOLE.  The map
+ * is left empty if the filesystem doesn't support it (or the file
+ * has no holes).
+ */
+static struct hed_extent_set *read_hole_map(int fd, size_t size)
+{
+  struct hed_extent_set *holes = malloc(sizeof(struct hed_extent_set));
+  if (! holes)
+    return NULL;
+  holes->extents = NULL;
+  holes->num_extents = 0;
+  holes->cap = 0;
+  holes->num_bytes = 0;
+
+  off_t pos = 0;
+  while ((size_t) pos < size) {
+    off_t data = lseek(fd, pos, SEEK_DATA);
+    if (data < 0 && errno == ENXIO)
+      data = size;              // hole until the end of the file
+    else if (data < 0)
+      break;
+    if (data > pos && hed_add_extent(holes, pos, data - pos) < 0)
+      break;
+    if ((size_t) data >= size)
+      break;
+    pos = lseek(fd, data, SEEK_HOLE);
+    if (pos < 0)
+      break;
+  }
+  return holes;
+}
+
+static void free_hole_map(struct hed_extent_set *holes)
+{
+  free(holes->extents);
+  free(holes);
+}
+
+/*
+ * Return the length of the run of hole or data bytes starting at
+ * 'off' in the store, and set 'is_hole' to which one it is.
+ */
+size_t hed_store_get_run(struct hed_store *store, size_t off, bool *is_hole)
+{
+  *is_hole = false;
+  size_t len = atomic_load(&store->len);
+  if (off >= len)
+    return 0;
+  struct hed_extent_set *holes = store->holes;
+  if (! holes || holes->num_extents == 0)
+    return len - off;
+
+  // find the first hole that ends after 'off'
+  size_t lo = 0, hi = holes->num_extents;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (holes->extents[mid].pos + holes->extents[mid].len <= off)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == holes->num_extents)
+    return len - off;
+  struct hed_extent *hole = &holes->extents[lo];
+  if (hole->pos <= off) {
+    *is_hole = true;
+    return hole->pos + hole->len - off;
+  }
+  return hole->pos - off;
+}
+
+struct hed_store *hed_new_memory_store(uint8_t *data, size_t len)
+{
+  struct hed_store *store = new_store(HED_STORE_MEMORY, len);
+  if (! store)
+    return NULL;
+  store->data = data;
+  return store;
+}
+
+/*
+ * Return true if the file should be read through the page cache
+ * instead of mapped: when the memory use is limited, when the file
+ * is on a network or FUSE filesystem (where a page fault can block
+ * for a long time or fail with SIGBUS), or when the file is larger
+ * than physical memory.
+ */
+static bool want_paged_store(int fd, size_t size)
+{
+  if (page_cache.limited)
+    return true;
+
+  struct statfs fs;
+  if (fstatfs(fd, &fs) == 0) {
+    switch ((unsigned long) fs.f_type) {
+    case NFS_SUPER_MAGIC:
+    case SMB_SUPER_MAGIC:
+    case CIFS_SUPER_MAGIC:
+    case SMB2_SUPER_MAGIC:
+    case FUSE_SUPER_MAGIC:
+    case CEPH_SUPER_MAGIC:
+    case V9FS_SUPER_MAGIC:
+      return true;
+    }
+  }
+
+  long num_pages = sysconf(_SC_PHYS_PAGES);
+  long page_size = sysconf(_SC_PAGESIZE);
+  if (num_pages > 0 && page_size > 0 && size / page_size > (size_t) num_pages)
+    return true;
+  return false;
+}
+
+/*
+ * Allocate memory for 'size' bytes of file data.  Large sizes get an
+ * anonymous mapping aligned to the huge page size and marked for
+ * transparent huge pages, so the data takes fewer TLB entries and
+ * page faults; '*mapped' tells if it must be freed with munmap().
+ */
+static uint8_t *alloc_file_data(size_t size, bool *mapped)
+{
+  *mapped = false;
+  if (size >= LOAD_HUGE_PAGE_SIZE && size <= SIZE_MAX - 2*LOAD_HUGE_PAGE_SIZE) {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t map_len = size + LOAD_HUGE_PAGE_SIZE;
+    uint8_t *map = mmap(NULL, map_len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (map != MAP_FAILED) {
+      uint8_t *start = (uint8_t *) (((uintptr_t) map + LOAD_HUGE_PAGE_SIZE - 1) / LOAD_HUGE_PAGE_SIZE * LOAD_HUGE_PAGE_SIZE);
+      uint8_t *end = start + (size + page_size - 1) / page_size * page_size;
+      if (start > map)
+        munmap(map, start - map);
+      if (end < map + map_len)
+        munmap(end, map + map_len - end);
+      madvise(start, end - start, MADV_HUGEPAGE);
+      *mapped = true;
+      return start;
+    }
+  }
+  return malloc((size == 0) ? 1 : size);
+}
+
+static void *load_thread(void *arg)
+{
+  struct hed_loader *loader = arg;
+
+  while (! atomic_load(&loader->failed)) {
+    size_t pos = atomic_fetch_add(&loader->next_off, LOAD_CHUNK_SIZE);
+    if (pos >= loader->size)
+      break;
+    size_t end = (loader->size - pos > LOAD_CHUNK_SIZE) ? pos + LOAD_CHUNK_SIZE : loader->size;
+    while (pos < end) {
+      ssize_t n = pread(loader->fd, loader->data + pos, end - pos, pos);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0) {
+        atomic_store(&loader->failed, true);
+        break;
+      }
+      pos += n;
+      atomic_fetch_add(&loader->done, n);
+    }
+  }
+
+  pthread_mutex_lock(&loader->lock);
+  loader->num_running--;
+  pthread_cond_signal(&loader->finished);
+  pthread_mutex_unlock(&loader->lock);
+  return NULL;
+}
+
+/*
+ * Wait for the threads of a loader to finish, reporting the progress
+ * every LOAD_PROGRESS_INTERVAL milliseconds.
+ */
+static void wait_for_loader(struct hed_loader *loader)
+{
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  pthread_mutex_lock(&loader->lock);
+  while (loader->num_running > 0) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += LOAD_PROGRESS_INTERVAL * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    if (pthread_cond_timedwait(&loader->finished, &loader->lock, &deadline) == ETIMEDOUT && load_progress_func) {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      double elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+      pthread_mutex_unlock(&loader->lock);
+      load_progress_func(load_progress_data, atomic_load(&loader->done), loader->size, elapsed);
+      pthread_mutex_lock(&loader->lock);
+    }
+  }
+  pthread_mutex_unlock(&loader->lock);
+}
+
+/*
+ * Read the whole file into memory.  Used for files that can't be
+ * mapped (empty files or filesystems that don't support mmap()) or
+ * when asked to with hed_set_load_into_memory().
+ */
+static uint8_t *read_file_data(int fd, size_t size, bool *mapped)
+{
+  uint8_t *data = alloc_file_data(size, mapped);
+  if (! data) {
+    show_msg("ERROR: not enough memory for %zu bytes", size);
+    return NULL;
+  }
+
+  struct hed_loader loader = {
+    .fd = fd,
+    .data = data,
+    .size = size,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .finished = PTHREAD_COND_INITIALIZER,
+  };
+  atomic_init(&loader.next_off, 0);
+  atomic_init(&loader.done, 0);
+  atomic_init(&loader.failed, false);
+
+  // The threads spend most of their time waiting for the disk, so
+  // their number doesn't depend on the number of CPUs: it's what
+  // keeps enough requests queued to the device.
+  size_t num_chunks = (size + LOAD_CHUNK_SIZE - 1) / LOAD_CHUNK_SIZE;
+  size_t max_threads = (num_chunks < LOAD_MAX_THREADS) ? num_chunks : LOAD_MAX_THREADS;
+
+  pthread_t threads[LOAD_MAX_THREADS];
+  size_t num_threads = 0;
+  if (max_threads > 1) {
+    pthread_mutex_lock(&loader.lock);
+    while (num_threads < max_threads && pthread_create(&threads[num_threads], NULL, load_thread, &loader) == 0) {
+      loader.num_running++;
+      num_threads++;
+    }
+    pthread_mutex_unlock(&loader.lock);
+  }
+  if (num_threads > 0) {
+    wait_for_loader(&loader);
+    for (size_t i = 0; i < num_threads; i++)
+      pthread_join(threads[i], NULL);
+  } else {
+    // small file (or no threads): read it here
+    loader.num_running = 1;
+    load_thread(&loader);
+  }
+  pthread_mutex_destroy(&loader.lock);
+  pthread_cond_destroy(&loader.finished);
+
+  if (atomic_load(&loader.failed)) {
+    show_msg("ERROR: error reading file");
+    if (*mapped)
+      munmap(data, size);
+    else
+      free(data);
+    return NULL;
+  }
+  return data;
+}
+
+/*
+ * Start watching the file of a store for writes.  If inotify can't be
+ * used (for example, when out of watches), the file size is checked
+ * on every poll instead.
+ */
+static void start_follow(struct hed_store *store)
+{
+  store->follow = true;
+  store->watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (store->watch_fd < 0)
+    return;
+  // the watch is on the inode the descriptor points to, not on the
+  // name, so it doesn't matter if the file is renamed
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", store->fd);
+  if (inotify_add_watch(store->watch_fd, path, IN_MODIFY) < 0) {
+    close(store->watch_fd);
+    store->watch_fd = -1;
+  }
+}
+
+/*
+ * Check if a followed file grew and extend the store with the new
+ * data, which will be read when it's needed.  Returns true if 'len'
+ * changed.  Files that shrink are left alone: what was already read
+ * is kept.
+ */
+bool hed_store_poll_follow(struct hed_store *store)
+{
+  if (! store->follow)
+    return false;
+  if (store->watch_fd >= 0) {
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool modified = false;
+    while (read(store->watch_fd, events, sizeof(events)) > 0)
+      modified = true;
+    if (! modified)
+      return false;
+  }
+
+  struct stat st;
+  if (fstat(store->fd, &st) < 0 || (uint64_t) st.st_size > SIZE_MAX || (size_t) st.st_size <= store->len)
+    return false;
+  pthread_mutex_lock(&page_cache_lock);
+  atomic_store(&store->len, st.st_size);
+  pthread_mutex_unlock(&page_cache_lock);
+  return true;
+}
+
+/*
+ * Create a store for the file or block device open in 'fd'.  The
+ * store takes ownership of the file descriptor.
+ */
+struct hed_store *hed_open_file_store(int fd)
+{
+  struct stat st;
+  uint64_t file_size;
+  if (fstat(fd, &st) < 0) {
+    show_msg("ERROR: can't determine file size");
+    return NULL;
+  }
+  if (S_ISREG(st.st_mode))
+    file_size = st.st_size;
+  else if (! S_ISBLK(st.st_mode) || ioctl(fd, BLKGETSIZE64, &file_size) < 0) {
+    show_msg("ERROR: can't determine file size");
+    return NULL;
+  }
+  if (file_size > SIZE_MAX) {
+    show_msg("ERROR: file is too large");
+    return NULL;
+  }
+  size_t size = file_size;
+
+  // Devices are always read on demand: they can be huge, and
+  // mapping them doesn't work everywhere.
+  struct hed_store *store = NULL;
+  bool follow = follow_files && S_ISREG(st.st_mode);
+  if (size > 0 && S_ISREG(st.st_mode) && load_into_memory && ! follow) {
+    // read below
+  } else if (follow || (size > 0 && (S_ISBLK(st.st_mode) || want_paged_store(fd, size)))) {
+    if (init_page_cache() < 0) {
+      show_msg("ERROR: out of memory");
+      return NULL;
+    }
+    store = new_store(HED_STORE_PAGED, size);
+  } else if (size > 0) {
+    // Map the file instead of reading it: opening is constant time,
+    // and only the pages that are actually looked at get read.  The
+    // mapping is never written to: edits go to the buffer's add data.
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      store = new_store(HED_STORE_MAPPED, size);
+      if (! store)
+        munmap(map, size);
+      else
+        store->data = map;
+    }
+  }
+  if (! store) {
+    bool mapped;
+    uint8_t *data = read_file_data(fd, size, &mapped);
+    if (! data)
+      return NULL;
+    store = hed_new_memory_store(data, size);
+    if (! store) {
+      if (mapped)
+        munmap(data, size);
+      else
+        free(data);
+    } else
+      store->data_mapped = mapped;
+  }
+  if (! store) {
+    show_msg("ERROR: out of memory");
+    return NULL;
+  }
+  store->fd = fd;
+  store->dev = st.st_dev;
+  store->ino = st.st_ino;
+  if (S_ISREG(st.st_mode) && size > 0)
+    store->holes = read_hole_map(fd, size);
+  if (follow)
+    start_follow(store);
+  return store;
+}
+
+/*
+ * Create a store for the address space of process 'pid', read from
+ * /proc/PID/mem.  Offsets are virtual addresses: the store ends with
+ * the last readable region, and the gaps between regions are holes,
+ * which are never read.  The regions are the ones mapped when the
+ * store is created.
+ */
+struct hed_store *hed_open_process_store(pid_t pid)
+{
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/maps", (int) pid);
+  FILE *maps = fopen(path, "r");
+  if (! maps) {
+    show_msg("ERROR: can't read memory map of process %d", (int) pid);
+    return NULL;
+  }
+
+  struct hed_extent_set *holes = malloc(sizeof(struct hed_extent_set));
+  if (! holes) {
+    fclose(maps);
+    show_msg("ERROR: out of memory");
+    return NULL;
+  }
+  holes->extents = NULL;
+  holes->num_extents = 0;
+  holes->cap = 0;
+  holes->num_bytes = 0;
+
+  size_t len = 0;
+  char line[512];
+  while (fgets(line, sizeof(line), maps)) {
+    size_t start, end;
+    char perms[8];
+    if (sscanf(line, "%zx-%zx %7s", &start, &end, perms) != 3 || perms[0] != 'r' || start < len || end <= start)
+      continue;
+    // these can't be read through /proc/PID/mem
+    if (strstr(line, "[vvar") || strstr(line, "[vsyscall]"))
+      continue;
+    if (start > len && hed_add_extent(holes, len, start - len) < 0) {
+      fclose(maps);
+      free_hole_map(holes);
+      show_msg("ERROR: out of memory");
+      return NULL;
+    }
+    len = end;
+  }
+  fclose(maps);
+
+  snprintf(path, sizeof(path), "/proc/%d/mem", (int) pid);
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    free_hole_map(holes);
+    show_msg("ERROR: can't read memory of process %d", (int) pid);
+    return NULL;
+  }
+  struct hed_store *store = NULL;
+  if (init_page_cache() < 0 || ! (store = new_store(HED_STORE_PAGED, len))) {
+    close(fd);
+    free_hole_map(holes);
+    show_msg("ERROR: out of memory");
+    return NULL;
+  }
+  store->fd = fd;
+  store->holes = holes;
+  return store;
+}
+
+/*
+ * Drop the cached data of a paged store, so it's read again when
+ * it's needed (to see the current memory of a process).  Pages other
+ * threads are looking at are left alone.
+ */
+void hed_store_refresh(struct hed_store *store)
+{
+  if (store->type != HED_STORE_PAGED)
+    return;
+  pthread_mutex_lock(&page_cache_lock);
+  struct hed_page *page = page_cache.lru_first;
+  while (page) {
+    struct hed_page *next = page->lru_next;
+    if (page->store == store && (page->pins == 0 || (page == pinned_page && page->pins == 1)))
+      drop_page(page);
+    page = next;
+  }
+  pthread_mutex_unlock(&page_cache_lock);
+}
+
+void hed_set_stream_spill_size(size_t max_bytes)
+{
+  stream_spill_size = (max_bytes + HED_PAGE_SIZE - 1) / HED_PAGE_SIZE * HED_PAGE_SIZE;
+}
+
+/*
+ * Open an unlinked temporary file in $TMPDIR (or /tmp).
+ */
+static int open_spill_file(void)
+{
+  const char *dir = getenv("TMPDIR");
+  if (! dir || *dir == '\0')
+    dir = "/tmp";
+  int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if (fd >= 0)
+    return fd;
+
+  char *filename = malloc(strlen(dir) + sizeof("/hed-XXXXXX"));
+  if (! filename)
+    return -1;
+  strcpy(filename, dir);
+  strcat(filename, "/hed-XXXXXX");
+  fd = mkstemp(filename);
+  if (fd >= 0)
+    unlink(filename);
+  free(filename);
+  return fd;
+}
+
+/*
+ * Move up to 'len' bytes from the input to 'off' in 'fd'.  Data from
+ * a pipe is spliced without being copied to user space; anything else
+ * goes through a buffer.
+ */
+static ssize_t transfer_stream_data(struct hed_stream *stream, int fd, size_t off, size_t len, bool *can_splice)
+{
+  if (*can_splice) {
+    loff_t out_off = off;
+    ssize_t n = splice(stream->in_fd, NULL, fd, &out_off, len, SPLICE_F_MOVE);
+    if (n >= 0 || errno != EINVAL)
+      return n;
+    *can_splice = false;
+  }
+
+  uint8_t buf[64*1024];
+  ssize_t n = read(stream->in_fd, buf, (len < sizeof(buf)) ? len : sizeof(buf));
+  if (n <= 0)
+    return n;
+  ssize_t done = 0;
+  while (done < n) {
+    ssize_t w = pwrite(fd, buf + done, n - done, off + done);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0)
+      return -1;
+    done += w;
+  }
+  return n;
+}
+
+static void *stream_thread(void *arg)
+{
+  struct hed_stream *stream = arg;
+  size_t len = 0;
+  bool can_splice = true;
+
+  while (true) {
+    int fd = stream->mem_fd;
+    size_t off = len;
+    size_t max = stream->spill_off - len;
+    if (len >= stream->spill_off) {
+      if (stream->spill_fd < 0 && (stream->spill_fd = open_spill_file()) < 0) {
+        atomic_store(&stream->failed, true);
+        break;
+      }
+      fd = stream->spill_fd;
+      off = len - stream->spill_off;
+      max = 1024*1024;
+    }
+    ssize_t n = transfer_stream_data(stream, fd, off, max, &can_splice);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      atomic_store(&stream->failed, true);
+    if (n <= 0)
+      break;
+    len += n;
+    atomic_store(&stream->avail, len);
+  }
+  atomic_store(&stream->ended, true);
+  return NULL;
+}
+
+static void free_stream(struct hed_stream *stream)
+{
+  if (! atomic_load(&stream->ended))
+    pthread_cancel(stream->thread);
+  pthread_join(stream->thread, NULL);
+  if (stream->mem_fd >= 0)
+    close(stream->mem_fd);
+  if (stream->spill_fd >= 0)
+    close(stream->spill_fd);
+  free(stream);
+}
+
+/*
+ * Create a store for the data arriving on 'fd' (which is not
+ * closed).  The data is read in the background; use
+ * hed_store_poll_stream() to see how much has arrived.
+ */
+struct hed_store *hed_open_stream_store(int fd)
+{
+  if (init_page_cache() < 0) {
+    show_msg("ERROR: out of memory");
+    return NULL;
+  }
+  struct hed_store *store = new_store(HED_STORE_STREAM, 0);
+  struct hed_stream *stream = malloc(sizeof(struct hed_stream));
+  if (! store || ! stream) {
+    free(store);
+    free(stream);
+    show_msg("ERROR: out of memory");
+    return NULL;
+  }
+  stream->in_fd = fd;
+  stream->spill_fd = -1;
+  stream->spill_off = stream_spill_size;
+  stream->mem_fd = memfd_create("hed-stream", MFD_CLOEXEC);
+  if (stream->mem_fd < 0)
+    stream->spill_off = 0;      // no memfd: spill everything
+  atomic_init(&stream->avail, 0);
+  atomic_init(&stream->ended, false);
+  atomic_init(&stream->failed, false);
+  if (pthread_create(&stream->thread, NULL, stream_thread, stream) != 0) {
+    if (stream->mem_fd >= 0)
+      close(stream->mem_fd);
+    free(stream);
+    free(store);
+    show_msg("ERROR: can't start reading stream");
+    return NULL;
+  }
+  store->stream = stream;
+  return store;
+}
+
+/*
+ * Update the length of a stream store with the data received so
+ * far.  Returns 1 while the stream is still open, 0 when it ended
+ * and -1 if it ended with an error.
+ */
+int hed_store_poll_stream(struct hed_store *store)
+{
+  struct hed_stream *stream = store->stream;
+  bool ended = atomic_load(&stream->ended);
+  atomic_store(&store->len, atomic_load(&stream->avail));
+  if (! ended)
+    return 1;
+  return (atomic_load(&stream->failed)) ? -1 : 0;
+}
+
+void hed_free_store(struct hed_store *store)
+{
+  switch (store->type) {
+  case HED_STORE_MEMORY:
+    if (store->data_mapped)
+      munmap(store->data, store->len);
+    else
+      free(store->data);
+    break;
+
+  case HED_STORE_MAPPED:
+    munmap(store->data, store->len);
+    break;
+
+  case HED_STORE_PAGED:
+    pthread_mutex_lock(&page_cache_lock);
+    cancel_prefetch(store);
+    drop_store_pages(store);
+    pthread_mutex_unlock(&page_cache_lock);
+    break;
+
+  case HED_STORE_STREAM:
+    free_stream(store->stream);
+    pthread_mutex_lock(&page_cache_lock);
+    drop_store_pages(store);
+    pthread_mutex_unlock(&page_cache_lock);
+    break;
+  }
+  if (store->holes)
+    free_hole_map(store->holes);
+  if (store->watch_fd >= 0)
+    close(store->watch_fd);
+  if (store->fd >= 0)
+    close(store->fd);
+  free(store);
+}
+
+/*
+ * Get a pointer to the data at offset 'off' and return the number
+ * of bytes that can be read contiguously from it.  For paged stores
+ * the pointer is only valid until the next call, since the page may
+ * then be evicted.
+ */
+size_t hed_store_get_span(struct hed_store *store, size_t off, const uint8_t **data)
+{
+  size_t avail = get_store_avail(store);
+  if (off >= avail)
+    return 0;
+
+  if (store->holes) {
+    bool is_hole;
+    size_t run = hed_store_get_run(store, off, &is_hole);
+    if (is_hole) {
+      *data = zero_page;
+      return (run < sizeof(zero_page)) ? run : sizeof(zero_page);
+    }
+  }
+
+  switch (store->type) {
+  case HED_STORE_MEMORY:
+  case HED_STORE_MAPPED:
+    *data = store->data + off;
+    return atomic_load(&store->len) - off;
+
+  case HED_STORE_PAGED:
+  case HED_STORE_STREAM:
+    {
+      pthread_mutex_lock(&page_cache_lock);
+      if (pinned_page) {
+        pinned_page->pins--;
+        pinned_page = NULL;
+      }
+      struct hed_page *page = get_page(store, off / HED_PAGE_SIZE);
+      if (page) {
+        page->pins++;
+        pinned_page = page;
+      }
+      pthread_mutex_unlock(&page_cache_lock);
+      if (! page)
+        return 0;
+      *data = page->data + off % HED_PAGE_SIZE;
+      return page->len - off % HED_PAGE_SIZE;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Prepare the calling thread to read from stores in the background:
+ * read errors are counted instead of shown, since only the main
+ * thread may touch the screen.
+ */
+void hed_store_enter_thread(void)
+{
+  quiet_read_errors = true;
+  num_read_errors = 0;
+}
+
+/*
+ * Return true if there were read errors in the calling thread since
+ * hed_store_enter_thread().
+ */
+bool hed_store_had_read_errors(void)
+{
+  return num_read_errors > 0;
+}
+
+/*
+ * Release the page pinned by the calling thread before it exits.
+ */
+void hed_store_leave_thread(void)
+{
+  pthread_mutex_lock(&page_cache_lock);
+  if (pinned_page) {
+    pinned_page->pins--;
+    pinned_page = NULL;
+  }
+  pthread_mutex_unlock(&page_cache_lock);
+}
+
+/*
+ * Start reading 'len' bytes at offset 'off' of a file store in the
+ * background, so they're ready when they're looked at.  Mapped files
+ * are left to the kernel's readahead; paged files are read into the
+ * page cache by the prefetch thread (but never more than half of it,
+ * so the prefetched pages don't push out the ones being used).
+ * Stores without a file are ignored.
+ */
+void hed_store_prefetch(struct hed_store *store, size_t off, size_t len)
+{
+  if (off >= store->len || len == 0)
+    return;
+  if (len > store->len - off)
+    len = store->len - off;
+
+  switch (store->type) {
+  case HED_STORE_MEMORY:
+  case HED_STORE_STREAM:
+    break;
+
+  case HED_STORE_MAPPED:
+    {
+      size_t page_size = sysconf(_SC_PAGESIZE);
+      size_t start = off / page_size * page_size;
+      madvise(store->data + start, off + len - start, MADV_WILLNEED);
+    }
+    break;
+
+  case HED_STORE_PAGED:
+    {
+      size_t max_len = page_cache.max_pages / 2 * HED_PAGE_SIZE;
+      if (len > max_len)
+        len = max_len;
+      posix_fadvise(store->fd, off, len, POSIX_FADV_WILLNEED);
+
+      pthread_mutex_lock(&page_cache_lock);
+      if (! prefetcher.started) {
+        pthread_t thread;
+        if (init_page_cache() < 0 || pthread_create(&thread, NULL, prefetch_thread, NULL) != 0) {
+          pthread_mutex_unlock(&page_cache_lock);
+          return;
+        }
+        pthread_detach(thread);
+        prefetcher.started = true;
+      }
+      if (prefetcher.num_reqs == PREFETCH_QUEUE_LEN) {
+        prefetcher.first = (prefetcher.first + 1) % PREFETCH_QUEUE_LEN;
+        prefetcher.num_reqs--;
+      }
+      struct hed_prefetch_req *req = &prefetcher.queue[(prefetcher.first + prefetcher.num_reqs) % PREFETCH_QUEUE_LEN];
+      req->store = store;
+      req->off = off;
+      req->len = len;
+      prefetcher.num_reqs++;
+      pthread_cond_signal(&prefetcher.wake);
+      pthread_mutex_unlock(&page_cache_lock);
+    }
+    break;
+  }
+}
+
+/*
+ * Tell the system that 'len' bytes at offset 'off' of a file store
+ * won't be needed soon: their pages are dropped from our cache (if
+ * nobody is using them) and from the kernel's.
+ */
+void hed_store_drop(struct hed_store *store, size_t off, size_t len)
+{
+  if (off >= store->len || len == 0)
+    return;
+  if (len > store->len - off)
+    len = store->len - off;
+
+  switch (store->type) {
+  case HED_STORE_MEMORY:
+  case HED_STORE_STREAM:
+    break;
+
+  case HED_STORE_MAPPED:
+    {
+      // only whole pages inside the range
+      size_t page_size = sysconf(_SC_PAGESIZE);
+      size_t start = (off + page_size - 1) / page_size * page_size;
+      size_t end = (off + len) / page_size * page_size;
+      if (start < end)
+        madvise(store->data + start, end - start, MADV_DONTNEED);
+      posix_fadvise(store->fd, off, len, POSIX_FADV_DONTNEED);
+    }
+    break;
+
+  case HED_STORE_PAGED:
+    {
+      size_t first = (off + HED_PAGE_SIZE - 1) / HED_PAGE_SIZE;
+      size_t end = (off + len) / HED_PAGE_SIZE;
+      if (off + len == store->len)
+        end = (store->len + HED_PAGE_SIZE - 1) / HED_PAGE_SIZE;
+      pthread_mutex_lock(&page_cache_lock);
+      for (size_t index = first; index < end; index++) {
+        struct hed_page *page = find_page(store, index);
+        if (page && page->pins == 0)
+          drop_page(page);
+      }
+      pthread_mutex_unlock(&page_cache_lock);
+      posix_fadvise(store->fd, off, len, POSIX_FADV_DONTNEED);
+    }
+    break;
+  }
+}
@@ -0,0 +1,76 @@
+/* store.h */
+
+#ifndef STORE_H_FILE
+#define STORE_H_FILE
+
+#include <sys/types.h>
+
+#include "hed.h"
+
+#define HED_PAGE_SIZE             (64*1024)
+#define HED_DEFAULT_CACHE_SIZE    (64*1024*1024)
+#define HED_DEFAULT_SPILL_SIZE    (256*1024*1024)
+
+enum hed_store_type {
+  HED_STORE_MEMORY,
+  HED_STORE_MAPPED,
+  HED_STORE_PAGED,
+  HED_STORE_STREAM,
+};
+
+struct hed_stream;
+struct hed_extent_set;
+
+typedef void (*hed_load_progress_func)(void *data, size_t done, size_t total, double elapsed);
+
+/*
+ * Store for the original (unmodified) data of a buffer.  The data
+ * can be in memory, mapped from a file, read on demand from a file
+ * through the page cache or still arriving from a stream (in which
+ * case 'len' is the amount received so far).  Memory data is either
+ * malloc()ed or, if 'data_mapped' is set, an anonymous mapping.
+ * Paged stores of followed files ('follow') grow with the file.
+ * 'holes' has the holes of sparse files, which read as zeros without
+ * using any memory.  'len' only changes in the thread that owns the
+ * store (as a stream or followed file grows), but it's read by the
+ * threads that load and search the data, so it's atomic.
+ */
+struct hed_store {
+  enum hed_store_type type;
+  _Atomic size_t len;
+  int fd;
+  bool follow;
+  int watch_fd;
+  dev_t dev;
+  ino_t ino;
+  uint8_t *data;
+  bool data_mapped;
+  struct hed_stream *stream;
+  struct hed_extent_set *holes;
+};
+
+struct hed_store *hed_new_memory_store(uint8_t *data, size_t len);
+struct hed_store *hed_open_file_store(int fd);
+struct hed_store *hed_open_stream_store(int fd);
+struct hed_store *hed_open_process_store(pid_t pid);
+int hed_store_poll_stream(struct hed_store *store);
+bool hed_store_poll_follow(struct hed_store *store);
+void hed_free_store(struct hed_store *store);
+
+size_t hed_store_get_span(struct hed_store *store, size_t off, const uint8_t **data);
+size_t hed_store_get_run(struct hed_store *store, size_t off, bool *is_hole);
+void hed_store_prefetch(struct hed_store *store, size_t off, size_t len);
+void hed_store_drop(struct hed_store *store, size_t off, size_t len);
+void hed_store_refresh(struct hed_store *store);
+void hed_store_enter_thread(void);
+bool hed_store_had_read_errors(void);
+void hed_store_leave_thread(void);
+
+void hed_set_memory_limit(size_t max_bytes);
+void hed_set_stream_spill_size(size_t max_bytes);
+void hed_set_load_into_memory(bool load);
+void hed_set_follow_files(bool follow);
+void hed_set_load_progress_func(hed_load_progress_func func, void *data);
+size_t hed_get_cache_usage(void);
+
+#endif /* STORE_H_FILE */
@@ -0,0 +1,49 @@
+/* test.c */
+
+#include <stdarg.h>
+
+#include "test.h"
+#include "screen.h"
+
+int test_failures;
+
+static uint32_t random_state = 1;
+
+void test_seed_random(uint32_t seed)
+{
+  random_state = (seed != 0) ? seed : 1;
+}
+
+uint32_t test_random(void)
+{
+  // xorshift32
+  uint32_t x = random_state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  random_state = x;
+  return x;
+}
+
+/*
+ * Print the result of a test program and return its exit status.
+ */
+int test_report(const char *name)
+{
+  if (test_failures > 0) {
+    printf("%s: %d checks failed\n", name, test_failures);
+    return 1;
+  }
+  printf("%s: ok\n", name);
+  return 0;
+}
+
+/*
+ * The library code reports errors through the screen, which the
+ * tests don't have.
+ */
+int hed_scr_show_msg(const char *fmt, ...)
+{
+  UNUSED(fmt);
+  return -1;
+}
@@ -0,0 +1,29 @@
+/* test.h */
+
+#ifndef TEST_H_FILE
+#define TEST_H_FILE
+
+#include <stdio.h>
+
+#include "hed.h"
+
+/*
+ * Minimal support for the unit tests: CHECK() reports a failed
+ * condition and counts it, and test_random() gives the same sequence
+ * of numbers on every run.
+ */
+#define CHECK(cond)                                                     \
+  do {                                                                  \
+    if (! (cond)) {                                                     \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      test_failures++;                                                  \
+    }                                                                   \
+  } while (0)
+
+extern int test_failures;
+
+void test_seed_random(uint32_t seed);
+uint32_t test_random(void);
+int test_report(const char *name);
+
+#endif /* TEST_H_FILE */
@@ -0,0 +1,195 @@
+/* test_buffer.c */
+
+#include <string.h>
+
+#include "test.h"
+#include "buffer.h"
+#include "store.h"
+
+#define MAX_STATES  64
+
+/*
+ * The data the buffer should have after each of the changes that can
+ * be undone: 'states[n]' is the data when 'undo_pos' is 'n'.
+ */
+struct state {
+  uint8_t *data;
+  size_t len;
+};
+
+static struct state states[MAX_STATES];
+
+static void set_state(size_t num, const uint8_t *data, size_t len)
+{
+  free(states[num].data);
+  states[num].data = malloc((len > 0) ? len : 1);
+  memcpy(states[num].data, data, len);
+  states[num].len = len;
+}
+
+static void free_states(void)
+{
+  for (size_t i = 0; i < MAX_STATES; i++) {
+    free(states[i].data);
+    states[i].data = NULL;
+  }
+}
+
+static bool has_data(struct hed_buffer *buf, const uint8_t *data, size_t len)
+{
+  if (buf->len != len)
+    return false;
+  uint8_t *buf_data = malloc((len > 0) ? len : 1);
+  bool same = hed_buffer_read(buf, 0, buf_data, len) == len && memcmp(buf_data, data, len) == 0;
+  free(buf_data);
+  return same;
+}
+
+static struct hed_buffer *new_test_buffer(const char *str)
+{
+  size_t len = strlen(str);
+  uint8_t *data = malloc(len);
+  memcpy(data, str, len);
+  return hed_new_buffer(hed_new_memory_store(data, len));
+}
+
+/*
+ * Typing consecutive bytes (and overwriting the second nibble of one)
+ * makes a single undo entry, which is undone and redone as a whole.
+ */
+static void test_merge(void)
+{
+  static const char orig[] = "0123456789abcdef";
+  struct hed_buffer *buf = new_test_buffer(orig);
+  for (size_t i = 0; i < 5; i++)
+    hed_buffer_insert(buf, 4 + i, (const uint8_t *) "xyzzy" + i, 1);
+  hed_buffer_replace(buf, 8, 1, (const uint8_t *) "Y", 1);
+  CHECK(buf->undo_len == 1);
+  static const char typed[] = "0123xyzzY456789abcdef";
+  CHECK(has_data(buf, (const uint8_t *) typed, strlen(typed)));
+
+  // overwriting a range that starts before the typed bytes and ends after them
+  hed_buffer_replace(buf, 2, 9, (const uint8_t *) "--", 2);
+  CHECK(buf->undo_len == 1);
+  static const char changed[] = "01--6789abcdef";
+  CHECK(has_data(buf, (const uint8_t *) changed, strlen(changed)));
+
+  size_t pos;
+  for (int i = 0; i < 3; i++) {
+    CHECK(hed_buffer_undo(buf, &pos) == 1 && pos == 2);
+    CHECK(has_data(buf, (const uint8_t *) orig, strlen(orig)));
+    CHECK(hed_buffer_undo(buf, &pos) == 0);
+    CHECK(hed_buffer_redo(buf, &pos) == 1 && pos == 2);
+    CHECK(has_data(buf, (const uint8_t *) changed, strlen(changed)));
+    CHECK(hed_buffer_redo(buf, &pos) == 0);
+  }
+
+  // a deletion after an undo or redo is not merged into the entry
+  hed_buffer_delete(buf, 0, 2);
+  CHECK(buf->undo_len == 2);
+  CHECK(hed_buffer_undo(buf, &pos) == 1);
+  CHECK(has_data(buf, (const uint8_t *) changed, strlen(changed)));
+  hed_free_buffer(buf);
+}
+
+/*
+ * Data inserted in several steps that cross the border between two
+ * chunks of the add buffer: the merged undo entry must not join
+ * references to different chunks.
+ */
+static void test_add_chunks(void)
+{
+  struct hed_buffer *buf = new_test_buffer("ab");
+  size_t fill_len = HED_ADD_CHUNK_SIZE - 1000;
+  size_t len = 3000;
+  uint8_t *data = malloc(2 + len + fill_len);
+  for (size_t i = 0; i < 2 + len + fill_len; i++)
+    data[i] = test_random();
+  data[0] = 'a';
+  data[1 + len] = 'b';
+  hed_buffer_insert(buf, 2, data + 2 + len, fill_len);
+  for (size_t done = 0; done < len; ) {
+    size_t n = 1 + test_random() % 300;
+    if (n > len - done)
+      n = len - done;
+    hed_buffer_insert(buf, 1 + done, data + 1 + done, n);
+    done += n;
+  }
+  CHECK(buf->undo_len == 2);
+  CHECK(has_data(buf, data, 2 + len + fill_len));
+
+  size_t pos;
+  for (int i = 0; i < 3; i++) {
+    CHECK(hed_buffer_undo(buf, &pos) == 1 && pos == 1);
+    CHECK(buf->len == 2 + fill_len);
+    CHECK(hed_buffer_redo(buf, &pos) == 1);
+    CHECK(has_data(buf, data, 2 + len + fill_len));
+  }
+  free(data);
+  hed_free_buffer(buf);
+}
+
+/*
+ * Random changes, many of them next to the last one so they're
+ * merged, mixed with undo and redo, checked against a copy of the
+ * data at each point of the history.
+ */
+static void test_random_history(void)
+{
+  size_t cap = 4 * HED_ADD_CHUNK_SIZE;
+  uint8_t *model = malloc(cap);
+  size_t model_len = 1000;
+  for (size_t i = 0; i < model_len; i++)
+    model[i] = test_random();
+  uint8_t *orig = malloc(model_len);
+  memcpy(orig, model, model_len);
+  struct hed_buffer *buf = hed_new_buffer(hed_new_memory_store(orig, model_len));
+  set_state(0, model, model_len);
+
+  size_t last_pos = 0;
+  uint8_t data[8192];
+  for (int i = 0; i < 3000; i++) {
+    uint32_t op = test_random() % 10;
+    size_t pos;
+    if (op == 0) {
+      hed_buffer_undo(buf, &pos);
+    } else if (op == 1) {
+      hed_buffer_redo(buf, &pos);
+    } else {
+      memcpy(model, states[buf->undo_pos].data, states[buf->undo_pos].len);
+      model_len = states[buf->undo_pos].len;
+      pos = (test_random() % 3 != 0 && last_pos <= model_len) ? last_pos : test_random() % (model_len + 1);
+      size_t del_len = (test_random() % 2) ? test_random() % 4 : 0;
+      size_t len = (test_random() % 20 == 0) ? test_random() % sizeof(data) : test_random() % 3;
+      if (del_len > model_len - pos)
+        del_len = model_len - pos;
+      if (model_len - del_len + len > cap || buf->undo_len >= MAX_STATES - 1)
+        continue;
+      for (size_t j = 0; j < len; j++)
+        data[j] = test_random();
+      CHECK(hed_buffer_replace(buf, pos, del_len, data, len) == 0);
+      memmove(model + pos + len, model + pos + del_len, model_len - pos - del_len);
+      memcpy(model + pos, data, len);
+      model_len += len - del_len;
+      set_state(buf->undo_pos, model, model_len);
+      last_pos = pos + len;
+    }
+    struct state *state = &states[buf->undo_pos];
+    if (! has_data(buf, state->data, state->len)) {
+      CHECK(false);
+      fprintf(stderr, "  step %d: data doesn't match state %zu of %zu\n", i, buf->undo_pos, buf->undo_len);
+      break;
+    }
+  }
+  free(model);
+  free_states();
+  hed_free_buffer(buf);
+}
+
+int main(void)
+{
+  test_merge();
+  test_add_chunks();
+  test_random_history();
+  return test_report("test_buffer");
+}
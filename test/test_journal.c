@@ -0,0 +1,260 @@
+/* test_journal.c */
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "test.h"
+#include "buffer.h"
+#include "store.h"
+#include "journal.h"
+
+#define ORIG_LEN  2000
+
+static char dir[] = "/tmp/hed-test-XXXXXX";
+static char filename[64];
+static char journal_filename[64];
+static uint8_t orig[ORIG_LEN];
+
+static struct hed_buffer *new_orig_buffer(void)
+{
+  uint8_t *data = malloc(ORIG_LEN);
+  memcpy(data, orig, ORIG_LEN);
+  return hed_new_buffer(hed_new_memory_store(data, ORIG_LEN));
+}
+
+static bool same_data(struct hed_buffer *a, struct hed_buffer *b)
+{
+  if (a->len != b->len)
+    return false;
+  uint8_t *data_a = malloc(a->len + 1);
+  uint8_t *data_b = malloc(b->len + 1);
+  hed_buffer_read(a, 0, data_a, a->len);
+  hed_buffer_read(b, 0, data_b, b->len);
+  bool same = memcmp(data_a, data_b, a->len) == 0;
+  free(data_a);
+  free(data_b);
+  return same;
+}
+
+static size_t file_size(const char *name)
+{
+  struct stat st;
+  if (stat(name, &st) < 0)
+    return 0;
+  return st.st_size;
+}
+
+/*
+ * Make a change to the buffer and record it like
+ * hed_replace_file_data() does.
+ */
+static void replace(struct hed_buffer *buf, struct hed_journal *journal, size_t pos, size_t del_len, const char *str)
+{
+  size_t undo_pos = buf->undo_pos;
+  size_t len = strlen(str);
+  CHECK(hed_buffer_replace(buf, pos, del_len, (const uint8_t *) str, len) == 0);
+  bool merged = (buf->undo_pos == undo_pos && undo_pos > 0);
+  CHECK(hed_journal_replace(journal, pos, del_len, (const uint8_t *) str, len, merged) == 0);
+}
+
+static void undo(struct hed_buffer *buf, struct hed_journal *journal, bool redo)
+{
+  size_t pos;
+  CHECK(((redo) ? hed_buffer_redo(buf, &pos) : hed_buffer_undo(buf, &pos)) == 1);
+  CHECK(hed_journal_undo(journal, redo) == 0);
+}
+
+/*
+ * Replay the journal left for the file into a new buffer, and check
+ * that it has the data of 'expected' and the journal is cut to
+ * 'journal_len' bytes.
+ */
+static void check_replay(struct hed_buffer *expected, int expected_changes, size_t journal_len)
+{
+  int fd = open(filename, O_RDONLY);
+  CHECK(fd >= 0);
+  struct hed_journal *journal = hed_open_journal(filename, fd);
+  close(fd);
+  CHECK(journal != NULL);
+  if (! journal)
+    return;
+  struct hed_buffer *buf = new_orig_buffer();
+  size_t pos = 0;
+  int num_changes = hed_replay_journal(journal, buf, &pos);
+  CHECK(num_changes == expected_changes);
+  CHECK(same_data(buf, expected));
+  CHECK(hed_journal_size(journal) == journal_len);
+  CHECK(file_size(journal_filename) == journal_len);
+  hed_close_journal(journal, false);
+  hed_free_buffer(buf);
+}
+
+/*
+ * A journal with merged records, undo and redo replays to the same
+ * data.  If the last record is torn or damaged (hed died while it was
+ * written), the records before it are replayed and it's cut off, and
+ * new records go after them.
+ */
+static void test_replay(void)
+{
+  struct stat st;
+  CHECK(stat(filename, &st) == 0);
+  struct hed_journal *journal = hed_create_journal(filename, &st);
+  CHECK(journal != NULL);
+  if (! journal)
+    return;
+  struct hed_buffer *buf = new_orig_buffer();
+  replace(buf, journal, 10, 0, "a");
+  replace(buf, journal, 11, 0, "b");
+  replace(buf, journal, 11, 1, "B");
+  replace(buf, journal, 500, 30, "");
+  undo(buf, journal, false);
+  undo(buf, journal, true);
+  undo(buf, journal, false);
+  replace(buf, journal, 1000, 4, "wxyz");
+  int num_changes = 7;
+  size_t good_len = hed_journal_size(journal);
+  CHECK(file_size(journal_filename) == good_len);
+
+  // the last record, which will be torn
+  struct hed_buffer *last_buf = new_orig_buffer();
+  replace(buf, journal, 1500, 2, "torn record");
+  size_t full_len = hed_journal_size(journal);
+  hed_close_journal(journal, false);
+  hed_free_buffer(buf);
+
+  // the same changes without the last one
+  buf = new_orig_buffer();
+  size_t pos;
+  hed_buffer_replace(buf, 10, 0, (const uint8_t *) "aB", 2);
+  hed_buffer_replace(buf, 500, 30, NULL, 0);
+  hed_buffer_undo(buf, &pos);
+  hed_buffer_replace(buf, 1000, 4, (const uint8_t *) "wxyz", 4);
+  hed_buffer_replace(last_buf, 10, 0, (const uint8_t *) "aB", 2);
+  hed_buffer_replace(last_buf, 1000, 4, (const uint8_t *) "wxyz", 4);
+  hed_buffer_replace(last_buf, 1500, 2, (const uint8_t *) "torn record", 11);
+
+  uint8_t *journal_data = malloc(full_len);
+  int fd = open(journal_filename, O_RDWR);
+  CHECK(fd >= 0 && pread(fd, journal_data, full_len, 0) == (ssize_t) full_len);
+  check_replay(last_buf, num_changes + 1, full_len);
+  for (size_t cut = good_len + 1; cut < full_len; cut += 7) {
+    CHECK(pwrite(fd, journal_data, full_len, 0) == (ssize_t) full_len && ftruncate(fd, cut) == 0);
+    check_replay(buf, num_changes, good_len);
+  }
+
+  // a damaged byte in the data of the last record
+  journal_data[full_len - 1] ^= 1;
+  CHECK(pwrite(fd, journal_data, full_len, 0) == (ssize_t) full_len);
+  check_replay(buf, num_changes, good_len);
+  journal_data[full_len - 1] ^= 1;
+  close(fd);
+
+  // a new change after the torn record was cut off
+  fd = open(filename, O_RDONLY);
+  journal = hed_open_journal(filename, fd);
+  close(fd);
+  CHECK(journal != NULL);
+  if (journal) {
+    struct hed_buffer *replayed = new_orig_buffer();
+    CHECK(hed_replay_journal(journal, replayed, &pos) == num_changes);
+    replace(replayed, journal, 0, 1, "new");
+    hed_buffer_replace(buf, 0, 1, (const uint8_t *) "new", 3);
+    hed_close_journal(journal, false);
+    hed_free_buffer(replayed);
+    check_replay(buf, num_changes + 1, file_size(journal_filename));
+  }
+  free(journal_data);
+  hed_free_buffer(buf);
+  hed_free_buffer(last_buf);
+}
+
+/*
+ * A snapshot (taken by a search or a save) ends the undo entry, so an
+ * adjacent change after it is undone on its own.  Replaying the
+ * journal must give the same undo history.
+ */
+static void test_undo_entries(void)
+{
+  struct stat st;
+  CHECK(stat(filename, &st) == 0);
+  struct hed_journal *journal = hed_create_journal(filename, &st);
+  CHECK(journal != NULL);
+  if (! journal)
+    return;
+  struct hed_buffer *buf = new_orig_buffer();
+  replace(buf, journal, 0, 1, "A");
+  hed_free_snapshot(hed_buffer_snapshot(buf));
+  replace(buf, journal, 1, 1, "B");
+  replace(buf, journal, 2, 1, "C");
+  hed_close_journal(journal, false);
+
+  int fd = open(filename, O_RDONLY);
+  journal = hed_open_journal(filename, fd);
+  close(fd);
+  CHECK(journal != NULL);
+  if (journal) {
+    struct hed_buffer *replayed = new_orig_buffer();
+    size_t pos;
+    CHECK(hed_replay_journal(journal, replayed, &pos) == 3);
+    CHECK(replayed->undo_len == 2);
+    for (int i = 0; i < 2; i++) {
+      CHECK(hed_buffer_undo(buf, &pos) == 1);
+      CHECK(hed_buffer_undo(replayed, &pos) == 1);
+      CHECK(same_data(buf, replayed));
+    }
+    hed_close_journal(journal, false);
+    hed_free_buffer(replayed);
+  }
+  hed_free_buffer(buf);
+}
+
+/*
+ * Remove the files made by the tests (the data file and any journal
+ * left in the directory) and the directory.
+ */
+static void remove_test_files(void)
+{
+  DIR *d = opendir(dir);
+  if (d) {
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+      if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+        continue;
+      char name[sizeof(dir) + 256];
+      snprintf(name, sizeof(name), "%s/%s", dir, ent->d_name);
+      unlink(name);
+    }
+    closedir(d);
+  }
+  rmdir(dir);
+}
+
+int main(void)
+{
+  if (! mkdtemp(dir)) {
+    perror(dir);
+    return 1;
+  }
+  snprintf(filename, sizeof(filename), "%s/data", dir);
+  snprintf(journal_filename, sizeof(journal_filename), "%s/.data.hedj", dir);
+  for (size_t i = 0; i < ORIG_LEN; i++)
+    orig[i] = test_random();
+  int fd = open(filename, O_WRONLY | O_CREAT, 0600);
+  bool written = fd >= 0 && write(fd, orig, ORIG_LEN) == ORIG_LEN;
+  CHECK(written);
+  if (fd >= 0)
+    close(fd);
+  if (! written)
+    goto out;
+
+  test_replay();
+  test_undo_entries();
+
+ out:
+  remove_test_files();
+  return test_report("test_journal");
+}
@@ -0,0 +1,436 @@
+/* test_search.c */
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "test.h"
+#include "buffer.h"
+#include "store.h"
+#include "search.h"
+
+static const char *cpu_names[] = { "scalar", "sse2", "avx2", "avx512" };
+
+/*
+ * The buffer being searched, and a copy of its data to check the
+ * results against.
+ */
+static struct hed_buffer *buf;
+static uint8_t *ref;
+static size_t ref_len;
+
+static void set_buffer(struct hed_buffer *new_buf)
+{
+  if (buf && buf != new_buf)
+    hed_free_buffer(buf);
+  free(ref);
+  buf = new_buf;
+  ref_len = buf->len;
+  ref = malloc(ref_len);
+  hed_buffer_read(buf, 0, ref, ref_len);
+}
+
+static bool overlaps_hole(size_t pos, size_t len)
+{
+  const struct hed_extent_set *holes = hed_buffer_get_holes(buf);
+  for (size_t i = 0; i < holes->num_extents; i++) {
+    if (holes->extents[i].pos < pos + len && pos < holes->extents[i].pos + holes->extents[i].len)
+      return true;
+  }
+  return false;
+}
+
+static bool matches_at(const uint8_t *bytes, const uint8_t *mask, size_t len, size_t pos)
+{
+  for (size_t i = 0; i < len; i++) {
+    uint8_t m = (mask) ? mask[i] : 0xff;
+    if ((ref[pos + i] & m) != (bytes[i] & m))
+      return false;
+  }
+  return true;
+}
+
+/*
+ * Search the copy of the data one position at a time.
+ */
+static int naive_search(const uint8_t *bytes, const uint8_t *mask, size_t len, size_t pos, bool backward,
+                        bool match_holes, size_t *match_pos)
+{
+  if (len > ref_len)
+    return 0;
+  if (! backward) {
+    for (size_t p = pos; p + len <= ref_len; p++) {
+      if (matches_at(bytes, mask, len, p) && (match_holes || ! overlaps_hole(p, len))) {
+        *match_pos = p;
+        return 1;
+      }
+    }
+    return 0;
+  }
+  for (size_t p = (pos < ref_len - len) ? pos : ref_len - len; ; p--) {
+    if (matches_at(bytes, mask, len, p) && (match_holes || ! overlaps_hole(p, len))) {
+      *match_pos = p;
+      return 1;
+    }
+    if (p == 0)
+      return 0;
+  }
+}
+
+/*
+ * Search with the engine and with naive_search() and check that both
+ * find the same thing.
+ */
+static void check_search(const uint8_t *bytes, const uint8_t *mask, size_t len, size_t pos, bool backward, bool match_holes)
+{
+  struct hed_pattern *pat = hed_new_pattern(bytes, mask, len);
+  CHECK(pat != NULL);
+  if (! pat)
+    return;
+  size_t found_pos = 0, want_pos = 0;
+  int found = hed_finish_search(hed_start_search(buf, pat, pos, backward, match_holes), &found_pos);
+  int want = naive_search(bytes, mask, len, pos, backward, match_holes, &want_pos);
+  CHECK(found == want);
+  if (found == want && found > 0)
+    CHECK(found_pos == want_pos);
+  if (found != want || found_pos != want_pos)
+    fprintf(stderr, "  len=%zu pos=%zu backward=%d: found %d at %zu, expected %d at %zu\n",
+            len, pos, backward, found, found_pos, want, want_pos);
+  hed_free_pattern(pat);
+}
+
+/*
+ * Make a pattern of 'len' bytes, either copied from the data (so it's
+ * found) or made of the bytes the data has.
+ */
+static void make_pattern(uint8_t *bytes, size_t len)
+{
+  if (test_random() % 2 == 0) {
+    memcpy(bytes, ref + test_random() % (ref_len - len + 1), len);
+    return;
+  }
+  for (size_t i = 0; i < len; i++)
+    bytes[i] = "ab\0"[test_random() % 3];
+}
+
+static size_t random_pattern_len(void)
+{
+  return (test_random() % 4 == 0) ? 1 + test_random() % 80 : 1 + test_random() % 8;
+}
+
+/*
+ * Data made of a few different bytes (so there are many partial
+ * matches), edited so it's split in pieces.
+ */
+static struct hed_buffer *new_test_buffer(size_t len)
+{
+  uint8_t *data = malloc(len);
+  for (size_t i = 0; i < len; i++)
+    data[i] = "aab\0"[test_random() % 4];
+  struct hed_buffer *new_buf = hed_new_buffer(hed_new_memory_store(data, len));
+  for (int i = 0; i < 50; i++) {
+    uint8_t bytes[16];
+    size_t n = 1 + test_random() % sizeof(bytes);
+    for (size_t j = 0; j < n; j++)
+      bytes[j] = "abc"[test_random() % 3];
+    hed_buffer_replace(new_buf, test_random() % new_buf->len, test_random() % 4, bytes, n);
+  }
+  return new_buf;
+}
+
+/*
+ * Compare every kernel, with one and several threads, against the
+ * naive search, forward and backward.
+ */
+static void test_kernels(void)
+{
+  set_buffer(new_test_buffer(10 * HED_SEARCH_PARALLEL_CHUNK + 123));
+  for (size_t c = 0; c < sizeof(cpu_names)/sizeof(cpu_names[0]); c++) {
+    if (hed_set_search_cpu(cpu_names[c]) < 0) {
+      printf("  %s kernels not supported, skipped\n", cpu_names[c]);
+      continue;
+    }
+    for (unsigned int threads = 1; threads <= 4; threads += 3) {
+      hed_set_search_threads(threads);
+      for (int i = 0; i < 300; i++) {
+        uint8_t bytes[80];
+        size_t len = random_pattern_len();
+        make_pattern(bytes, len);
+        check_search(bytes, NULL, len, test_random() % ref_len, test_random() % 2, true);
+      }
+    }
+  }
+  hed_set_search_cpu("auto");
+}
+
+/*
+ * Matches that cross the borders between the chunks searched by
+ * different threads, and the nearest of several matches in different
+ * chunks.
+ */
+static void test_chunk_borders(void)
+{
+  set_buffer(new_test_buffer(8 * HED_SEARCH_PARALLEL_CHUNK));
+  hed_set_search_threads(4);
+  for (size_t chunk = 1; chunk < 8; chunk++) {
+    size_t border = chunk * HED_SEARCH_PARALLEL_CHUNK;
+    for (size_t len = 2; len <= 40; len += 19) {
+      for (size_t before = 1; before < len; before += len / 2) {
+        const uint8_t *bytes = ref + border - before;
+        check_search(bytes, NULL, len, border - HED_SEARCH_PARALLEL_CHUNK / 2, false, true);
+        check_search(bytes, NULL, len, border - before, false, true);
+        check_search(bytes, NULL, len, border + HED_SEARCH_PARALLEL_CHUNK / 2, true, true);
+        check_search(bytes, NULL, len, border - before, true, true);
+      }
+    }
+  }
+
+  // a byte sequence that only appears in the first and last chunks
+  static const uint8_t unique[] = "unique";
+  size_t len = sizeof(unique) - 1;
+  hed_buffer_replace(buf, 100, len, unique, len);
+  hed_buffer_replace(buf, buf->len - 100, len, unique, len);
+  set_buffer(buf);
+  check_search(unique, NULL, len, 0, false, true);
+  check_search(unique, NULL, len, 101, false, true);
+  check_search(unique, NULL, len, ref_len - 1, true, true);
+  check_search(unique, NULL, len, ref_len - 101, true, true);
+  hed_set_search_threads(0);
+}
+
+/*
+ * Holes of a sparse file match zeros, except when 'match_holes' is not
+ * set, and then no match may overlap a hole.
+ */
+static void test_holes(void)
+{
+  // the file is removed at once, so nothing is left behind if the
+  // test fails or crashes
+  char filename[] = "/tmp/hed-test-XXXXXX";
+  int fd = mkstemp(filename);
+  CHECK(fd >= 0);
+  if (fd < 0)
+    return;
+  unlink(filename);
+  size_t hole_size = 256 * 1024;
+  uint8_t data[8192];
+  for (size_t i = 0; i < sizeof(data); i++)
+    data[i] = (i % 7 == 0) ? 0 : "ab"[test_random() % 2];
+  for (size_t i = 0; i < 3; i++) {
+    if (pwrite(fd, data, sizeof(data), i * (sizeof(data) + hole_size)) != sizeof(data)) {
+      CHECK(false);
+      close(fd);
+      return;
+    }
+  }
+  struct hed_store *store = hed_open_file_store(fd);
+  CHECK(store != NULL);
+  if (! store) {
+    close(fd);
+    return;
+  }
+  set_buffer(hed_new_buffer(store));
+  if (hed_buffer_get_holes(buf)->num_extents == 0)
+    printf("  the filesystem doesn't report holes\n");
+
+  hed_set_search_threads(4);
+  for (int i = 0; i < 300; i++) {
+    uint8_t bytes[80];
+    size_t len = random_pattern_len();
+    make_pattern(bytes, len);
+    if (i % 3 == 0)
+      memset(bytes, 0, len / 2);
+    size_t pos = (test_random() % 2) ? test_random() % ref_len : sizeof(data) + (test_random() % 2) * hole_size;
+    check_search(bytes, NULL, len, pos, test_random() % 2, test_random() % 2);
+  }
+  hed_set_search_threads(0);
+}
+
+/*
+ * Hex digits with '?' for any nibble, separated or not.
+ */
+static void test_parse_bytes(void)
+{
+  uint8_t bytes[8], mask[8];
+  CHECK(hed_parse_search_bytes(bytes, mask, sizeof(bytes), "4D 5A ?? ?? 50 45") == 6);
+  CHECK(memcmp(bytes, "\x4d\x5a\x00\x00\x50\x45", 6) == 0);
+  CHECK(memcmp(mask, "\xff\xff\x00\x00\xff\xff", 6) == 0);
+
+  CHECK(hed_parse_search_bytes(bytes, mask, sizeof(bytes), "e?,8b") == 2);
+  CHECK(bytes[0] == 0xe0 && mask[0] == 0xf0);
+  CHECK(bytes[1] == 0x8b && mask[1] == 0xff);
+  CHECK(hed_parse_search_bytes(bytes, mask, sizeof(bytes), "?F") == 1);
+  CHECK(bytes[0] == 0x0f && mask[0] == 0x0f);
+  CHECK(hed_parse_search_bytes(bytes, mask, sizeof(bytes), "????") == 2);
+  CHECK(mask[0] == 0 && mask[1] == 0);
+  CHECK(hed_parse_search_bytes(bytes, mask, sizeof(bytes), " 00 ff ") == 2);
+  CHECK(bytes[0] == 0x00 && bytes[1] == 0xff);
+
+  // odd number of digits, invalid characters, too long or empty
+  CHECK(hed_parse_search_bytes(bytes, mask, sizeof(bytes), "4D 5") == 0);
+  CHECK(hed_parse_search_bytes(bytes, mask, sizeof(bytes), "4 ") == 0);
+  CHECK(hed_parse_search_bytes(bytes, mask, sizeof(bytes), "?") == 0);
+  CHECK(hed_parse_search_bytes(bytes, mask, sizeof(bytes), "4G") == 0);
+  CHECK(hed_parse_search_bytes(bytes, mask, sizeof(bytes), "0x4D") == 0);
+  CHECK(hed_parse_search_bytes(bytes, mask, sizeof(bytes), "00 11 22 33 44 55 66 77") == 8);
+  CHECK(hed_parse_search_bytes(bytes, mask, sizeof(bytes), "00 11 22 33 44 55 66 77 88") == 0);
+  CHECK(hed_parse_search_bytes(bytes, mask, sizeof(bytes), "") == 0);
+  CHECK(hed_parse_search_bytes(bytes, mask, sizeof(bytes), " , ") == 0);
+}
+
+/*
+ * Search for a pattern given as a hex list.
+ */
+static void check_hex_search(const char *str, size_t pos, bool backward)
+{
+  uint8_t bytes[32], mask[32];
+  size_t len = hed_parse_search_bytes(bytes, mask, sizeof(bytes), str);
+  CHECK(len > 0);
+  if (len > 0)
+    check_search(bytes, mask, len, pos, backward, true);
+}
+
+/*
+ * Patterns with wildcards, which use their own kernels: random masks,
+ * wildcards at the ends of the pattern and the data, and patterns
+ * where every byte has a wildcard.
+ */
+static void test_masks(void)
+{
+  static const uint8_t mask_bytes[] = { 0xff, 0xff, 0xff, 0xf0, 0x0f, 0x00 };
+  static const char *const hex_patterns[] = {
+    "?? 61", "61 ??", "?? 61 ??", "?1 6?", "?? ??", "??", "?0", "0?",
+    "61 ?? ?? 62", "?? ?? ?? ?? ?? ?? ?? ?? ?? ?? ?? ?? ?? ?? ?? ?? ?? 62",
+  };
+  set_buffer(new_test_buffer(6 * HED_SEARCH_PARALLEL_CHUNK + 77));
+  for (size_t c = 0; c < sizeof(cpu_names)/sizeof(cpu_names[0]); c++) {
+    if (hed_set_search_cpu(cpu_names[c]) < 0)
+      continue;
+    hed_set_search_threads(4);
+    for (int i = 0; i < 300; i++) {
+      uint8_t bytes[80], mask[80];
+      size_t len = random_pattern_len();
+      make_pattern(bytes, len);
+      for (size_t j = 0; j < len; j++)
+        mask[j] = mask_bytes[test_random() % sizeof(mask_bytes)];
+      check_search(bytes, mask, len, test_random() % ref_len, test_random() % 2, true);
+    }
+    for (size_t i = 0; i < sizeof(hex_patterns)/sizeof(hex_patterns[0]); i++) {
+      check_hex_search(hex_patterns[i], 0, false);
+      check_hex_search(hex_patterns[i], ref_len - 1, true);
+      check_hex_search(hex_patterns[i], test_random() % ref_len, test_random() % 2);
+    }
+  }
+
+  // data shorter than a vector, so only the ends are searched
+  for (size_t c = 0; c < sizeof(cpu_names)/sizeof(cpu_names[0]); c++) {
+    if (hed_set_search_cpu(cpu_names[c]) < 0)
+      continue;
+    for (size_t len = 1; len < 100; len += 7) {
+      uint8_t *data = malloc(len);
+      for (size_t i = 0; i < len; i++)
+        data[i] = "ab"[test_random() % 2];
+      set_buffer(hed_new_buffer(hed_new_memory_store(data, len)));
+      for (size_t i = 0; i < sizeof(hex_patterns)/sizeof(hex_patterns[0]); i++) {
+        check_hex_search(hex_patterns[i], 0, false);
+        check_hex_search(hex_patterns[i], len - 1, true);
+      }
+    }
+  }
+  hed_set_search_cpu("auto");
+  hed_set_search_threads(0);
+}
+
+/*
+ * When every byte has a wildcard there's no run of whole bytes, so
+ * the byte with the most bits compared is chosen instead.
+ */
+static void test_anchors(void)
+{
+  static const uint8_t bytes[] = { 0x00, 0x30, 0x00, 0x04 };
+  static const uint8_t mask[] = { 0x00, 0xf0, 0x00, 0x0f };
+  struct hed_pattern *pat = hed_new_pattern(bytes, mask, sizeof(bytes));
+  CHECK(pat != NULL);
+  if (pat) {
+    CHECK(pat->first_len == 1);
+    CHECK(pat->first == 1);
+    CHECK(pat->anchor == 3);
+    hed_free_pattern(pat);
+  }
+
+  static const uint8_t no_bits[3] = { 0 };
+  pat = hed_new_pattern(bytes, no_bits, sizeof(no_bits));
+  CHECK(pat != NULL);
+  if (pat) {
+    CHECK(pat->first_len == 1);
+    CHECK(pat->first < pat->len && pat->anchor < pat->len);
+    size_t off = 99;
+    CHECK(hed_pattern_find(pat, (const uint8_t *) "xyz", 3, false, &off) && off == 0);
+    CHECK(hed_pattern_find(pat, (const uint8_t *) "wxyz", 4, true, &off) && off == 1);
+    CHECK(! hed_pattern_find(pat, (const uint8_t *) "xy", 2, false, &off));
+    hed_free_pattern(pat);
+  }
+
+  static const uint8_t run_bytes[] = { 0x61, 0x61, 0x00, 0x61 };
+  static const uint8_t run_mask[] = { 0xff, 0xff, 0x00, 0xff };
+  pat = hed_new_pattern(run_bytes, run_mask, sizeof(run_bytes));
+  CHECK(pat != NULL);
+  if (pat) {
+    CHECK(pat->first == 0 && pat->first_len == 2);
+    hed_free_pattern(pat);
+  }
+}
+
+/*
+ * The progress of a search grows up to the number of positions, which
+ * it reaches when the search is done, whether or not it finds a match.
+ */
+static void test_progress(void)
+{
+  set_buffer(new_test_buffer(10 * HED_SEARCH_PARALLEL_CHUNK + 5));
+  static const uint8_t missing[] = "xyz";
+  for (unsigned int threads = 1; threads <= 4; threads += 3) {
+    hed_set_search_threads(threads);
+    for (int i = 0; i < 8; i++) {
+      const uint8_t *bytes = (i % 4 < 2) ? missing : ref + test_random() % (ref_len - 3);
+      struct hed_pattern *pat = hed_new_pattern(bytes, NULL, 3);
+      struct hed_search *search = hed_start_search(buf, pat, (i % 2) ? ref_len : 0, i % 2, true);
+      CHECK(search != NULL);
+      if (! search) {
+        hed_free_pattern(pat);
+        continue;
+      }
+      struct hed_search_progress progress;
+      size_t last_done = 0;
+      bool finished;
+      do {
+        finished = hed_search_finished(search);
+        hed_get_search_progress(search, &progress);
+        CHECK(progress.done >= last_done && progress.done <= progress.total);
+        last_done = progress.done;
+      } while (! finished);
+      CHECK(progress.total == ref_len - 2);
+      if (i % 4 < 2)
+        CHECK(progress.done == progress.total);
+      size_t match_pos;
+      hed_finish_search(search, &match_pos);
+      hed_free_pattern(pat);
+    }
+  }
+  hed_set_search_threads(0);
+}
+
+int main(void)
+{
+  test_kernels();
+  test_chunk_borders();
+  test_holes();
+  test_parse_bytes();
+  test_masks();
+  test_anchors();
+  test_progress();
+  if (buf)
+    hed_free_buffer(buf);
+  free(ref);
+  return test_report("test_search");
+}